@@ -21,6 +21,7 @@
 #include "simulation/window.hpp"
 #include "simulation/particles/species.hpp"
 #include "simulation/multilevelgrid/multilevelgrid.hpp"
+#include "simulation/grid/selection.hpp"
 #include "simulation/field/randomfieldgenerator.hpp"
 #include "simulation/field/multilevelfield.hpp"
 #include "simulation/field/evaluator.hpp"
@@ -88,6 +89,15 @@ protected:
   //! Number of gadget files (if in use)
   int nGadgetFiles = 1;
 
+  //! Chunking and filter settings for gadgethdf and swift output
+  io::gadgethdf::HDFWriteOptions hdfWriteOptions;
+
+  //! Back-end used to write gadget, tipsy and grafic output
+  tools::FileWriterOptions fileWriterOptions;
+
+  //! If true, numpy grid dumps are written in single precision
+  bool dumpSinglePrecision = false;
+
   //! DM supersampling to perform on deepest zoom grid
   int supersample = 1;
 
@@ -101,7 +111,8 @@ protected:
   T epsNorm = 0.01075; // Default value arbitrary to coincide with normal UW resolution
 
 
-  io::OutputFormat outputFormat = io::OutputFormat::unknown; //!< Output format used by the code for particle data.
+  io::OutputFormat outputFormat = io::OutputFormat::unknown; //!< Output format the particle mapper is currently set up for.
+  std::vector<io::OutputFormat> outputFormats; //!< All output formats to be written, in order.
   string outputFolder; //!< Name of folder for output files.
   string outputFilename; //!< Name of files for output.
 
@@ -675,6 +686,76 @@ public:
     this->nGadgetFiles = nFiles;
   }
 
+  //! Set the number of particles per HDF5 chunk, which is also the number generated and written at a time (gadgethdf and swift only)
+  void setHDF5ChunkSize(size_t chunkSize) {
+    if (chunkSize == 0)
+      throw std::runtime_error("HDF5 chunk size must be greater than zero");
+    this->hdfWriteOptions.chunkSize = chunkSize;
+  }
+
+  //! Set the size of the chunk cache for each HDF5 dataset in MB (gadgethdf and swift only)
+  void setHDF5ChunkCache(double sizeMB) {
+    this->hdfWriteOptions.chunkCacheBytes = static_cast<size_t>(sizeMB * 1024 * 1024);
+  }
+
+  //! Apply the HDF5 shuffle filter to the particle datasets (gadgethdf and swift only)
+  void setHDF5Shuffle() {
+    this->hdfWriteOptions.shuffle = true;
+  }
+
+  //! Choose how gadget, tipsy and grafic output is written: memmap (the default) or buffered
+  void setOutputBackend(tools::WriteBackend backend) {
+    this->fileWriterOptions.backend = backend;
+  }
+
+  //! Set the size in MB of each buffer used by the buffered output back-end
+  void setOutputBufferSize(double sizeMB) {
+    if (sizeMB <= 0)
+      throw std::runtime_error("Output buffer size must be greater than zero");
+    this->fileWriterOptions.bufferSize = static_cast<size_t>(sizeMB * 1024 * 1024);
+  }
+
+  //! Set the number of buffers used by the buffered output back-end, including the one being filled
+  void setOutputNumBuffers(size_t numBuffers) {
+    if (numBuffers < 2)
+      throw std::runtime_error("The buffered output back-end needs at least two buffers");
+    this->fileWriterOptions.numBuffers = numBuffers;
+  }
+
+  //! Bypass the page cache (using O_DIRECT) when writing with the buffered output back-end
+  void setOutputDirectIO() {
+    this->fileWriterOptions.directIO = true;
+  }
+
+  //! Use the specified number of threads for every Fourier transform, instead of choosing by grid size
+  void setFFTWThreads(int nThreads) {
+    if (nThreads < 1)
+      throw std::runtime_error("The number of FFTW threads must be at least one");
+    tools::numerics::fourier::fftwThreadTable.setFixedThreads(nThreads);
+    logging::entry() << "FFTW transforms will use up to " << nThreads << " threads" << std::endl;
+  }
+
+  //! Time Fourier transforms on each grid to choose how many threads they use, caching the results in the specified file
+  void calibrateFFTWThreads(std::string cacheFilename) {
+    if (multiLevelContext.getNumLevels() < 1)
+      throw std::runtime_error("Grids must be defined before calibrating FFTW threads");
+
+    std::vector<size_t> sizes;
+    for (size_t level = 0; level < multiLevelContext.getNumLevels(); ++level)
+      sizes.push_back(multiLevelContext.getGridForLevel(level).size);
+    std::sort(sizes.begin(), sizes.end());
+    sizes.erase(std::unique(sizes.begin(), sizes.end()), sizes.end());
+
+    tools::numerics::fourier::initialise();
+    tools::numerics::fourier::fftwThreadTable.calibrate<T>(sizes, tools::numerics::fourier::maxFFTWThreads,
+                                                            cacheFilename);
+  }
+
+  //! Write subsequent numpy grid dumps in single precision, halving their size
+  void setDumpSinglePrecision() {
+    this->dumpSinglePrecision = true;
+  }
+
 protected:
 
   void checkWhetherGadgetTypeUsed(unsigned int type) {
@@ -743,9 +824,26 @@ public:
     outputFilename = outputFilename_;
   }
 
-  //! Set formats from handled formats in io namespace
-  void setOutputFormat(io::OutputFormat format) {
-    outputFormat = format;
+  /*! \brief Set one or more formats from handled formats in io namespace
+
+      All the formats are written from the same realisation, so that the random field, modifications and particle
+      generators are only computed once.
+  */
+  void setOutputFormat(io::OutputFormatList formats) {
+    for (size_t i = 0; i < formats.formats.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+        if (formats.formats[i] == formats.formats[j])
+          throw std::runtime_error("The same output format cannot be requested more than once");
+      }
+    }
+    auto requested = [&formats](io::OutputFormat format) {
+      return std::find(formats.formats.begin(), formats.formats.end(), format) != formats.formats.end();
+    };
+    if (requested(io::OutputFormat::gadgethdf) && requested(io::OutputFormat::swift))
+      throw std::runtime_error("gadgethdf and swift output cannot be requested together, as they use the same filename");
+
+    outputFormats = formats.formats;
+    outputFormat = outputFormats[0];
     updateParticleMapper();
   }
 
@@ -860,7 +958,7 @@ public:
     filename << outputFolder << "/" << prefix << "-" << level;
     filename << ".npy";
 
-    data.dumpGridData(filename.str());
+    data.dumpGridData(filename.str(), dumpSinglePrecision);
 
 
     // Output meta-data:
@@ -1271,14 +1369,35 @@ public:
   }
 
 
-  //! Outputs the ICs in the defined format, creating appropriate particle generators if required
+  //! Outputs the ICs in each of the defined formats, creating appropriate particle generators if required
   virtual void write() {
-    using namespace io;
-
     initialiseRandomComponentIfUninitialised();
     applyPowerSpec();
     ensureParticleGeneratorInitialised();
 
+    // The particle generators are shared between the formats, but the mapper depends on the format
+    for (auto format : outputFormats) {
+      if (format != outputFormat) {
+        outputFormat = format;
+        updateParticleMapper();
+      }
+      writeInCurrentFormat();
+    }
+
+    if (outputFormat != outputFormats[0]) {
+      outputFormat = outputFormats[0];
+      updateParticleMapper();
+    }
+
+    logging::entry() << "Finished writing initial conditions" << endl;
+
+  }
+
+protected:
+  //! Outputs the ICs in the format the mapper is currently set up for
+  void writeInCurrentFormat() {
+    using namespace io;
+
     logging::entry() << "Writing output; number dm particles=" << pMapper->size_dm()
          << ", number gas particles=" << pMapper->size_gas() << endl;
 #ifdef DEBUG_INFO
@@ -1294,20 +1413,23 @@ public:
         gadget::save<float>(getOutputPath() + ".gadget", boxlen, *pMapper,
                             pParticleGenerator,
                             cosmology, static_cast<int>(outputFormat),
-                            nGadgetFiles);
+                            nGadgetFiles, fileWriterOptions);
         break;
       case OutputFormat::gadgethdf:
         gadgethdf::save<float>(getOutputPath(), boxlen, *pMapper, pParticleGenerator, cosmology,
-                               nGadgetFiles);
+                               nGadgetFiles, hdfWriteOptions);
         break;
       case OutputFormat::swift:
         swift::save<float>(getOutputPath(), boxlen, *pMapper, pParticleGenerator, cosmology,
-                               nGadgetFiles);
+                               nGadgetFiles, hdfWriteOptions);
+        break;
+      case OutputFormat::shm:
+        shm::save<float>(getOutputPath(), boxlen, *pMapper, pParticleGenerator, cosmology);
         break;
 
       case OutputFormat::tipsy:
         tipsy::save(getOutputPath() + ".tipsy", boxlen, pParticleGenerator,
-                    pMapper, cosmology);
+                    pMapper, cosmology, fileWriterOptions);
         break;
       case OutputFormat::grafic:
         centre = this->getBoxCentre();
@@ -1320,16 +1442,14 @@ public:
 
         grafic::save(getOutputPath() + ".grafic",
                      pParticleGenerator, multiLevelContext, cosmology, pvarValue, centre,
-                     subsample, supersample, zoomParticleArray, outputFields);
+                     subsample, supersample, zoomParticleArray, outputFields, fileWriterOptions);
         break;
       default:
         throw std::runtime_error("Unknown output format");
     }
-
-    logging::entry() << "Finished writing initial conditions" << endl;
-
   }
 
+public:
   //! Initialise random components for all the fields.
   virtual void initialiseAllRandomComponents() {
     if (haveInitialisedRandomComponent)
@@ -1395,7 +1515,7 @@ protected:
     logging::entry() << "Loading " << filename << endl;
 #endif
     std::vector<size_t> flaggedParticles;
-    io::getBuffer(flaggedParticles, filename);
+    io::ids::load(flaggedParticles, filename);
     tools::sortAndEraseDuplicate(flaggedParticles);
 
     flagCellsCorrespondingToParticles(flaggedParticles);
@@ -1415,7 +1535,7 @@ protected:
 
 
 public:
-  //! Load from a file new flagged particles
+  //! Load from a file new flagged particles (text, raw binary .bin or numpy .npy; see io::ids)
   void loadID(string fname) {
     loadParticleIdFile(fname);
     getCentre();
@@ -1427,7 +1547,7 @@ public:
     getCentre();
   }
 
-  //! Output to a file the currently flagged particles
+  //! Output to a file the currently flagged particles, in the format given by its extension (see io::ids)
   virtual void dumpID(string fname) {
     std::vector<size_t> results;
 #ifdef DEBUG_INFO
@@ -1435,7 +1555,7 @@ public:
     logging::entry() << (*pMapper);
 #endif
     pMapper->getFlaggedParticles(results);
-    io::dumpBuffer(results, fname);
+    io::ids::save(results, fname);
   }
 
   //! Defines the currently interesting coordinates using a particle ID
@@ -1454,11 +1574,13 @@ public:
     grid.flagCells({id});
   }
 
-  //! Selects particles to flag according to a specified function of their co-ordinate.
-  void select(std::function<bool(T, T, T)> inclusionFunction) {
-    T delta_x, delta_y, delta_z;
-    T xp, yp, zp;
-
+  /*! \brief Flags the cells on every level whose offsets (dx, dy, dz) from the current centre satisfy inclusionFunction.
+   *
+   * \param halfExtent - half the size of a box around the centre outside which inclusionFunction is always false.
+   *                     Only cells inside this box are tested (see grids::flagCellsInRegion).
+   */
+  template<typename Predicate>
+  void select(const Coordinate<T> &halfExtent, const Predicate &inclusionFunction) {
     // unflag all grids first. This can't be in the loop below in case there are subtle
     // relationships between grids (in particular the ResolutionMatchingGrid which actually
     // points to two levels simultaneously).
@@ -1466,30 +1588,25 @@ public:
       getOutputGrid(level)->unflagAllCells();
     }
 
+    const Coordinate<T> centre(x0, y0, z0);
     for (size_t level = 0; level < multiLevelContext.getNumLevels(); ++level) {
-      std::vector<size_t> particleArray;
-      auto grid = getOutputGrid(level);
-      size_t N = grid->size3;
-      for (size_t i = 0; i < N; i++) {
-        std::tie(xp, yp, zp) = grid->getCentroidFromIndex(i);
-        delta_x = get_wrapped_delta(xp, x0);
-        delta_y = get_wrapped_delta(yp, y0);
-        delta_z = get_wrapped_delta(zp, z0);
-        if (inclusionFunction(delta_x, delta_y, delta_z))
-          particleArray.push_back(i);
-      }
-      grid->flagCells(particleArray);
-
+      grids::flagCellsInRegion(*getOutputGrid(level), multiLevelContext.getGridForLevel(0), centre, halfExtent,
+                               inclusionFunction);
     }
   }
 
+  //! Selects particles to flag according to a specified function of their co-ordinate, with no bounding box.
+  void select(std::function<bool(T, T, T)> inclusionFunction) {
+    select(Coordinate<T>(std::numeric_limits<T>::infinity()), inclusionFunction);
+  }
+
   //! Flag all cells contained in the sphere centered at the coordinates currently pointed at
   /*!
    * \param radius in Mpc/h
    * */
   void selectSphere(float radius) {
     T r2 = radius * radius;
-    select([r2](T delta_x, T delta_y, T delta_z) -> bool {
+    select(Coordinate<T>(radius), [r2](T delta_x, T delta_y, T delta_z) -> bool {
       T r2_i = delta_x * delta_x + delta_y * delta_y + delta_z * delta_z;
       return r2_i < r2;
     });
@@ -1505,7 +1622,7 @@ public:
     a2 = a * a;
     b2 = b * b;
     c2 = c * c;
-    select([a2, b2, c2](T delta_x, T delta_y, T delta_z) -> bool {
+    select(Coordinate<T>(a, b, c), [a2, b2, c2](T delta_x, T delta_y, T delta_z) -> bool {
       T r2_i = delta_x * delta_x / a2 + delta_y * delta_y / b2 + delta_z * delta_z / c2;
       return r2_i < 1.;
     });
@@ -1518,7 +1635,7 @@ public:
    * */
   void selectCube(float side) {
     T side_by_2 = side / 2;
-    select([side_by_2](T delta_x, T delta_y, T delta_z) -> bool {
+    select(Coordinate<T>(side_by_2), [side_by_2](T delta_x, T delta_y, T delta_z) -> bool {
       return abs(delta_x) < side_by_2 && abs(delta_y) < side_by_2 && abs(delta_z) < side_by_2;
     });
   }
@@ -1676,14 +1793,19 @@ public:
     newGenerator.draw();
     logging::entry() << "Finished constructing new random field. Beginning splice operation." << endl;
 
-    for(size_t level=0; level<multiLevelContext.getNumLevels(); ++level) {
+    // The covariances are fetched in series because the power spectrum's cache is not thread-safe
+    std::vector<std::shared_ptr<fields::Field<GridDataType>>> covariances;
+    for(size_t level=0; level<multiLevelContext.getNumLevels(); ++level)
+      covariances.push_back(multiLevelContext.getCovariance(level, particle::species::all));
+
+    multiLevelContext.forEachLevelConcurrently([&](size_t level) {
       auto &originalFieldThisLevel = outputFields[0]->getFieldForLevel(level);
       auto &newFieldThisLevel = newField.getFieldForLevel(level);
       auto splicedFieldThisLevel = modifications::spliceOneLevel(newFieldThisLevel, originalFieldThisLevel,
-                                                             *multiLevelContext.getCovariance(level, particle::species::all));
+                                                             *covariances[level]);
       splicedFieldThisLevel.toFourier();
       originalFieldThisLevel = std::move(splicedFieldThisLevel);
-    }
+    });
   }
 
   //! Reverses the sign of the low-k modes.
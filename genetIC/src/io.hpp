@@ -14,15 +14,18 @@ namespace cosmology {
 }
 
 #include "io/input.hpp"
+#include "io/ids.hpp"
 #include "io/gadget.hpp"
 #include "io/gadgethdf.hpp"
 #include "io/swift.hpp"
+#include "io/shm.hpp"
 #include "io/tipsy.hpp"
 #include "io/grafic.hpp"
 
 #include <iostream>
 #include <string>
 #include <stdexcept>
+#include <vector>
 
 /*!
     \namespace io
@@ -33,7 +36,7 @@ namespace cosmology {
 namespace io {
 
   enum class OutputFormat {
-    unknown = 1, gadget2 = 2, gadget3 = 3, tipsy = 4, grafic = 5, gadgethdf = 6, swift = 7
+    unknown = 1, gadget2 = 2, gadget3 = 3, tipsy = 4, grafic = 5, gadgethdf = 6, swift = 7, shm = 8
   };
 
   std::ostream &operator<<(std::ostream &outputStream, const OutputFormat &format) {
@@ -59,6 +62,9 @@ namespace io {
       case OutputFormat::swift:
         outputStream << "swift";
         break;
+      case OutputFormat::shm:
+        outputStream << "shm";
+        break;
     }
     return outputStream;
   }
@@ -82,6 +88,8 @@ namespace io {
         format = OutputFormat::gadgethdf;
       } else if (s == "swift") {
         format = OutputFormat::swift;
+      } else if (s == "shm") {
+        format = OutputFormat::shm;
       } else {
           inputStream.setstate(std::ios::failbit);
       }
@@ -89,6 +97,36 @@ namespace io {
     return inputStream;
   }
 
+  /*! \struct OutputFormatList
+      \brief One or more output formats, all of which are written from the same realisation.
+  */
+  struct OutputFormatList {
+    std::vector<OutputFormat> formats; //!< Formats in the order they will be written
+  };
+
+  std::ostream &operator<<(std::ostream &outputStream, const OutputFormatList &list) {
+    for (size_t i = 0; i < list.formats.size(); ++i) {
+      if (i > 0) outputStream << " ";
+      outputStream << list.formats[i];
+    }
+    return outputStream;
+  }
+
+  //! Reads all the formats remaining on the line, stopping at the end or at a comment
+  std::istream &operator>>(std::istream &inputStream, OutputFormatList &list) {
+    list.formats.clear();
+    do {
+      OutputFormat format;
+      inputStream >> format;
+      if (inputStream.fail())
+        return inputStream;
+      list.formats.push_back(format);
+      if (!inputStream.eof())
+        inputStream >> std::ws;
+    } while (!inputStream.eof() && inputStream.peek() != '#' && inputStream.peek() != '%');
+    return inputStream;
+  }
+
 
 
 
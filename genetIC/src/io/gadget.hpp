@@ -5,7 +5,10 @@
 #include "src/tools/data_types/float_types.hpp"
 #include "src/io.hpp"
 #include "src/simulation/particles/species.hpp"
+#include "src/simulation/particles/batch.hpp"
+#include "src/tools/scheduler.hpp"
 #include <vector>
+#include <algorithm>
 
 namespace io {
   /*!
@@ -239,11 +242,13 @@ namespace io {
     class GadgetOutput {
     protected:
       using InternalFloatType = tools::datatypes::strip_complex<GridDataType>;
+      using ParticleBatchType = particle::ParticleBatch<InternalFloatType>;
 
       particle::mapper::ParticleMapper<GridDataType> &mapper; //!< Particle mapper, for relating offsets in the file to GenetIC grid cells.
       particle::SpeciesToGeneratorMap<GridDataType> generators; //!< Particle generators for each particle species.
       const cosmology::CosmologicalParameters<InternalFloatType> &cosmology; //!< Struct containing cosmological parameters.
       std::vector<tools::MemMapFileWriter> writers; //!< Low-level file operations are handled by this object.
+      tools::FileWriterOptions writerOptions; //!< Back-end used by the writers
 
       size_t nTotal; //!< Total number of particles to output across all files and types
       std::vector<size_t> nPartPerFile; //!< Number of particles to write per file
@@ -301,42 +306,263 @@ namespace io {
         for(int i=0; i<nFiles; i++)
           currentWriteBlocks.push_back(writers[i].template getMemMapFortran<WriteType>(nPerFile[i]));
 
-        assert(this->template genericSaveBlock(particleTypes, getData, currentWriteBlocks) == nTotalForThisBlock);
+        assert(this->template genericSaveBlock(particleTypes, getData, currentWriteBlocks, nPerFile) == nTotalForThisBlock);
 
       }
 
+      /*! \brief Write the data for the given particle types into per-file targets, in parallel.
+       *
+       * Particles are numbered consecutively through the listed types; the first nPerFile[0] go to the first file,
+       * the next nPerFile[1] to the second and so on. Each thread receives a contiguous block of particles, so the file
+       * boundaries only need to be located once per block rather than once per particle.
+       */
       template<typename TargetType, typename WriteType>
       size_t genericSaveBlock(const std::vector<unsigned int> & particleTypes,
                             std::function<WriteType(const particle::mapper::MapperIterator<GridDataType> &)> getData,
-                            std::vector<TargetType> & currentWriteBlocks) {
+                            std::vector<TargetType> & currentWriteBlocks,
+                            const std::vector<size_t> & nPerFile) {
         size_t current_n = 0;
+        auto fileStartAddress = getFileStartAddresses(nPerFile);
 
         for (auto particle_type: particleTypes) {
           auto begin = mapper.beginParticleType(*generators[gadgetTypeToSpecies[particle_type]], particle_type);
           auto end = mapper.endParticleType(*generators[gadgetTypeToSpecies[particle_type]], particle_type);
           size_t nMax = end.getIndex() - begin.getIndex();
 
-          current_n += begin.parallelIterate(
-              [&](size_t n_offset, const particle::mapper::MapperIterator<GridDataType> &localIterator) {
-                int fileNum = 0;
-                size_t addr = n_offset + current_n;
-
-                // Now figure out which file to dump this into.
-                // The following approach looks slow (doing it for every particle!),
-                // but code profiling suggests it's not a significant overhead.
-                // Easier to do this than to try and have thread-local variables
-                while (addr >= nPartPerFile[fileNum]) {
-                  addr -= nPartPerFile[fileNum];
-                  fileNum++;
-                }
-
-                currentWriteBlocks[fileNum][addr] = getData(localIterator);
+          current_n += begin.parallelIterateBlocks(
+              [&](size_t blockStart, size_t blockLength,
+                  particle::mapper::MapperIterator<GridDataType> &localIterator) {
+                forEachFileInRange(current_n + blockStart, blockLength, fileStartAddress,
+                                   [&](size_t fileNum, size_t fileOffset, size_t blockOffset, size_t n) {
+                                     auto &target = currentWriteBlocks[fileNum];
+                                     for (size_t k = 0; k < n; ++k) {
+                                       target[fileOffset + k] = getData(localIterator);
+                                       if (blockOffset + k + 1 < blockLength) ++localIterator;
+                                     }
+                                   });
               }, nMax);
         }
         return current_n;
 
       }
 
+      //! \brief Returns the overall position of the first particle in each file, followed by the total
+      static std::vector<size_t> getFileStartAddresses(const std::vector<size_t> &nPerFile) {
+        std::vector<size_t> fileStartAddress(nPerFile.size() + 1, 0);
+        for (size_t fileNum = 0; fileNum < nPerFile.size(); ++fileNum)
+          fileStartAddress[fileNum + 1] = fileStartAddress[fileNum] + nPerFile[fileNum];
+        return fileStartAddress;
+      }
+
+      /*! \brief Split a range of particles into the parts that fall in each file.
+       *
+       * The range covers n particles starting at overall position addr. For each file it touches, the callback
+       * receives the file number, the offset of the part within that file, the offset of the part within the range,
+       * and the number of particles in the part.
+       */
+      static void forEachFileInRange(size_t addr, size_t n, const std::vector<size_t> &fileStartAddress,
+                                     const std::function<void(size_t, size_t, size_t, size_t)> &callback) {
+        size_t addrEnd = addr + n;
+        size_t fileNum = std::upper_bound(fileStartAddress.begin(), fileStartAddress.end(), addr)
+                         - fileStartAddress.begin() - 1;
+        while (addr < addrEnd) {
+          assert(fileNum + 1 < fileStartAddress.size());
+          size_t addrEndThisFile = std::min(addrEnd, fileStartAddress[fileNum + 1]);
+          callback(fileNum, addr - fileStartAddress[fileNum], addr + n - addrEnd, addrEndThisFile - addr);
+          addr = addrEndThisFile;
+          ++fileNum;
+        }
+      }
+
+      /*! \brief Generate the particles of the listed gadget types in parallel, handing them over in batches.
+       *
+       * The callback receives the overall position of each batch's first particle, counting consecutively through
+       * the listed types, and the batch itself. It is called concurrently from several threads.
+       */
+      size_t iterateParticleBatches(const std::vector<unsigned int> &particleTypes,
+                                    const std::function<void(size_t, const ParticleBatchType &)> &callback) {
+        size_t current_n = 0;
+
+        for (auto particle_type: particleTypes) {
+          auto begin = mapper.beginParticleType(*generators[gadgetTypeToSpecies[particle_type]], particle_type);
+          auto end = mapper.endParticleType(*generators[gadgetTypeToSpecies[particle_type]], particle_type);
+          size_t nMax = end.getIndex() - begin.getIndex();
+
+          current_n += begin.parallelIterateBlocks(
+              [&](size_t blockStart, size_t blockLength,
+                  particle::mapper::MapperIterator<GridDataType> &localIterator) {
+                ParticleBatchType::iterateInBatches(localIterator, blockLength,
+                  [&](size_t batchStart, const ParticleBatchType &batch) {
+                    callback(current_n + blockStart + batchStart, batch);
+                  });
+              }, nMax);
+        }
+        return current_n;
+      }
+
+      /*! \brief Returns iterators pointing at the first particle of each gadget type in each file.
+       *
+       * Element [i][j] is for file i and type j. The iterators are flattened here, outside any parallel region, so
+       * that each file can then be generated independently of the others.
+       */
+      std::vector<std::vector<particle::mapper::MapperIterator<GridDataType>>> getFileIterators() {
+        std::vector<std::vector<particle::mapper::MapperIterator<GridDataType>>> fileIterators(nFiles);
+        for (unsigned int particle_type = 0; particle_type < 6; ++particle_type) {
+          auto iterator = mapper.beginParticleType(*generators[gadgetTypeToSpecies[particle_type]], particle_type);
+          iterator.flatten();
+          for (unsigned int i = 0; i < nFiles; ++i) {
+            fileIterators[i].push_back(iterator);
+            if (nPartPerTypePerFile[i][particle_type] > 0) // types with no particles may have no mapper to step
+              iterator += nPartPerTypePerFile[i][particle_type];
+          }
+        }
+        return fileIterators;
+      }
+
+      //! \brief Returns the number of particles in each file, as the relative costs of writing the files concurrently
+      std::vector<double> getFileCosts() const {
+        return std::vector<double>(nPartPerFile.begin(), nPartPerFile.end());
+      }
+
+      /*! \brief Save the position, velocity, ID and (if required) mass blocks, generating each particle only once.
+       *
+       * All the blocks for each file are mapped at the outset. The files are then filled concurrently, each by its
+       * own share of the threads (see tools::forEachTaskConcurrently), from batches of particles generated starting
+       * at that file's offset within each gadget type.
+       */
+      void saveParticleBlocks() {
+        using CoordinateType = Coordinate<OutputFloatType>;
+
+        std::vector<tools::MemMapRegion<CoordinateType>> posBlocks, velBlocks;
+        std::vector<tools::MemMapRegion<unsigned long>> idBlocks;
+        std::vector<tools::MemMapRegion<OutputFloatType>> massBlocks;
+
+        for (unsigned int i = 0; i < nFiles; ++i) {
+          posBlocks.push_back(writers[i].template getMemMapFortranLeavingOpen<CoordinateType>(nPartPerFile[i]));
+          velBlocks.push_back(writers[i].template getMemMapFortranLeavingOpen<CoordinateType>(nPartPerFile[i]));
+          idBlocks.push_back(writers[i].template getMemMapFortranLeavingOpen<unsigned long>(nPartPerFile[i]));
+          if (variableMass)
+            massBlocks.push_back(writers[i].template getMemMapFortranLeavingOpen<OutputFloatType>(nPartPerFile[i]));
+        }
+
+        auto fileIterators = getFileIterators();
+
+        tools::forEachTaskConcurrently(getFileCosts(), [&](size_t i) {
+          size_t nWrittenThisFile = 0;
+
+          for (unsigned int particle_type = 0; particle_type < 6; ++particle_type) {
+            size_t nThisType = nPartPerTypePerFile[i][particle_type];
+
+            fileIterators[i][particle_type].parallelIterateBlocks(
+              [&](size_t blockStart, size_t blockLength, particle::mapper::MapperIterator<GridDataType> &localIterator) {
+                ParticleBatchType::iterateInBatches(localIterator, blockLength,
+                  [&](size_t batchStart, const ParticleBatchType &batch) {
+                    size_t fileOffset = nWrittenThisFile + blockStart + batchStart;
+                    for (size_t k = 0; k < batch.size(); ++k) {
+                      posBlocks[i][fileOffset + k] = CoordinateType(batch.pos[k]);
+                      velBlocks[i][fileOffset + k] = CoordinateType(batch.vel[k]);
+                      idBlocks[i][fileOffset + k] = batch.id[k];
+                    }
+                    if (variableMass) {
+                      for (size_t k = 0; k < batch.size(); ++k)
+                        massBlocks[i][fileOffset + k] = batch.mass[k];
+                    }
+                  });
+              }, nThisType);
+
+            nWrittenThisFile += nThisType;
+          }
+
+          assert(nWrittenThisFile == nPartPerFile[i]);
+        });
+      }
+
+      /*! \brief Save the position, velocity, ID, mass and internal energy blocks, streaming each file in order.
+       *
+       * Used with the buffered writer back-end. The space for each block is reserved up front, then each batch of
+       * particles is generated in parallel and copied into small regions of every block, which are handed to the
+       * writer's I/O thread while the next batch is generated. Memory use is therefore bounded by the buffer size
+       * for each file being written.
+       *
+       * Each file has its own writer and I/O thread, so the files are streamed concurrently, each by its own share
+       * of the threads (see tools::forEachTaskConcurrently).
+       */
+      void saveParticleBlocksStreamed() {
+        using CoordinateType = Coordinate<OutputFloatType>;
+
+        bool writeInternalEnergy = cosmology.OmegaBaryons0 > 0;
+        size_t bytesPerParticle = 2 * sizeof(CoordinateType) + sizeof(unsigned long) + sizeof(OutputFloatType) * 2;
+        size_t batchSize = std::max(size_t(1), writerOptions.bufferSize / bytesPerParticle);
+
+        auto fileIterators = getFileIterators();
+
+        tools::forEachTaskConcurrently(getFileCosts(), [&](size_t i) {
+          auto &writer = writers[i];
+          auto &typeIterators = fileIterators[i];
+          ParticleBatchType batch;
+
+          size_t nGasThisFile = 0;
+          for (unsigned int particle_type = 0; particle_type < 6; ++particle_type) {
+            if (gadgetTypeToSpecies[particle_type] == particle::species::baryon)
+              nGasThisFile += nPartPerTypePerFile[i][particle_type];
+          }
+
+          size_t posStart = writer.template reserveFortran<CoordinateType>(nPartPerFile[i]);
+          size_t velStart = writer.template reserveFortran<CoordinateType>(nPartPerFile[i]);
+          size_t idStart = writer.template reserveFortran<unsigned long>(nPartPerFile[i]);
+          size_t massStart = variableMass ? writer.template reserveFortran<OutputFloatType>(nPartPerFile[i]) : 0;
+          size_t internalEnergyStart = writeInternalEnergy ?
+                                       writer.template reserveFortran<OutputFloatType>(nGasThisFile) : 0;
+
+          size_t nWrittenThisFile = 0, nGasWrittenThisFile = 0;
+
+          for (unsigned int particle_type = 0; particle_type < 6; ++particle_type) {
+            size_t nThisType = nPartPerTypePerFile[i][particle_type];
+            bool isGas = gadgetTypeToSpecies[particle_type] == particle::species::baryon;
+
+            for (size_t batchStart = 0; batchStart < nThisType; batchStart += batchSize) {
+              size_t n = std::min(batchSize, nThisType - batchStart);
+              batch.fillInParallel(typeIterators[particle_type], n);
+
+              auto pos = writer.template getMemMapAt<CoordinateType>(
+                posStart + nWrittenThisFile * sizeof(CoordinateType), n);
+              auto vel = writer.template getMemMapAt<CoordinateType>(
+                velStart + nWrittenThisFile * sizeof(CoordinateType), n);
+              auto id = writer.template getMemMapAt<unsigned long>(
+                idStart + nWrittenThisFile * sizeof(unsigned long), n);
+
+#pragma omp parallel for
+              for (size_t k = 0; k < n; ++k) {
+                pos[k] = CoordinateType(batch.pos[k]);
+                vel[k] = CoordinateType(batch.vel[k]);
+                id[k] = batch.id[k];
+              }
+
+              if (variableMass) {
+                auto mass = writer.template getMemMapAt<OutputFloatType>(
+                  massStart + nWrittenThisFile * sizeof(OutputFloatType), n);
+                for (size_t k = 0; k < n; ++k)
+                  mass[k] = batch.mass[k];
+              }
+
+              if (writeInternalEnergy && isGas) {
+                // dummy internal energy
+                auto internalEnergy = writer.template getMemMapAt<OutputFloatType>(
+                  internalEnergyStart + nGasWrittenThisFile * sizeof(OutputFloatType), n);
+                for (size_t k = 0; k < n; ++k)
+                  internalEnergy[k] = 0;
+                nGasWrittenThisFile += n;
+              }
+
+              nWrittenThisFile += n;
+            }
+          }
+
+          assert(nWrittenThisFile == nPartPerFile[i]);
+          assert(!writeInternalEnergy || nGasWrittenThisFile == nGasThisFile);
+        });
+      }
+
       //! \brief Returns false in base class. Override in child class to force variable mass output
       virtual bool forceVariableMass() const { return false; }
 
@@ -397,6 +623,27 @@ namespace io {
       void getParticleInfo(InternalFloatType &min_mass, InternalFloatType &max_mass,
                            size_t &num, unsigned int particle_type) {
 
+        InternalFloatType tot_mass;
+        if (mapper.getParticleMassStatistics(*generators[gadgetTypeToSpecies[particle_type]], min_mass, max_mass,
+                                             tot_mass, num, particle_type)) {
+#ifdef DEBUG_INFO
+          InternalFloatType scanned_min_mass, scanned_max_mass;
+          size_t scanned_num;
+          scanParticleInfo(scanned_min_mass, scanned_max_mass, scanned_num, particle_type);
+          if (scanned_num != num || scanned_min_mass != min_mass || scanned_max_mass != max_mass)
+            throw std::runtime_error("Segment index disagrees with particle scan for gadget particle type " +
+                                     std::to_string(particle_type));
+#endif
+          return;
+        }
+
+        scanParticleInfo(min_mass, max_mass, num, particle_type);
+      }
+
+      //! \brief As getParticleInfo, but visiting every particle; used for mappers without a segment index
+      void scanParticleInfo(InternalFloatType &min_mass, InternalFloatType &max_mass,
+                            size_t &num, unsigned int particle_type) {
+
         min_mass = std::numeric_limits<InternalFloatType>::max();
         max_mass = 0;
         num = 0;
@@ -485,14 +732,17 @@ namespace io {
           \param generators_ - vector of particle generators for each species.
           \param cosmology - struct containing cosmological parameters.
           \param gadgetVersion - 2 for gadget2 format, 3 for gadget3 format.
+          \param numFiles - number of files to split the output across.
+          \param writerOptions - back-end used to write the files.
       */
       GadgetOutput(double boxLength,
                    particle::mapper::ParticleMapper<GridDataType> &mapper,
                    const particle::SpeciesToGeneratorMap<GridDataType> &generators_,
                    const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-                   int gadgetVersion, int numFiles) :
-        mapper(mapper), generators(generators_), cosmology(cosmology), boxLength(boxLength),
-        gadgetVersion(gadgetVersion), nFiles(numFiles) {
+                   int gadgetVersion, int numFiles,
+                   const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) :
+        mapper(mapper), generators(generators_), cosmology(cosmology), writerOptions(writerOptions),
+        boxLength(boxLength), gadgetVersion(gadgetVersion), nFiles(numFiles) {
       }
 
       //! \brief Operation to save gadget particles
@@ -501,47 +751,24 @@ namespace io {
         preScanForMassesAndParticleNumbers();
 
         if(nFiles==1) {
-          writers.push_back(tools::MemMapFileWriter(name + std::to_string(gadgetVersion)));
+          writers.push_back(tools::MemMapFileWriter(name + std::to_string(gadgetVersion), writerOptions));
         } else {
           for(int i=0; i<nFiles; i++) {
-            writers.push_back(tools::MemMapFileWriter(name + std::to_string(gadgetVersion) + "." + std::to_string(i)));
+            writers.push_back(tools::MemMapFileWriter(name + std::to_string(gadgetVersion) + "." + std::to_string(i),
+                                                      writerOptions));
           }
         }
 
         writeHeader();
 
-        // positions
-        saveGadgetBlock<Coordinate<OutputFloatType>>(
-           particle::species::all,
-          [](auto &localIterator) {
-            auto particle = localIterator.getParticle();
-            return Coordinate<OutputFloatType>(particle.pos);
-          });
-
-        // velocities
-        saveGadgetBlock<Coordinate<OutputFloatType>>(
-          particle::species::all,
-          [](auto &localIterator) {
-            auto particle = localIterator.getParticle();
-            return Coordinate<OutputFloatType>(particle.vel);
-          });
-
-        // IDs
-        saveGadgetBlock<unsigned long>(
-          particle::species::all,
-          [](auto &localIterator) {
-            return localIterator.getIndex();
-          });
-
-
-        if (variableMass) {
-          saveGadgetBlock<OutputFloatType>(
-            particle::species::all,
-            [](auto &localIterator) {
-              return localIterator.getMass();
-            });
+        if (writerOptions.backend == tools::WriteBackend::buffered) {
+          saveParticleBlocksStreamed();
+          return;
         }
 
+        // positions, velocities, IDs and masses
+        saveParticleBlocks();
+
         if(cosmology.OmegaBaryons0>0) {
           // dummy internal energy
           saveGadgetBlock<OutputFloatType>(
@@ -565,15 +792,18 @@ namespace io {
     \param generators - particles generators for each particle species (vector)
     \param cosmology - cosmological parameters
     \param gadgetformat - 2 or 3, gives type of gadget output (gadget2 or gadget3)
+    \param nFiles - number of files to split the output across
+    \param writerOptions - back-end used to write the files
     */
     template<typename OutputFloatType, typename GridDataType>
     void save(const std::string &name, double Boxlength,
               particle::mapper::ParticleMapper<GridDataType> &mapper,
               particle::SpeciesToGeneratorMap<GridDataType> &generators,
               const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-              int gadgetformat, int nFiles) {
+              int gadgetformat, int nFiles, const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) {
 
-      GadgetOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, gadgetformat, nFiles);
+      GadgetOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, gadgetformat, nFiles,
+                                                         writerOptions);
       output(name);
 
     }
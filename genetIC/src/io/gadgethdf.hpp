@@ -1,6 +1,11 @@
 #ifndef IC_GADGETHDF_HPP
 #define IC_GADGETHDF_HPP
 
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
 #include "gadget.hpp"
 
 // we use this third-party HDF C++ wrapper because it is more modern and doesn't require
@@ -21,6 +26,21 @@ namespace io {
     using std::vector;
 
 
+    /*! \struct HDFWriteOptions
+        \brief Settings controlling the layout of the particle datasets and how they are written.
+    */
+    struct HDFWriteOptions {
+      //! Particles per HDF5 chunk. Particles are also generated and written this many at a time, which bounds memory use.
+      size_t chunkSize = 262144;
+
+      //! Size in bytes of the chunk cache for each dataset, or zero to keep the HDF5 default
+      size_t chunkCacheBytes = 0;
+
+      //! If true, apply the HDF5 shuffle filter to each dataset
+      bool shuffle = false;
+    };
+
+
     /*! \class GadgetOutput
     \brief Class to handle output to gadget files.
     */
@@ -28,7 +48,9 @@ namespace io {
     class GadgetHDFOutput : public gadget::GadgetOutput<GridDataType, OutputFloatType> {
     protected:
       using InternalFloatType = tools::datatypes::strip_complex<GridDataType>;
+      using ParticleBatchType = typename gadget::GadgetOutput<GridDataType, OutputFloatType>::ParticleBatchType;
       std::vector<HighFive::File> h5Files;
+      HDFWriteOptions writeOptions;
 
     public:
 
@@ -36,84 +58,233 @@ namespace io {
                    particle::mapper::ParticleMapper<GridDataType> &mapper,
                    const particle::SpeciesToGeneratorMap<GridDataType> &generators_,
                    const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-                   int numFiles) :
+                   int numFiles, const HDFWriteOptions &writeOptions = HDFWriteOptions()) :
                    gadget::GadgetOutput<GridDataType, OutputFloatType>(boxLength, mapper, generators_,
-                                                                       cosmology, 0, numFiles) { }
+                                                                       cosmology, 0, numFiles),
+                   writeOptions(writeOptions) {
+        if (writeOptions.chunkSize == 0)
+          throw std::runtime_error("HDF5 chunk size must be greater than zero");
+      }
 
 
 
+      /*! \brief Create a dataset for nTotal particles, chunked along the particle axis as set by writeOptions.
+       *
+       * Empty datasets cannot be chunked, so are created with the default contiguous layout.
+       */
       template<typename WriteType, typename UnderlyingType=typename strip_coordinate<WriteType>::type>
       HighFive::DataSet createDataSet(HighFive::Group & location, std::string name, size_t nTotal) {
         const bool three_dimensional = !std::is_same<UnderlyingType, WriteType>::value;
 
-        std::unique_ptr<HighFive::DataSpace> ds;
+        std::vector<size_t> dims = {nTotal};
+        std::vector<hsize_t> chunkDims = {std::min(nTotal, writeOptions.chunkSize)};
 
         if constexpr(three_dimensional) {
           static_assert(sizeof(Coordinate<UnderlyingType>) == 3*sizeof(UnderlyingType));
-          ds = std::make_unique<HighFive::DataSpace>(nTotal, 3);
-        } else {
-          ds = std::make_unique<HighFive::DataSpace>(nTotal);
+          dims.push_back(3);
+          chunkDims.push_back(3);
         }
 
-        HighFive::DataSet dataset = location.createDataSet<UnderlyingType>(name, *ds);
-        return dataset;
-      }
+        HighFive::DataSpace ds(dims);
+
+        if (nTotal == 0)
+          return location.createDataSet<UnderlyingType>(name, ds);
+
+        HighFive::DataSetCreateProps createProps;
+        createProps.add(HighFive::Chunking(chunkDims));
+        if (writeOptions.shuffle)
+          createProps.add(HighFive::Shuffle());
 
+        HighFive::DataSetAccessProps accessProps;
+        if (writeOptions.chunkCacheBytes > 0)
+          accessProps.add(HighFive::Caching(12421, writeOptions.chunkCacheBytes)); // slot count is a prime, per HDF5 advice
 
+        return location.createDataSet<UnderlyingType>(name, ds, createProps, accessProps);
+      }
+
+      //! Create one dataset for the specified gadget particle type in each file, creating the groups if required
       template<typename WriteType>
-      void saveBlock(particle::species forSpecies,
-                     std::function<WriteType(const particle::mapper::MapperIterator<GridDataType> &)> getData,
-                     std::string name) {
+      std::vector<HighFive::DataSet> createDataSets(unsigned int particleType, std::string name) {
+        std::vector<HighFive::DataSet> datasets;
+        std::string groupName = "/PartType"+std::to_string(particleType);
+
+        std::vector<HighFive::Group> groups;
+
+        for (int i=0; i<this->nFiles; i++) {
+          HighFive::File &file = h5Files[i];
+          try {
+            groups.push_back(file.getGroup(groupName));
+          } catch (HighFive::Exception &e) {
+            groups.push_back(file.createGroup(groupName));
+          }
+          datasets.push_back(createDataSet<WriteType>(groups.back(), name, this->nPartPerTypePerFile[i][particleType]));
+        }
+        return datasets;
+      }
 
+      /*! \brief Write n values to a dataset, starting at the given offset within it.
+          \param getData - returns the value for the k-th of the n particles
+      */
+      template<typename WriteType>
+      void writeHyperslab(HighFive::DataSet &dataset, size_t offset, size_t n,
+                          const std::function<WriteType(size_t)> &getData, std::vector<WriteType> &buffer) {
         using UnderlyingType = typename strip_coordinate<WriteType>::type;
+        const bool three_dimensional = !std::is_same<UnderlyingType, WriteType>::value;
 
-        size_t current_n = 0;
-        size_t nTotalForThisBlock = 0;
+        buffer.resize(n);
 
-        for(int particleType = 0; particleType < 6; particleType++) {
-          if (forSpecies != this->gadgetTypeToSpecies[particleType] && forSpecies != particle::species::all)
-            continue;
+        // Runs alongside the generation of the next batch, so does not compete with it for threads
+        for (size_t k = 0; k < n; ++k)
+          buffer[k] = getData(k);
 
-          std::vector<HighFive::Group> groups;
-          std::vector<HighFive::DataSet> datasets;
-          std::vector<WriteType> buffer;
+        if constexpr(three_dimensional)
+          dataset.select({offset, 0}, {n, 3}).write_raw(reinterpret_cast<UnderlyingType*>(buffer.data()));
+        else
+          dataset.select({offset}, {n}).write_raw(reinterpret_cast<UnderlyingType*>(buffer.data()));
+      }
 
-          size_t nPartThisType = 0;
+      /*! \brief Write all the datasets for the specified gadget particle type.
+       *
+       * The particles are generated in batches of writeOptions.chunkSize, each of which is written to every dataset
+       * of its file. Batches never straddle two files, and so line up with the dataset chunks.
+       *
+       * The batches for each file are generated concurrently, each file by its own share of the threads (see
+       * tools::forEachTaskConcurrently). HDF5 calls must not be made concurrently, so the batches are handed to a
+       * single writer thread, and generation waits if more than a few are waiting to be written. Chunks are written
+       * in the order in which batches become ready, so their placement within each file may vary from run to run,
+       * but the contents of the datasets do not.
+       */
+      void saveParticleType(unsigned int particleType) {
+        using CoordinateType = Coordinate<OutputFloatType>;
+
+        particle::species forSpecies = this->gadgetTypeToSpecies[particleType];
+
+        bool writeMass = this->variableMass;
+        bool writeGas = this->cosmology.OmegaBaryons0 > 0 && forSpecies == particle::species::baryon;
+
+        auto coordinates = createDataSets<CoordinateType>(particleType, "Coordinates");
+        auto velocities = createDataSets<CoordinateType>(particleType, "Velocities");
+        auto ids = createDataSets<unsigned long>(particleType, "ParticleIDs");
+        std::vector<HighFive::DataSet> masses, internalEnergies, smoothingLengths;
+        if (writeMass)
+          masses = createDataSets<OutputFloatType>(particleType, "Masses");
+        if (writeGas) {
+          internalEnergies = createDataSets<OutputFloatType>(particleType, "InternalEnergy");
+          smoothingLengths = createDataSets<OutputFloatType>(particleType, "SmoothingLength");
+        }
 
-          // create or open particle type groups
-          for (int i=0; i<this->nFiles; i++) {
-            HighFive::File &file = h5Files[i];
-            std::string groupName = "/PartType"+std::to_string(particleType);
-            size_t nPart = this->nPartPerTypePerFile[i][particleType];
-            try {
-              groups.push_back(file.getGroup(groupName));
-            } catch (HighFive::Exception &e) {
-              groups.push_back(file.createGroup(groupName));
-            }
-            datasets.push_back(createDataSet<WriteType>(groups.back(), name, nPart));
-            nPartThisType += nPart;
+        OutputFloatType internalEnergy = cosmology::getInternalEnergy(this->cosmology);
+
+        std::vector<CoordinateType> coordinateBuffer;
+        std::vector<unsigned long> idBuffer;
+        std::vector<OutputFloatType> floatBuffer;
+
+        auto writeBatch = [&](const ParticleBatchType &batch, int i, size_t offset, size_t n) {
+          writeHyperslab<CoordinateType>(coordinates[i], offset, n, [&batch](size_t k) {
+            return CoordinateType(batch.pos[k]);
+          }, coordinateBuffer);
+
+          writeHyperslab<CoordinateType>(velocities[i], offset, n, [&batch](size_t k) {
+            return CoordinateType(batch.vel[k]);
+          }, coordinateBuffer);
+
+          writeHyperslab<unsigned long>(ids[i], offset, n, [&batch](size_t k) {
+            return batch.id[k];
+          }, idBuffer);
+
+          if (writeMass) {
+            writeHyperslab<OutputFloatType>(masses[i], offset, n, [&batch](size_t k) {
+              return batch.mass[k];
+            }, floatBuffer);
           }
 
-          assert(nPartThisType == this->nPartPerType[particleType]);
+          if (writeGas) {
+            writeHyperslab<OutputFloatType>(internalEnergies[i], offset, n, [internalEnergy](size_t) {
+              return internalEnergy;
+            }, floatBuffer);
 
-          buffer.resize(nPartThisType);
+            writeHyperslab<OutputFloatType>(smoothingLengths[i], offset, n, [&batch](size_t k) {
+              return batch.smoothing[k];
+            }, floatBuffer);
+          }
+        };
+
+        //! A generated batch waiting to be written
+        struct PendingBatch {
+          int file; //!< File to which the batch belongs
+          size_t offset; //!< Offset of the batch within the file's datasets
+          ParticleBatchType batch; //!< The particles
+        };
+
+        const size_t maxPendingBatches = 2;
+        std::deque<PendingBatch> pendingBatches; // batches generated but not yet taken by the writer
+        bool generationFinished = false; // set once no more batches will be added
+        bool writeFailed = false; // set if the writer has stopped because of an error
+        std::mutex pendingMutex; // protects the above
+        std::condition_variable pendingChanged; // signalled whenever any of the above changes
+
+        auto writer = std::async(std::launch::async, [&]() {
+          HighFive::SilenceHDF5 silence; // the silencer in save only applies to the thread that created it
+          std::unique_lock<std::mutex> lock(pendingMutex);
+          while (true) {
+            pendingChanged.wait(lock, [&]() { return !pendingBatches.empty() || generationFinished; });
+            if (pendingBatches.empty())
+              return;
+
+            PendingBatch pending = std::move(pendingBatches.front());
+            pendingBatches.pop_front();
+            pendingChanged.notify_all();
+            lock.unlock();
 
-          auto begin = this->mapper.beginParticleType(*this->generators[this->gadgetTypeToSpecies[particleType]],
-                                                      particleType);
-          auto end = this->mapper.endParticleType(*this->generators[this->gadgetTypeToSpecies[particleType]],
-                                                  particleType);
-          begin.parallelIterate(
-              [&](size_t n_offset, const particle::mapper::MapperIterator<GridDataType> &localIterator) {
-                buffer[n_offset] = getData(localIterator);
-              }, end - begin);
+            try {
+              writeBatch(pending.batch, pending.file, pending.offset, pending.batch.size());
+            } catch (...) {
+              lock.lock();
+              writeFailed = true;
+              pendingChanged.notify_all();
+              throw;
+            }
 
-          size_t offset = 0;
-          for (int i = 0; i < this->nFiles; i++) {
-            datasets[i].write_raw<UnderlyingType>(reinterpret_cast<UnderlyingType*>(&buffer[offset]));
-            offset+=this->nPartPerTypePerFile[i][particleType];
+            lock.lock();
           }
+        });
+
+        auto fileIterators = this->getFileIterators();
+        std::vector<double> costs;
+        for (int i = 0; i < this->nFiles; i++)
+          costs.push_back(double(this->nPartPerTypePerFile[i][particleType]));
+
+        std::exception_ptr generationException;
+        try {
+          tools::forEachTaskConcurrently(costs, [&](size_t i) {
+            auto &iterator = fileIterators[i][particleType];
+            size_t nThisFile = this->nPartPerTypePerFile[i][particleType];
+
+            for (size_t offset = 0; offset < nThisFile; offset += writeOptions.chunkSize) {
+              PendingBatch pending{int(i), offset, ParticleBatchType()};
+              pending.batch.fillInParallel(iterator, std::min(writeOptions.chunkSize, nThisFile - offset));
+
+              std::unique_lock<std::mutex> lock(pendingMutex);
+              pendingChanged.wait(lock, [&]() { return pendingBatches.size() < maxPendingBatches || writeFailed; });
+              if (writeFailed)
+                return; // the writer's exception is rethrown below
+              pendingBatches.push_back(std::move(pending));
+              pendingChanged.notify_all();
+            }
+          });
+        } catch (...) {
+          generationException = std::current_exception();
         }
 
+        {
+          std::lock_guard<std::mutex> lock(pendingMutex);
+          generationFinished = true;
+        }
+        pendingChanged.notify_all();
+
+        writer.get(); // rethrows any exception from writing
+        if (generationException)
+          std::rethrow_exception(generationException);
       }
 
       template<typename T>
@@ -190,49 +361,8 @@ namespace io {
 
 
 
-        saveBlock<Coordinate<OutputFloatType>>(
-           particle::species::all,
-          [](auto &localIterator) {
-            auto particle = localIterator.getParticle();
-            return Coordinate<OutputFloatType>(particle.pos);
-          }, "Coordinates");
-
-        saveBlock<Coordinate<OutputFloatType>>(
-          particle::species::all,
-          [](auto &localIterator) {
-            auto particle = localIterator.getParticle();
-            return Coordinate<OutputFloatType>(particle.vel);
-          }, "Velocities");
-
-        saveBlock<unsigned long>(
-          particle::species::all,
-          [](auto &localIterator) {
-            return localIterator.getIndex();
-          }, "ParticleIDs");
-
-
-        if (this->variableMass) {
-          saveBlock<OutputFloatType>(
-            particle::species::all,
-            [](auto &localIterator) {
-              return localIterator.getMass();
-            }, "Masses");
-        }
-
-        if (this->cosmology.OmegaBaryons0 > 0) {
-          OutputFloatType internalEnergy = cosmology::getInternalEnergy(this->cosmology);
-          saveBlock<OutputFloatType>(
-            particle::species::baryon,
-            [internalEnergy](auto &localIterator) {
-              return internalEnergy;
-            }, "InternalEnergy");
-
-          saveBlock<OutputFloatType>(
-            particle::species::baryon,
-            [](auto &localIterator) {
-              return localIterator.getSmoothingScale();
-            }, "SmoothingLength");
-        }
+        for (unsigned int particleType = 0; particleType < 6; particleType++)
+          saveParticleType(particleType);
 
       }
 
@@ -246,16 +376,19 @@ namespace io {
     \param mapper - particle mapper used to link particles to grid locations
     \param generators - particles generators for each particle species (vector)
     \param cosmology - cosmological parameters
+    \param nFiles - number of files to split the output across
+    \param writeOptions - chunking and filter settings for the particle datasets
     */
     template<typename OutputFloatType, typename GridDataType>
     void save(const std::string &name, double Boxlength,
               particle::mapper::ParticleMapper<GridDataType> &mapper,
               particle::SpeciesToGeneratorMap<GridDataType> &generators,
               const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-              int nFiles) {
+              int nFiles, const HDFWriteOptions &writeOptions = HDFWriteOptions()) {
 
       HighFive::SilenceHDF5 silence; // suppresses HDF5 warnings while in scope
-      GadgetHDFOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, nFiles);
+      GadgetHDFOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, nFiles,
+                                                            writeOptions);
       output(name);
 
     }
@@ -54,6 +54,7 @@ namespace io {
       T lengthFactorDisplacements; //!< Multiplicative factor from internal position units to GRAFIC/RAMSES displacement units
       T velFactor; //!< Multiplicative factor from internal velocity units to GRAFIC output velocities.
       size_t iordOffset; //!< Offset for converting grid indices on each level into global grid cell indices. Accumulates as levels are sequentially processed.
+      tools::FileWriterOptions writerOptions; //!< Back-end used to write the files.
 
     public:
       /*! \brief Constructor
@@ -68,6 +69,7 @@ namespace io {
           \param supersample - factor to supersample dark matter by.
           \param input_mask - masks used on each level.
           \param outFields - vector of output overdensity fields (needed for baryon output).
+          \param writerOptions - back-end used to write the files.
       */
       GraficOutput(const std::string &fname,
                    multilevelgrid::MultiLevelGrid<DataType> &levelContext,
@@ -78,10 +80,12 @@ namespace io {
                    size_t subsample,
                    size_t supersample,
                    std::vector<std::vector<size_t>> &input_mask,
-                   std::vector<std::shared_ptr<fields::OutputField<DataType>>> outFields) :
+                   std::vector<std::shared_ptr<fields::OutputField<DataType>>> outFields,
+                   const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) :
         outputFilename(fname),
         cosmology(cosmology),
-        pvarValue(pvarValue) {
+        pvarValue(pvarValue),
+        writerOptions(writerOptions) {
 
         this->generators = particleGenerators;
         this->outputFields = outFields;
@@ -146,7 +150,7 @@ namespace io {
 
         for (size_t i = 0; i < filenames.size(); ++i) {
           auto filename_i = filenames[i];
-          files.emplace_back(thisGridFilename + "/" + filename_i);
+          files.emplace_back(thisGridFilename + "/" + filename_i, writerOptions);
           writeHeaderForGrid(files.back(), targetGrid);
         }
 
@@ -159,47 +163,60 @@ namespace io {
           baryonFieldOnLevelPtr = outputFields[1]->getFieldForLevel(level).shared_from_this();
         }
 
-        for (size_t i_z = 0; i_z < targetGrid.size; ++i_z) {
-          pb.tick();
+        // Planes are written in batches, with one map per file covering all the planes of the batch, and the
+        // particles for the whole batch evaluated in parallel. Each batch is about one buffer's worth of data.
+        size_t bytesPerPlane = (9 * sizeof(float) + sizeof(size_t)) * targetGrid.size2;
+        size_t planesPerBatch = std::max(size_t(1), std::min(targetGrid.size, writerOptions.bufferSize / bytesPerPlane));
+        size_t floatStride = tools::MemMapFileWriter::getFortranRecordStride<float>(targetGrid.size2);
+        size_t idStride = tools::MemMapFileWriter::getFortranRecordStride<size_t>(targetGrid.size2);
+
+        for (size_t z_start = 0; z_start < targetGrid.size; z_start += planesPerBatch) {
+          size_t nPlanes = std::min(planesPerBatch, targetGrid.size - z_start);
 
           std::vector<tools::MemMapRegion<float>> varMaps;
           for (int m = 0; m < 9; ++m)
-            varMaps.push_back(files[m].getMemMapFortran<float>(targetGrid.size2));
+            varMaps.push_back(files[m].getMemMapFortranRecords<float>(targetGrid.size2, nPlanes));
 
-          tools::MemMapRegion<size_t> idMap = files[9].getMemMapFortran<size_t>(targetGrid.size2);
+          tools::MemMapRegion<size_t> idMap = files[9].getMemMapFortranRecords<size_t>(targetGrid.size2, nPlanes);
 
-#pragma omp parallel for
-          for (size_t i_y = 0; i_y < targetGrid.size; ++i_y) {
-            for (size_t i_x = 0; i_x < targetGrid.size; ++i_x) {
-              size_t i = targetGrid.getIndexFromCoordinateNoWrap(i_x, i_y, i_z);
-              size_t global_index = i + iordOffset;
-              auto particle = evaluator_dm->getParticleNoOffset(i);
+#pragma omp parallel for collapse(2)
+          for (size_t plane = 0; plane < nPlanes; ++plane) {
+            for (size_t i_y = 0; i_y < targetGrid.size; ++i_y) {
+              size_t i_z = z_start + plane;
+              for (size_t i_x = 0; i_x < targetGrid.size; ++i_x) {
+                size_t i = targetGrid.getIndexFromCoordinateNoWrap(i_x, i_y, i_z);
+                size_t global_index = i + iordOffset;
+                auto particle = evaluator_dm->getParticleNoOffset(i);
 
-              Coordinate<float> velScaled(particle.vel * velFactor);
-              Coordinate<float> posScaled(particle.pos * lengthFactorDisplacements);
+                Coordinate<float> velScaled(particle.vel * velFactor);
+                Coordinate<float> posScaled(particle.pos * lengthFactorDisplacements);
 
 
-              float deltab = (*overdensityFieldEvaluator)[i];
+                float deltab = (*overdensityFieldEvaluator)[i];
 
-              // Detect whether we are using baryons:
-              float mask = this->mask->isInMask(level, i);
-              float pvar = pvarValue * mask;
-              size_t file_index = i_y * targetGrid.size + i_x;
+                // Detect whether we are using baryons:
+                float mask = this->mask->isInMask(level, i);
+                float pvar = pvarValue * mask;
+                size_t file_index = plane * floatStride + i_y * targetGrid.size + i_x;
 
 
-              varMaps[0][file_index] = velScaled.x;
-              varMaps[1][file_index] = velScaled.y;
-              varMaps[2][file_index] = velScaled.z;
-              varMaps[3][file_index] = posScaled.x;
-              varMaps[4][file_index] = posScaled.y;
-              varMaps[5][file_index] = posScaled.z;
-              varMaps[6][file_index] = deltab;
-              varMaps[7][file_index] = mask;
-              varMaps[8][file_index] = pvar;
-              idMap[file_index] = global_index;
+                varMaps[0][file_index] = velScaled.x;
+                varMaps[1][file_index] = velScaled.y;
+                varMaps[2][file_index] = velScaled.z;
+                varMaps[3][file_index] = posScaled.x;
+                varMaps[4][file_index] = posScaled.y;
+                varMaps[5][file_index] = posScaled.z;
+                varMaps[6][file_index] = deltab;
+                varMaps[7][file_index] = mask;
+                varMaps[8][file_index] = pvar;
+                idMap[plane * idStride + i_y * targetGrid.size + i_x] = global_index;
 
+              }
             }
           }
+
+          for (size_t plane = 0; plane < nPlanes; ++plane)
+            pb.tick();
         }
         iordOffset += targetGrid.size3;
       }
@@ -252,6 +269,7 @@ namespace io {
     \param supersample - supersample factor specified in paramter file
     \param input_mask - Grafic mask being used
     \param outputFields - Vector of references to underlying overdensity fields
+    \param writerOptions - back-end used to write the files
     */
     template<typename DataType, typename T=tools::datatypes::strip_complex<DataType>>
     void save(const std::string &filename,
@@ -260,9 +278,11 @@ namespace io {
               const cosmology::CosmologicalParameters<T> &cosmology,
               const T pvarValue, Coordinate<T> center, size_t subsample, size_t supersample,
               std::vector<std::vector<size_t>> &input_mask,
-              std::vector<std::shared_ptr<fields::OutputField<DataType>>> &outputFields) {
+              std::vector<std::shared_ptr<fields::OutputField<DataType>>> &outputFields,
+              const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) {
       GraficOutput<DataType> output(filename, context, generators,
-                                    cosmology, pvarValue, center, subsample, supersample, input_mask, outputFields);
+                                    cosmology, pvarValue, center, subsample, supersample, input_mask, outputFields,
+                                    writerOptions);
       output.write();
     }
 
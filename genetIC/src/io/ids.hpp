@@ -0,0 +1,285 @@
+#ifndef IC_IDS_HPP
+#define IC_IDS_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "numpy.hpp"
+
+namespace io {
+  /*!
+  \namespace io::ids
+  \brief Read and write lists of particle IDs, as used by id_file, merge_id_file and dump_id_file.
+
+   Three formats are understood. Text files hold one ID per line (any whitespace is accepted when reading).
+   Raw binary files (extension .bin) hold native-endian 64-bit unsigned integers with no header. Numpy files
+   (extension .npy, or any file starting with the numpy magic string) hold a one-dimensional array of 8, 16, 32
+   or 64-bit integers, signed or unsigned; negative IDs are rejected.
+   Text files are parsed in parallel, and binary files need no parsing at all.
+*/
+  namespace ids {
+
+    enum class IdFileFormat {
+      text, raw, numpy
+    };
+
+    //! Number of bytes of text parsed, or IDs formatted, by each thread at a time
+    constexpr size_t idChunkBytes = 4 * 1024 * 1024;
+
+    inline bool endsWith(const std::string &filename, const std::string &extension) {
+      return filename.size() >= extension.size() &&
+             filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    //! Decides the format of an ID file from its extension, or (when reading) from its first bytes
+    inline IdFileFormat getFormat(const std::string &filename, bool checkContents) {
+      if (endsWith(filename, ".npy"))
+        return IdFileFormat::numpy;
+      if (endsWith(filename, ".bin"))
+        return IdFileFormat::raw;
+      if (checkContents) {
+        std::ifstream f(filename, std::ios::binary);
+        char magic[6] = {};
+        if (f.read(magic, 6) && std::string(magic, 6) == "\x93NUMPY")
+          return IdFileFormat::numpy;
+      }
+      return IdFileFormat::text;
+    }
+
+    inline bool isSpace(char c) {
+      return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    //! Parses whitespace-separated integers in [begin, end), returning false if anything else is found
+    template<typename T>
+    bool parseIds(const char *begin, const char *end, std::vector<T> &store) {
+      const char *p = begin;
+      while (true) {
+        while (p < end && isSpace(*p)) ++p;
+        if (p == end)
+          return true;
+        T value;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc() || (result.ptr < end && !isSpace(*result.ptr)))
+          return false;
+        store.push_back(value);
+        p = result.ptr;
+      }
+    }
+
+    /*! \brief Parses a text ID file, splitting it between threads.
+
+        The file is mapped and cut into chunks, each moved forward to the start of the next ID. The chunks are
+        parsed independently and the results concatenated, so the IDs keep their order in the file.
+    */
+    template<typename T>
+    void loadText(std::vector<T> &store, const std::string &filename) {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd == -1)
+        throw std::runtime_error("File " + filename + " not found");
+      struct stat fileStatus;
+      if (::fstat(fd, &fileStatus) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Error reading file " + filename);
+      }
+      size_t length = static_cast<size_t>(fileStatus.st_size);
+      if (length == 0) {
+        ::close(fd);
+        return;
+      }
+      void *addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (addr == MAP_FAILED)
+        throw std::runtime_error("Error reading file " + filename);
+      const char *text = static_cast<const char *>(addr);
+
+      std::vector<size_t> chunkStarts;
+      for (size_t start = 0; start < length; start += idChunkBytes) {
+        size_t actualStart = std::max(start, chunkStarts.empty() ? 0 : chunkStarts.back());
+        while (actualStart > 0 && actualStart < length && !isSpace(text[actualStart - 1]))
+          ++actualStart;
+        chunkStarts.push_back(actualStart);
+      }
+      chunkStarts.push_back(length);
+
+      size_t nChunks = chunkStarts.size() - 1;
+      std::vector<std::vector<T>> chunkIds(nChunks);
+      bool ok = true;
+
+#pragma omp parallel for schedule(dynamic)
+      for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+        if (!parseIds(text + chunkStarts[chunk], text + chunkStarts[chunk + 1], chunkIds[chunk])) {
+#pragma omp atomic write
+          ok = false;
+        }
+      }
+      ::munmap(addr, length);
+
+      if (!ok)
+        throw std::runtime_error("Error reading file " + filename);
+
+      std::vector<size_t> offsets(nChunks + 1, store.size());
+      for (size_t chunk = 0; chunk < nChunks; ++chunk)
+        offsets[chunk + 1] = offsets[chunk] + chunkIds[chunk].size();
+      store.resize(offsets.back());
+
+#pragma omp parallel for schedule(dynamic)
+      for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+        std::copy(chunkIds[chunk].begin(), chunkIds[chunk].end(), store.begin() + offsets[chunk]);
+        std::vector<T>().swap(chunkIds[chunk]);
+      }
+    }
+
+    //! Reads a raw binary ID file, holding native-endian 64-bit unsigned integers
+    template<typename T>
+    void loadRaw(std::vector<T> &store, const std::string &filename) {
+      std::ifstream f(filename, std::ios::binary | std::ios::ate);
+      if (!f.is_open())
+        throw std::runtime_error("File " + filename + " not found");
+      size_t length = static_cast<size_t>(f.tellg());
+      if (length % sizeof(uint64_t) != 0)
+        throw std::runtime_error("Binary ID file " + filename + " does not hold a whole number of 64-bit IDs");
+      f.seekg(0);
+
+      size_t n = length / sizeof(uint64_t);
+      size_t initialSize = store.size();
+      store.resize(initialSize + n);
+      if constexpr (sizeof(T) == sizeof(uint64_t)) {
+        f.read(reinterpret_cast<char *>(store.data() + initialSize), length);
+      } else {
+        std::vector<uint64_t> buffer(n);
+        f.read(reinterpret_cast<char *>(buffer.data()), length);
+        std::copy(buffer.begin(), buffer.end(), store.begin() + initialSize);
+      }
+      if (!f)
+        throw std::runtime_error("Error reading file " + filename);
+    }
+
+    /*! \brief Reads a one-dimensional numpy array of IDs, of any signed or unsigned integer type up to 64 bits.
+
+        IDs are stored unsigned, so a signed array is checked after conversion: a negative ID wraps round to a value
+        with its top bit set, which is rejected.
+    */
+    template<typename T>
+    void loadNumpy(std::vector<T> &store, const std::string &filename) {
+      numpy::MappedNumpyArray array(filename);
+      if (array.getShape().size() != 1)
+        throw std::runtime_error("Numpy ID file " + filename + " must hold a one-dimensional array");
+      if (array.getDataType() != 'i' && array.getDataType() != 'u')
+        throw std::runtime_error("Numpy ID file " + filename + " must hold integers");
+      size_t initialSize = store.size();
+      store.resize(initialSize + array.getNumElements());
+      array.copyTo(store.data() + initialSize);
+
+      if (array.getDataType() == 'i') {
+        static_assert(std::is_unsigned<T>::value, "IDs are expected to be stored unsigned");
+        const T firstNegative = T(std::numeric_limits<std::make_signed_t<T>>::max()) + 1;
+        bool anyNegative = false;
+#pragma omp parallel for reduction(||:anyNegative)
+        for (size_t i = initialSize; i < store.size(); ++i)
+          anyNegative = anyNegative || store[i] >= firstNegative;
+        if (anyNegative) {
+          store.resize(initialSize);
+          throw std::runtime_error("Numpy ID file " + filename + " contains negative IDs");
+        }
+      }
+    }
+
+    //! Appends the IDs in the given file, in any of the supported formats, to store
+    template<typename T>
+    void load(std::vector<T> &store, const std::string &filename) {
+      switch (getFormat(filename, true)) {
+        case IdFileFormat::numpy:
+          loadNumpy(store, filename);
+          break;
+        case IdFileFormat::raw:
+          loadRaw(store, filename);
+          break;
+        case IdFileFormat::text:
+          loadText(store, filename);
+          break;
+      }
+    }
+
+    //! Writes IDs as text, one per line, formatting chunks of the list in parallel
+    template<typename T>
+    void saveText(const std::vector<T> &store, const std::string &filename) {
+      std::ofstream f(filename, std::ios::binary);
+      if (!f.is_open())
+        throw std::runtime_error("Can't open file " + filename);
+
+      // 21 characters is enough for any 64-bit integer plus its newline
+      const size_t idsPerChunk = idChunkBytes / 21;
+      const size_t nChunks = (store.size() + idsPerChunk - 1) / idsPerChunk;
+      std::vector<std::string> chunkText(nChunks);
+
+#pragma omp parallel for schedule(dynamic)
+      for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+        size_t start = chunk * idsPerChunk;
+        size_t end = std::min(start + idsPerChunk, store.size());
+        std::string &text = chunkText[chunk];
+        text.resize((end - start) * 21);
+        char *p = text.data();
+        for (size_t i = start; i < end; ++i) {
+          p = std::to_chars(p, text.data() + text.size(), store[i]).ptr;
+          *p++ = '\n';
+        }
+        text.resize(p - text.data());
+      }
+
+      for (const auto &text : chunkText)
+        f.write(text.data(), text.size());
+      if (!f)
+        throw std::runtime_error("Error writing file " + filename);
+    }
+
+    //! Writes IDs as native-endian 64-bit unsigned integers
+    template<typename T>
+    void saveRaw(const std::vector<T> &store, const std::string &filename) {
+      std::ofstream f(filename, std::ios::binary);
+      if (!f.is_open())
+        throw std::runtime_error("Can't open file " + filename);
+      if constexpr (sizeof(T) == sizeof(uint64_t)) {
+        f.write(reinterpret_cast<const char *>(store.data()), store.size() * sizeof(uint64_t));
+      } else {
+        std::vector<uint64_t> buffer(store.begin(), store.end());
+        f.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(uint64_t));
+      }
+      if (!f)
+        throw std::runtime_error("Error writing file " + filename);
+    }
+
+    //! Writes IDs in the format implied by the extension of the filename (.npy, .bin, or otherwise text)
+    template<typename T>
+    void save(const std::vector<T> &store, const std::string &filename) {
+      switch (getFormat(filename, false)) {
+        case IdFileFormat::numpy: {
+          if (store.size() > size_t(std::numeric_limits<int>::max()))
+            throw std::runtime_error("Too many IDs to write to a numpy file");
+          const int length = static_cast<int>(store.size());
+          numpy::SaveConvertedArrayAsNumpy<uint64_t>(filename, false, 1, &length, store.data());
+          break;
+        }
+        case IdFileFormat::raw:
+          saveRaw(store, filename);
+          break;
+        case IdFileFormat::text:
+          saveText(store, filename);
+          break;
+      }
+    }
+  }
+}
+
+#endif
@@ -23,14 +23,22 @@
 #pragma once
 
 #include <algorithm>
+#include <cerrno>
 #include <complex>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 #include <stdint.h>
 #include <string>
+#include <type_traits>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #if defined (__GLIBC__)
 # include <endian.h>
 # if (__BYTE_ORDER == __LITTLE_ENDIAN)
@@ -106,6 +114,26 @@ namespace io {
         static const char value = 'i';
       };
       template<>
+      struct DescriptorDataType<long> {
+        static const char value = 'i';
+      };
+      template<>
+      struct DescriptorDataType<long long> {
+        static const char value = 'i';
+      };
+      template<>
+      struct DescriptorDataType<unsigned int> {
+        static const char value = 'u';
+      };
+      template<>
+      struct DescriptorDataType<unsigned long> {
+        static const char value = 'u';
+      };
+      template<>
+      struct DescriptorDataType<unsigned long long> {
+        static const char value = 'u';
+      };
+      template<>
       struct DescriptorDataType<std::complex<float> > {
         static const char value = 'c';
       };
@@ -167,17 +195,106 @@ namespace io {
         preamble.append(reinterpret_cast<char *>(&header_length), 2);
       }
 
+      //! Identifies complex scalar types, which are stored in .npy files as interleaved real and imaginary parts
+      template<typename Scalar>
+      struct IsComplex : std::false_type {
+      };
+      template<typename Scalar>
+      struct IsComplex<std::complex<Scalar> > : std::true_type {
+      };
+
+      //! Converts a single value between scalar types; a complex value can only be converted to another complex type
+      template<typename Target, typename Source>
+      inline Target ConvertScalar(const Source &value) {
+        if constexpr (IsComplex<Target>::value && IsComplex<Source>::value) {
+          return Target(value.real(), value.imag());
+        } else if constexpr (IsComplex<Target>::value) {
+          return Target(value, 0);
+        } else if constexpr (IsComplex<Source>::value) {
+          // Callers reject complex to real conversions before getting here
+          return Target(value.real());
+        } else {
+          return static_cast<Target>(value);
+        }
+      }
+
+      //! Number of bytes handled at a time by each thread when copying or writing arrays
+      constexpr size_t ChunkBytes = 16 * 1024 * 1024;
+
+      //! Converts n values stored in the file's representation at source into dest, reversing bytes if required
+      template<typename FileScalar, typename Scalar>
+      void ConvertArray(const char *source, Scalar *dest, size_t n, bool swapBytes) {
+        constexpr size_t componentSize = IsComplex<FileScalar>::value ? sizeof(FileScalar) / 2 : sizeof(FileScalar);
+        const size_t chunkSize = ChunkBytes / sizeof(FileScalar);
+        const size_t nChunks = (n + chunkSize - 1) / chunkSize;
+
+        if constexpr (std::is_same<FileScalar, Scalar>::value) {
+          if (!swapBytes) {
+#pragma omp parallel for schedule(static)
+            for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+              size_t start = chunk * chunkSize;
+              size_t count = std::min(chunkSize, n - start);
+              std::memcpy(dest + start, source + start * sizeof(FileScalar), count * sizeof(FileScalar));
+            }
+            return;
+          }
+        }
+
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < n; ++i) {
+          FileScalar value;
+          char *bytes = reinterpret_cast<char *>(&value);
+          std::memcpy(bytes, source + i * sizeof(FileScalar), sizeof(FileScalar));
+          if (swapBytes) {
+            for (size_t c = 0; c < sizeof(FileScalar); c += componentSize)
+              std::reverse(bytes + c, bytes + c + componentSize);
+          }
+          dest[i] = ConvertScalar<Scalar>(value);
+        }
+      }
+
+      //! Writes the whole of the given buffer at the given offset, returning false on failure
+      inline bool WriteFully(int fd, const char *buffer, size_t length, size_t offset) {
+        while (length > 0) {
+          ssize_t written = ::pwrite(fd, buffer, length, static_cast<off_t>(offset));
+          if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+          }
+          buffer += written;
+          length -= static_cast<size_t>(written);
+          offset += static_cast<size_t>(written);
+        }
+        return true;
+      }
+
     } // namespace detail
 
+    //! Single precision type with the same complexity as Scalar, used for reduced-size grid dumps
     template<typename Scalar>
-    void SaveArrayAsNumpy(
+    struct SinglePrecision {
+      using type = float;
+    };
+    template<typename Scalar>
+    struct SinglePrecision<std::complex<Scalar> > {
+      using type = std::complex<float>;
+    };
+
+    /*! \brief Writes an array to a .npy file holding values of type FileScalar, converting from Scalar if required
+
+        The data is written in chunks with pwrite, with each thread converting and writing its own chunks.
+    */
+    template<typename FileScalar, typename Scalar>
+    void SaveConvertedArrayAsNumpy(
         const std::string &filename, bool fortran_order,
         int n_dims, const int shape[], const Scalar *data) {
+      static_assert(detail::IsComplex<FileScalar>::value || !detail::IsComplex<Scalar>::value,
+                    "Complex data cannot be written to a real .npy file");
       if (n_dims <= 0)
         throw std::invalid_argument("received an invalid argument");
 
       std::string preamble, header;
-      std::string descriptor = detail::CreateDescriptor<Scalar>();
+      std::string descriptor = detail::CreateDescriptor<FileScalar>();
       detail::CreateMetaData(
           preamble, header, descriptor, fortran_order, n_dims, shape);
       const size_t metadata_length = preamble.size() + header.size();
@@ -185,15 +302,56 @@ namespace io {
         throw std::runtime_error(
             "formatting error: metadata length is not divisible by 16.");
       }
-      std::ofstream stream(
-          filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
-      if (!stream) {
+
+      size_t size = 1;
+      for (int i = 0; i < n_dims; ++i) { size *= static_cast<size_t>(shape[i]); }
+
+      int fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1) {
         throw std::runtime_error("io error: failed to open a file.");
       }
-      stream << preamble << header;
-      int size = 1;
-      for (int i = 0; i < n_dims; ++i) { size *= shape[i]; }
-      stream.write(reinterpret_cast<const char *>(data), sizeof(Scalar) * size);
+      std::string metadata = preamble + header;
+      bool ok = detail::WriteFully(fd, metadata.data(), metadata.size(), 0) &&
+                ::ftruncate(fd, static_cast<off_t>(metadata_length + size * sizeof(FileScalar))) == 0;
+
+      const size_t chunkSize = detail::ChunkBytes / sizeof(FileScalar);
+      const size_t nChunks = ok ? (size + chunkSize - 1) / chunkSize : 0;
+
+#pragma omp parallel
+      {
+        std::vector<FileScalar> buffer;
+#pragma omp for schedule(dynamic)
+        for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+          size_t start = chunk * chunkSize;
+          size_t count = std::min(chunkSize, size - start);
+          const char *bytes;
+          if constexpr (std::is_same<FileScalar, Scalar>::value) {
+            bytes = reinterpret_cast<const char *>(data + start);
+          } else {
+            buffer.resize(count);
+            for (size_t i = 0; i < count; ++i)
+              buffer[i] = detail::ConvertScalar<FileScalar>(data[start + i]);
+            bytes = reinterpret_cast<const char *>(buffer.data());
+          }
+          if (!detail::WriteFully(fd, bytes, count * sizeof(FileScalar),
+                                  metadata_length + start * sizeof(FileScalar))) {
+#pragma omp atomic write
+            ok = false;
+          }
+        }
+      }
+
+      ::close(fd);
+      if (!ok) {
+        throw std::runtime_error("io error: failed to write " + filename);
+      }
+    }
+
+    template<typename Scalar>
+    void SaveArrayAsNumpy(
+        const std::string &filename, bool fortran_order,
+        int n_dims, const int shape[], const Scalar *data) {
+      SaveConvertedArrayAsNumpy<Scalar>(filename, fortran_order, n_dims, shape, data);
     }
 
     template<typename Scalar>
@@ -238,89 +396,200 @@ namespace io {
       SaveArrayAsNumpy(filename, false, 4, dim, data);
     }
 
-    template<typename Scalar>
-    void LoadArrayFromNumpy(
-        const std::string &filename, std::vector<int> &shape,
-        std::vector<Scalar> &data) {
-      std::ifstream stream(filename.c_str(), std::ios::in | std::ios::binary);
-      if (!stream) {
-        throw std::runtime_error("io error: failed to open a file.");
+    /*! \class MappedNumpyArray
+        \brief Read-only memory map of a .npy file.
+
+        The header is parsed on construction; the data can then be copied straight into its destination with copyTo,
+        which converts precision and byte order in parallel without an intermediate copy of the whole array.
+    */
+    class MappedNumpyArray {
+    protected:
+      char *mapping = nullptr; //!< Start of the mapped file
+      size_t mappingSize = 0; //!< Size of the mapped file in bytes
+      const char *dataStart = nullptr; //!< Start of the array data within the mapping
+      std::vector<int> shape; //!< Shape of the array, in C order
+      char dataType; //!< Numpy data kind ('f' for floating point, 'c' for complex, ...)
+      size_t wordSize; //!< Size in bytes of each element
+      bool swapBytes; //!< True if the file's byte order differs from this machine's
+      size_t numElements; //!< Total number of elements in the array
+
+    public:
+      explicit MappedNumpyArray(const std::string &filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+          throw std::runtime_error("io error: failed to open a file.");
+        }
+        struct stat fileStatus;
+        if (::fstat(fd, &fileStatus) != 0 || fileStatus.st_size < 10) {
+          ::close(fd);
+          throw std::runtime_error(
+              "io error: this file do not have a valid npy format.");
+        }
+        mappingSize = static_cast<size_t>(fileStatus.st_size);
+        void *addr = ::mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+          throw std::runtime_error("io error: failed to map " + filename);
+        }
+        mapping = static_cast<char *>(addr);
+
+        try {
+          parseHeader();
+        } catch (...) {
+          ::munmap(mapping, mappingSize);
+          throw;
+        }
       }
-      // check if this file is the valid .npy file
-      std::string valid_preamble = "\x93NUMPY";
-      valid_preamble.push_back(char(1));
-      valid_preamble.push_back(char(0));
-      std::string preamble(8, ' ');
-      stream.read(&preamble[0], 8);
-      if (valid_preamble != preamble) {
-        throw std::runtime_error(
-            "io error: this file do not have a valid npy format.");
+
+      MappedNumpyArray(const MappedNumpyArray &) = delete;
+
+      MappedNumpyArray &operator=(const MappedNumpyArray &) = delete;
+
+      ~MappedNumpyArray() {
+        ::munmap(mapping, mappingSize);
       }
-      // load header
-      uint16_t header_length;
-      stream.read(reinterpret_cast<char *>(&header_length), sizeof(uint16_t));
-      header_length = detail::ReorderInteger(header_length);
-      if ((header_length + preamble.size() + sizeof(uint16_t)) % 16 != 0) {
-        throw std::runtime_error(
-            "formatting error: metadata length is not divisible by 16.");
+
+      //! Shape of the array, in C order
+      const std::vector<int> &getShape() const {
+        return shape;
       }
-      std::string header(header_length, ' ');
-      stream.read(reinterpret_cast<char *>(&header[0]), header_length);
-
-      // load fortran order
-      typedef std::string::size_type size_type;
-      const size_type header_loc = header.find("fortran_order") + 16;
-      const bool fortran_order = (header.substr(header_loc, 4) == "True");
-
-      // load shape
-      const size_type shape_loc1 = header.find("(");
-      const size_type shape_loc2 = header.find(")");
-      std::string shape_str = header.substr(
-          shape_loc1 + 1, shape_loc2 - shape_loc1 - 1);
-      if (shape_str[shape_str.size() - 1] == ',') shape.resize(1);
-      else shape.resize(std::count(shape_str.begin(), shape_str.end(), ',') + 1);
-      for (size_t i = 0; i < shape.size(); ++i) {
-        std::stringstream ss;
-        const size_type loc = shape_str.find(",");
-        ss << shape_str.substr(0, loc);
-        ss >> shape[i];
-        shape_str = shape_str.substr(loc + 1);
+
+      //! Total number of elements in the array
+      size_t getNumElements() const {
+        return numElements;
+      }
+
+      //! Numpy data kind of the elements ('f', 'c', 'i' or 'u')
+      char getDataType() const {
+        return dataType;
       }
-      if (fortran_order) {
-        std::reverse(shape.begin(), shape.end());
+
+      //! Copies all elements into dest, which must have room for getNumElements() values
+      template<typename Scalar>
+      void copyTo(Scalar *dest) const {
+        if (dataType == 'c' && !detail::IsComplex<Scalar>::value) {
+          throw std::runtime_error(
+              "The .npy file data type does not match the expected type");
+        }
+        if (dataType == 'f' && wordSize == sizeof(float))
+          detail::ConvertArray<float>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'f' && wordSize == sizeof(double))
+          detail::ConvertArray<double>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'c' && wordSize == sizeof(std::complex<float>))
+          detail::ConvertArray<std::complex<float> >(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'c' && wordSize == sizeof(std::complex<double>))
+          detail::ConvertArray<std::complex<double> >(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'i' && wordSize == sizeof(int8_t))
+          detail::ConvertArray<int8_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'i' && wordSize == sizeof(int16_t))
+          detail::ConvertArray<int16_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'i' && wordSize == sizeof(int32_t))
+          detail::ConvertArray<int32_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'i' && wordSize == sizeof(int64_t))
+          detail::ConvertArray<int64_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'u' && wordSize == sizeof(uint8_t))
+          detail::ConvertArray<uint8_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'u' && wordSize == sizeof(uint16_t))
+          detail::ConvertArray<uint16_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'u' && wordSize == sizeof(uint32_t))
+          detail::ConvertArray<uint32_t>(dataStart, dest, numElements, swapBytes);
+        else if (dataType == 'u' && wordSize == sizeof(uint64_t))
+          detail::ConvertArray<uint64_t>(dataStart, dest, numElements, swapBytes);
+        else
+          throw std::runtime_error(
+              "The .npy file data type does not match the expected type");
       }
 
-      // load descriptor
-      const size_type descr_loc = header.find("descr") + 9;
-      const char endian_str = header[descr_loc];
-      const bool little_endian = (endian_str == '<' || endian_str == '|');
+    protected:
+      void parseHeader() {
+        // check if this file is the valid .npy file; versions 2 and 3 differ only in the size of the header length
+        const std::string magic = "\x93NUMPY";
+        if (std::string(mapping, 6) != magic) {
+          throw std::runtime_error(
+              "io error: this file do not have a valid npy format.");
+        }
+        const int major_version = mapping[6];
+        size_t preamble_length, header_length;
+        if (major_version == 1) {
+          uint16_t length;
+          std::memcpy(&length, mapping + 8, sizeof(uint16_t));
+          header_length = detail::ReorderInteger(length);
+          preamble_length = 8 + sizeof(uint16_t);
+        } else if ((major_version == 2 || major_version == 3) && mappingSize >= 12) {
+          uint32_t length;
+          std::memcpy(&length, mapping + 8, sizeof(uint32_t));
+#ifdef AOBA_NUMPY_BIG_ENDIAN
+          length = __builtin_bswap32(length);
+#endif
+          header_length = length;
+          preamble_length = 8 + sizeof(uint32_t);
+        } else {
+          throw std::runtime_error(
+              "io error: this file do not have a valid npy format.");
+        }
+        if (preamble_length + header_length > mappingSize) {
+          throw std::runtime_error(
+              "io error: this file do not have a valid npy format.");
+        }
+        const std::string header(mapping + preamble_length, header_length);
+        dataStart = mapping + preamble_length + header_length;
+
+        // load fortran order
+        typedef std::string::size_type size_type;
+        const size_type header_loc = header.find("fortran_order") + 16;
+        const bool fortran_order = (header.substr(header_loc, 4) == "True");
+
+        // load shape
+        const size_type shape_loc1 = header.find("(");
+        const size_type shape_loc2 = header.find(")");
+        std::string shape_str = header.substr(
+            shape_loc1 + 1, shape_loc2 - shape_loc1 - 1);
+        if (shape_str[shape_str.size() - 1] == ',') shape.resize(1);
+        else shape.resize(std::count(shape_str.begin(), shape_str.end(), ',') + 1);
+        for (size_t i = 0; i < shape.size(); ++i) {
+          std::stringstream ss;
+          const size_type loc = shape_str.find(",");
+          ss << shape_str.substr(0, loc);
+          ss >> shape[i];
+          shape_str = shape_str.substr(loc + 1);
+        }
+        if (fortran_order) {
+          std::reverse(shape.begin(), shape.end());
+        }
+
+        // load descriptor
+        const size_type descr_loc = header.find("descr") + 9;
+        const char endian_str = header[descr_loc];
+        const bool little_endian = (endian_str == '<' || endian_str == '|');
 #ifdef AOBA_NUMPY_BIG_ENDIAN
-      const bool is_same_endian = !little_endian;
+        swapBytes = (endian_str == '<');
 #else
-      const bool is_same_endian = little_endian;
+        swapBytes = !little_endian;
 #endif
-      if (!is_same_endian) {
-        throw std::runtime_error(
-            "The numpy file has a different endian convention, which is not supported.");
-      }
-      const char data_type = header[descr_loc + 1];
-      size_t word_size;
-      std::stringstream ss;
-      ss << header[descr_loc + 2];
-      ss >> word_size;
-      if (data_type != detail::DescriptorDataType<Scalar>::value ||
-          word_size != sizeof(Scalar)) {
-        throw std::runtime_error(
-            "The .npy file data type does not match the expected type");
-      }
+        dataType = header[descr_loc + 1];
+        std::stringstream ss(header.substr(descr_loc + 2));
+        ss >> wordSize;
 
-      // load data
-      size_t total = 1;
-      for (size_t i = 0; i < shape.size(); ++i) {
-        total *= shape[i];
+        // check the data is all present
+        numElements = 1;
+        for (size_t i = 0; i < shape.size(); ++i) {
+          numElements *= static_cast<size_t>(shape[i]);
+        }
+        if (static_cast<size_t>(dataStart - mapping) + numElements * wordSize > mappingSize) {
+          throw std::runtime_error(
+              "io error: the .npy file is shorter than its header implies.");
+        }
       }
-      data.resize(total);
-      stream.read(reinterpret_cast<char *>(&data[0]), word_size * total);
+    };
+
+    template<typename Scalar>
+    void LoadArrayFromNumpy(
+        const std::string &filename, std::vector<int> &shape,
+        std::vector<Scalar> &data) {
+      MappedNumpyArray array(filename);
+      shape = array.getShape();
+      data.resize(array.getNumElements());
+      array.copyTo(data.data());
     }
 
     template<typename Scalar>
@@ -0,0 +1,349 @@
+#ifndef IC_SHM_HPP
+#define IC_SHM_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include "gadget.hpp"
+
+namespace io {
+  /*!
+  \namespace io::shm
+  \brief Publish particle data in a POSIX shared-memory segment, for a simulation code running on the same machine.
+
+   The segment starts with a ShmHeader, which describes the layout of the particle arrays that follow. Particles
+   are ordered by gadget type, as in a single gadget file, and positions and velocities use the gadget conventions.
+   A consumer maps the segment read-only (see SharedMemoryReader) and uses the arrays in place, without any copies.
+*/
+  namespace shm {
+
+    //! Value of ShmHeader::magic, which identifies a genetIC segment ("genetICs" read as a little-endian integer)
+    constexpr uint64_t shmMagic = 0x734349746e656567ULL;
+
+    //! Version of the layout described by ShmHeader; changed whenever the layout changes
+    constexpr uint32_t shmVersion = 1;
+
+    //! Alignment of each array within the segment, in bytes
+    constexpr uint64_t shmArrayAlignment = 64;
+
+    /*! \struct ShmHeader
+        \brief Descriptor at the start of a genetIC shared-memory segment.
+
+        Offsets are in bytes from the start of the segment. Positions and velocities are stored as three floats of
+        floatSize bytes per particle, IDs as unsigned 64-bit integers, and masses as one float per particle if
+        massesOffset is non-zero; otherwise all particles of a type have the mass given in massTable.
+    */
+    struct ShmHeader {
+      uint64_t magic; //!< Always shmMagic
+      uint32_t version; //!< Always shmVersion
+      uint32_t floatSize; //!< Size in bytes of the floats used for positions, velocities and masses (4 or 8)
+      uint64_t segmentSize; //!< Total size of the segment in bytes
+      uint64_t nTotal; //!< Total number of particles
+      uint64_t nPartPerType[6]; //!< Number of particles of each gadget type, which are stored in type order
+      double massTable[6]; //!< Mass of the particles of each gadget type, or zero if masses are stored per particle
+      double scaleFactor; //!< Scale factor of the initial conditions
+      double boxSize; //!< Size of the simulation box in Mpc/h
+      double omega0; //!< Total matter density fraction
+      double omegaLambda; //!< Dark energy density fraction
+      double omegaBaryons; //!< Baryon density fraction
+      double hubbleParam; //!< Hubble rate in units of 100 km s^-1 Mpc^-1
+      uint64_t positionsOffset; //!< Offset of the positions
+      uint64_t velocitiesOffset; //!< Offset of the velocities
+      uint64_t idsOffset; //!< Offset of the particle IDs
+      uint64_t massesOffset; //!< Offset of the per-particle masses, or zero if massTable applies
+      uint32_t complete; //!< Set to 1 once all the particle data has been written
+      uint32_t reserved; //!< Unused, for alignment
+    };
+
+    // tools/compare.py reads the descriptor with its own copy of this layout, and checks the version and size
+    static_assert(sizeof(ShmHeader) == 216, "ShmHeader layout has changed: update shmVersion and tools/compare.py");
+
+    //! Returns the segment name (of the form /genetIC_name) to use for the given output path
+    inline std::string getSegmentName(const std::string &outputPath) {
+      return "/genetIC_" + outputPath.substr(outputPath.find_last_of('/') + 1);
+    }
+
+    /*! \class SharedMemoryOutput
+        \brief Writes particles into a shared-memory segment, with the same content as a single gadget file.
+    */
+    template<typename GridDataType, typename OutputFloatType>
+    class SharedMemoryOutput : public gadget::GadgetOutput<GridDataType, OutputFloatType> {
+    protected:
+      using ParticleBatchType = typename gadget::GadgetOutput<GridDataType, OutputFloatType>::ParticleBatchType;
+      ShmHeader header; //!< Descriptor, filled in by writeHeaderOneFile and copied to the segment when complete
+
+      //! Round up to the alignment used for arrays in the segment
+      static uint64_t alignArray(uint64_t offset) {
+        return ((offset + shmArrayAlignment - 1) / shmArrayAlignment) * shmArrayAlignment;
+      }
+
+      void writeHeaderOneFile(size_t, std::vector<size_t> nPartPerTypeThisFile) override {
+        using CoordinateType = Coordinate<OutputFloatType>;
+
+        ::memset(&header, 0, sizeof(header));
+        header.magic = shmMagic;
+        header.version = shmVersion;
+        header.floatSize = sizeof(OutputFloatType);
+        header.nTotal = this->nTotal;
+        for (unsigned int i = 0; i < 6; ++i) {
+          header.nPartPerType[i] = nPartPerTypeThisFile[i];
+          header.massTable[i] = this->masses[i];
+        }
+        header.scaleFactor = this->cosmology.scalefactor;
+        header.boxSize = this->boxLength;
+        header.omega0 = this->cosmology.OmegaM0;
+        header.omegaLambda = this->cosmology.OmegaLambda0;
+        header.omegaBaryons = this->cosmology.OmegaBaryons0;
+        header.hubbleParam = this->cosmology.hubble;
+
+        header.positionsOffset = alignArray(sizeof(ShmHeader));
+        header.velocitiesOffset = alignArray(header.positionsOffset + this->nTotal * sizeof(CoordinateType));
+        header.idsOffset = alignArray(header.velocitiesOffset + this->nTotal * sizeof(CoordinateType));
+        uint64_t end = header.idsOffset + this->nTotal * sizeof(uint64_t);
+        if (this->variableMass) {
+          header.massesOffset = alignArray(end);
+          end = header.massesOffset + this->nTotal * sizeof(OutputFloatType);
+        }
+        header.segmentSize = end;
+      }
+
+    public:
+      /*! \brief Constructor
+
+          \param boxLength - size of simulation box in Mpc/h.
+          \param mapper - particle mapper used to create output particles.
+          \param generators_ - vector of particle generators for each species.
+          \param cosmology - struct containing cosmological parameters.
+      */
+      SharedMemoryOutput(double boxLength,
+                         particle::mapper::ParticleMapper<GridDataType> &mapper,
+                         const particle::SpeciesToGeneratorMap<GridDataType> &generators_,
+                         const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology) :
+        gadget::GadgetOutput<GridDataType, OutputFloatType>(boxLength, mapper, generators_, cosmology, 0, 1) {}
+
+      /*! \brief Write the particles into the named segment, replacing any existing segment of that name
+
+          A consumer that still has an earlier segment of the same name mapped keeps its copy intact.
+      */
+      void operator()(const std::string &segmentName) override {
+        using CoordinateType = Coordinate<OutputFloatType>;
+
+        this->preScanForMassesAndParticleNumbers();
+        this->writeHeader();
+
+        ::shm_unlink(segmentName.c_str()); // there may be nothing to remove
+        int fd = ::shm_open(segmentName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd == -1)
+          throw std::runtime_error("Failed to create shared memory segment " + segmentName + " (reason: " +
+                                   std::string(::strerror(errno)) + ")");
+
+        if (::ftruncate(fd, header.segmentSize) != 0) {
+          std::string reason(::strerror(errno));
+          ::close(fd);
+          ::shm_unlink(segmentName.c_str());
+          throw std::runtime_error("Failed to size shared memory segment " + segmentName + " (reason: " + reason + ")");
+        }
+
+        char *base = static_cast<char *>(::mmap(nullptr, header.segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                               fd, 0));
+        ::close(fd);
+        if (base == MAP_FAILED) {
+          ::shm_unlink(segmentName.c_str());
+          throw std::runtime_error("Failed to map shared memory segment " + segmentName + " (reason: " +
+                                   std::string(::strerror(errno)) + ")");
+        }
+
+        auto positions = reinterpret_cast<CoordinateType *>(base + header.positionsOffset);
+        auto velocities = reinterpret_cast<CoordinateType *>(base + header.velocitiesOffset);
+        auto ids = reinterpret_cast<uint64_t *>(base + header.idsOffset);
+        auto masses = reinterpret_cast<OutputFloatType *>(base + header.massesOffset);
+        bool writeMass = this->variableMass;
+
+        size_t nWritten = this->iterateParticleBatches({0, 1, 2, 3, 4, 5},
+                                                       [&](size_t addr, const ParticleBatchType &batch) {
+          for (size_t k = 0; k < batch.size(); ++k) {
+            positions[addr + k] = CoordinateType(batch.pos[k]);
+            velocities[addr + k] = CoordinateType(batch.vel[k]);
+            ids[addr + k] = batch.id[k];
+          }
+          if (writeMass) {
+            for (size_t k = 0; k < batch.size(); ++k)
+              masses[addr + k] = batch.mass[k];
+          }
+        });
+        assert(nWritten == this->nTotal);
+
+        // Publish the descriptor last, so that a consumer seeing complete==1 also sees all the particle data
+        header.complete = 0;
+        ::memcpy(base, &header, sizeof(header));
+        std::atomic_thread_fence(std::memory_order_release);
+        reinterpret_cast<ShmHeader *>(base)->complete = 1;
+
+        ::munmap(base, header.segmentSize);
+      }
+
+      //! Returns the descriptor of the segment last written
+      const ShmHeader &getHeader() const {
+        return header;
+      }
+
+    };
+
+    /*! \class SharedMemoryReader
+        \brief Reference reader for segments written by SharedMemoryOutput.
+
+        Maps the segment read-only and checks its descriptor; the arrays can then be used in place for as long as the
+        reader exists.
+    */
+    class SharedMemoryReader {
+    protected:
+      const char *base = nullptr; //!< Start of the mapped segment
+      size_t size = 0; //!< Size of the mapped segment in bytes
+
+      //! Returns a pointer to the array at the given offset, after checking the float size matches
+      template<typename T>
+      const T *getArray(uint64_t offset, size_t elementFloatSize) const {
+        if (elementFloatSize != 0 && elementFloatSize != getHeader().floatSize)
+          throw std::runtime_error("Shared memory segment uses " + std::to_string(getHeader().floatSize) +
+                                   "-byte floats, not " + std::to_string(elementFloatSize));
+        return reinterpret_cast<const T *>(base + offset);
+      }
+
+    public:
+      //! Map the named segment, which must have been completely written
+      explicit SharedMemoryReader(const std::string &segmentName) {
+        int fd = ::shm_open(segmentName.c_str(), O_RDONLY, 0);
+        if (fd == -1)
+          throw std::runtime_error("Failed to open shared memory segment " + segmentName + " (reason: " +
+                                   std::string(::strerror(errno)) + ")");
+
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(ShmHeader)) {
+          ::close(fd);
+          throw std::runtime_error("Shared memory segment " + segmentName + " is too small to be a genetIC segment");
+        }
+        size = info.st_size;
+
+        void *addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+          throw std::runtime_error("Failed to map shared memory segment " + segmentName + " (reason: " +
+                                   std::string(::strerror(errno)) + ")");
+        base = static_cast<const char *>(addr);
+
+        const ShmHeader &header = getHeader();
+        std::string problem;
+        if (header.magic != shmMagic)
+          problem = "is not a genetIC segment";
+        else if (header.version != shmVersion)
+          problem = "has layout version " + std::to_string(header.version) + ", but this reader expects " +
+                    std::to_string(shmVersion);
+        else if (header.segmentSize != size)
+          problem = "has the wrong size for its descriptor";
+        else if (header.complete != 1)
+          problem = "has not been completely written";
+
+        if (!problem.empty()) {
+          ::munmap(const_cast<char *>(base), size);
+          throw std::runtime_error("Shared memory segment " + segmentName + " " + problem);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+      }
+
+      ~SharedMemoryReader() {
+        if (base != nullptr)
+          ::munmap(const_cast<char *>(base), size);
+      }
+
+      SharedMemoryReader(const SharedMemoryReader &) = delete;
+
+      SharedMemoryReader &operator=(const SharedMemoryReader &) = delete;
+
+      //! Returns the descriptor at the start of the segment
+      const ShmHeader &getHeader() const {
+        return *reinterpret_cast<const ShmHeader *>(base);
+      }
+
+      //! Positions, three per particle; FloatType must match the segment's floatSize
+      template<typename FloatType>
+      const FloatType *getPositions() const {
+        return getArray<FloatType>(getHeader().positionsOffset, sizeof(FloatType));
+      }
+
+      //! Velocities, three per particle; FloatType must match the segment's floatSize
+      template<typename FloatType>
+      const FloatType *getVelocities() const {
+        return getArray<FloatType>(getHeader().velocitiesOffset, sizeof(FloatType));
+      }
+
+      //! Particle IDs, one per particle
+      const uint64_t *getIDs() const {
+        return getArray<uint64_t>(getHeader().idsOffset, 0);
+      }
+
+      //! Returns the mass of a particle, from the per-particle masses if present or else the mass table
+      template<typename FloatType>
+      FloatType getMass(size_t particle) const {
+        const ShmHeader &header = getHeader();
+        if (header.massesOffset != 0)
+          return getArray<FloatType>(header.massesOffset, sizeof(FloatType))[particle];
+
+        for (unsigned int type = 0; type < 6; ++type) {
+          if (particle < header.nPartPerType[type])
+            return header.massTable[type];
+          particle -= header.nPartPerType[type];
+        }
+        throw std::out_of_range("Particle index is beyond the end of the shared memory segment");
+      }
+
+      //! Remove the named segment; memory is released once every process has unmapped it
+      static void remove(const std::string &segmentName) {
+        ::shm_unlink(segmentName.c_str());
+      }
+    };
+
+
+    //! \brief Writes particles to a shared-memory segment, and a small text file naming it for the consumer
+    /*!
+    \param name - output path, whose last component gives the segment name; the descriptor is written to name.shm
+    \param Boxlength - simulation size in Mpc/h
+    \param mapper - particle mapper used to link particles to grid locations
+    \param generators - particles generators for each particle species (vector)
+    \param cosmology - cosmological parameters
+    */
+    template<typename OutputFloatType, typename GridDataType>
+    void save(const std::string &name, double Boxlength,
+              particle::mapper::ParticleMapper<GridDataType> &mapper,
+              particle::SpeciesToGeneratorMap<GridDataType> &generators,
+              const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology) {
+
+      std::string segmentName = getSegmentName(name);
+      SharedMemoryOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology);
+      output(segmentName);
+
+      // Check the segment as a consumer will see it, so that the descriptor describes what was actually published
+      SharedMemoryReader reader(segmentName);
+      const ShmHeader &header = reader.getHeader();
+      std::ofstream descriptor(name + ".shm");
+      descriptor << "segment " << segmentName << std::endl;
+      descriptor << "version " << header.version << std::endl;
+      descriptor << "header_bytes " << sizeof(ShmHeader) << std::endl;
+      descriptor << "bytes " << header.segmentSize << std::endl;
+      descriptor << "float_size " << header.floatSize << std::endl;
+      descriptor << "particles " << header.nTotal << std::endl;
+
+      logging::entry() << "Particles published in shared memory segment " << segmentName << " ("
+                       << header.segmentSize << " bytes); remove it with shm_unlink once consumed" << std::endl;
+    }
+
+  }
+}
+
+
+#endif
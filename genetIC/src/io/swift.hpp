@@ -12,8 +12,9 @@ namespace io {
                      particle::mapper::ParticleMapper<GridDataType> &mapper,
                      particle::SpeciesToGeneratorMap<GridDataType> &generators,
                      const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-                     int nFiles) :
-        gadgethdf::GadgetHDFOutput<GridDataType, OutputFloatType>(Boxlength, mapper, generators, cosmology, nFiles) {}
+                     int nFiles, const gadgethdf::HDFWriteOptions &writeOptions = gadgethdf::HDFWriteOptions()) :
+        gadgethdf::GadgetHDFOutput<GridDataType, OutputFloatType>(Boxlength, mapper, generators, cosmology, nFiles,
+                                                                  writeOptions) {}
 
       bool forceVariableMass() const override {
         return true;
@@ -28,16 +29,19 @@ namespace io {
     \param mapper - particle mapper used to link particles to grid locations
     \param generators - particles generators for each particle species (vector)
     \param cosmology - cosmological parameters
+    \param nFiles - number of files to split the output across
+    \param writeOptions - chunking and filter settings for the particle datasets
     */
     template<typename OutputFloatType, typename GridDataType>
     void save(const std::string &name, double Boxlength,
               particle::mapper::ParticleMapper<GridDataType> &mapper,
               particle::SpeciesToGeneratorMap<GridDataType> &generators,
               const cosmology::CosmologicalParameters<tools::datatypes::strip_complex<GridDataType>> &cosmology,
-              int nFiles) {
+              int nFiles, const gadgethdf::HDFWriteOptions &writeOptions = gadgethdf::HDFWriteOptions()) {
 
       HighFive::SilenceHDF5 silence; // suppresses HDF5 warnings while in scope
-      SwiftHDFOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, nFiles);
+      SwiftHDFOutput<GridDataType, OutputFloatType> output(Boxlength, mapper, generators, cosmology, nFiles,
+                                                           writeOptions);
       output(name);
       logging::entry() << "Swift output saved.";
       logging::entry() << " Note that Swift output follows the GadgetHDF format and unit conventions.  You should";
@@ -5,6 +5,7 @@
 #include "src/io.hpp"
 #include "src/simulation/particles/mapper/mapper.hpp"
 #include "src/simulation/particles/species.hpp"
+#include "src/simulation/particles/batch.hpp"
 
 namespace io {
 
@@ -94,6 +95,7 @@ namespace io {
     protected:
       particle::SpeciesToGeneratorMap<GridDataType> generators; //!< Particle generators for each species.
       tools::MemMapFileWriter writer; //!< Writer used to process output file using memory maps.
+      tools::FileWriterOptions writerOptions; //!< Back-end used by the writer.
       std::ofstream photogenic_file; //!< Photogenic output file.
       size_t iord; //!< Cumulative index offset.
       double pos_factor; //!< Factor to multiply internal position offset by to get tipsy units.
@@ -117,28 +119,46 @@ namespace io {
         auto p = writer.getMemMap<ParticleType>(n);
 
 
-        begin.parallelIterate([&](size_t i, const particle::mapper::MapperIterator<GridDataType> &localIterator) {
-          TipsyParticle::initialise(p[i], cosmology);
-          auto thisParticle = localIterator.getParticle();
-          p[i].x = thisParticle.pos.x * pos_factor - 0.5;
-          p[i].y = thisParticle.pos.y * pos_factor - 0.5;
-          p[i].z = thisParticle.pos.z * pos_factor - 0.5;
-          p[i].eps = thisParticle.soft * pos_factor;
+        // Photogenic IDs are gathered per block and written out in block order afterwards, so that the file
+        // lists every lowest-mass particle in ascending order regardless of the number of threads
+        std::vector<std::pair<size_t, std::vector<size_t>>> photogenicIdsPerBlock;
+        bool writePhotogenic = photogenic_file.is_open();
 
-          p[i].vx = thisParticle.vel.x * vel_factor;
-          p[i].vy = thisParticle.vel.y * vel_factor;
-          p[i].vz = thisParticle.vel.z * vel_factor;
-          p[i].mass = thisParticle.mass * mass_factor;
+        begin.parallelIterateBlocks([&](size_t blockStart, size_t blockLength,
+                                        particle::mapper::MapperIterator<GridDataType> &localIterator) {
+          std::vector<size_t> photogenicIds;
 
-#ifdef _OPENMP
-          if (thisParticle.mass == min_mass && omp_get_thread_num() == 0)
-#else
-            if(thisParticle.mass==min_mass)
-#endif
-            photogenic_file << iord + i << std::endl;
+          particle::ParticleBatch<FloatType>::iterateInBatches(localIterator, blockLength,
+            [&](size_t batchStart, const particle::ParticleBatch<FloatType> &batch) {
+              for (size_t k = 0; k < batch.size(); ++k) {
+                size_t i = blockStart + batchStart + k;
+                TipsyParticle::initialise(p[i], cosmology);
+                p[i].x = batch.pos[k].x * pos_factor - 0.5;
+                p[i].y = batch.pos[k].y * pos_factor - 0.5;
+                p[i].z = batch.pos[k].z * pos_factor - 0.5;
+                p[i].eps = batch.soft[k] * pos_factor;
+
+                p[i].vx = batch.vel[k].x * vel_factor;
+                p[i].vy = batch.vel[k].y * vel_factor;
+                p[i].vz = batch.vel[k].z * vel_factor;
+                p[i].mass = batch.mass[k] * mass_factor;
+
+                if (writePhotogenic && batch.mass[k] == min_mass)
+                  photogenicIds.push_back(iord + i);
+              }
+            });
+
+#pragma omp critical
+          photogenicIdsPerBlock.emplace_back(blockStart, std::move(photogenicIds));
 
         }, n);
 
+        std::sort(photogenicIdsPerBlock.begin(), photogenicIdsPerBlock.end());
+        for (const auto &block: photogenicIdsPerBlock) {
+          for (size_t id: block.second)
+            photogenic_file << id << std::endl;
+        }
+
         iord += n;
 
 
@@ -153,8 +173,15 @@ namespace io {
         ParticleType p;
         TipsyParticle::initialise(p, cosmology);
         auto i = begin;
+
+        // With the buffered back-end, each block is handed to the I/O thread while the next is generated, so blocks
+        // must be small enough to keep the buffers within their set size
+        typename particle::mapper::MapperIterator<GridDataType>::difference_type nMax = 256 * 1024 * 1024;
+        if (writerOptions.backend == tools::WriteBackend::buffered)
+          nMax = std::max(size_t(1), writerOptions.bufferSize / sizeof(ParticleType));
+
         while (i != end) {
-          saveNextBlockOfTipsyParticles<ParticleType>(i, end);
+          saveNextBlockOfTipsyParticles<ParticleType>(i, end, nMax);
         }
       }
 
@@ -190,16 +217,33 @@ namespace io {
       }
 
 
+      //! \brief Finds the minimum, maximum and total mass and the number of particles by visiting every particle
+      void scanMassStatistics(FloatType &scan_min_mass, FloatType &scan_max_mass, FloatType &scan_tot_mass,
+                              size_t &scan_num) {
+        scan_min_mass = std::numeric_limits<FloatType>::max();
+        scan_max_mass = 0.0;
+        scan_tot_mass = 0.0;
+        scan_num = 0;
+
+        const auto end = pMapper->end(*generators[particle::species::dm]); // don't want to keep re-evaluating this
+        for (auto i = pMapper->begin(*generators[particle::species::dm]); i != end; ++i) {
+          FloatType mass = i.getMass(); // sometimes can be MUCH faster than getParticle
+          if (scan_min_mass > mass) scan_min_mass = mass;
+          if (scan_max_mass < mass) scan_max_mass = mass;
+          scan_tot_mass += mass;
+          ++scan_num;
+        }
+      }
+
     public:
       //! \brief Constructor
       TipsyOutput(double boxLength,
                   const particle::SpeciesToGeneratorMap<GridDataType> &_generators,
                   std::shared_ptr<particle::mapper::ParticleMapper<GridDataType>> pMapper,
-                  const cosmology::CosmologicalParameters<FloatType> &cosmology) : generators(_generators),
-                                                                                   iord(0),
-                                                                                   boxLength(boxLength),
-                                                                                   pMapper(pMapper),
-                                                                                   cosmology(cosmology) {
+                  const cosmology::CosmologicalParameters<FloatType> &cosmology,
+                  const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) :
+        generators(_generators), writerOptions(writerOptions), iord(0), boxLength(boxLength), pMapper(pMapper),
+        cosmology(cosmology) {
 
       }
 
@@ -215,15 +259,26 @@ namespace io {
         min_mass = std::numeric_limits<double>::max();
         max_mass = 0.0;
 
-        FloatType mass, tot_mass = 0.0;
-
-        const auto end = pMapper->end(*generators[particle::species::dm]); // don't want to keep re-evaluating this
-        for (auto i = pMapper->begin(*generators[particle::species::dm]); i != end; ++i) {
-          mass = i.getMass(); // sometimes can be MUCH faster than getParticle
-          if (min_mass > mass) min_mass = mass;
-          if (max_mass < mass) max_mass = mass;
-          tot_mass += mass;
+        FloatType tot_mass, seg_min_mass, seg_max_mass;
+        size_t num;
+
+        if (pMapper->getParticleMassStatistics(*generators[particle::species::dm], seg_min_mass, seg_max_mass,
+                                               tot_mass, num)) {
+#ifdef DEBUG_INFO
+          FloatType scanned_min_mass, scanned_max_mass, scanned_tot_mass;
+          size_t scanned_num;
+          scanMassStatistics(scanned_min_mass, scanned_max_mass, scanned_tot_mass, scanned_num);
+          // the scan sums particle by particle, so its total is only accurate to the usual bound on rounding errors
+          FloatType tot_mass_tolerance = FloatType(num) * std::numeric_limits<FloatType>::epsilon() * tot_mass;
+          if (scanned_num != num || scanned_min_mass != seg_min_mass || scanned_max_mass != seg_max_mass ||
+              std::abs(scanned_tot_mass - tot_mass) > tot_mass_tolerance)
+            throw std::runtime_error("Segment index disagrees with particle scan for tipsy particle masses");
+#endif
+        } else {
+          scanMassStatistics(seg_min_mass, seg_max_mass, tot_mass, num);
         }
+        min_mass = seg_min_mass;
+        max_mass = seg_max_mass;
 
         if (min_mass != max_mass) {
           photogenic_file.open("photogenic.txt");
@@ -259,7 +314,7 @@ namespace io {
 
         paramfile.close();
 
-        writer = tools::MemMapFileWriter(filename);
+        writer = tools::MemMapFileWriter(filename, writerOptions);
 
         writer.write<>(header);
 
@@ -278,14 +333,16 @@ namespace io {
     \param generators - vector of particles generators for each particle type
     \param pMapper - Particle mapper, linking particles to grid locations.
     \param cosmology - cosmological parameters
+    \param writerOptions - back-end used to write the file
     */
     template<typename GridDataType, typename T>
     void save(const std::string &filename, double boxLength,
               const particle::SpeciesToGeneratorMap<GridDataType> &generators,
               std::shared_ptr<particle::mapper::ParticleMapper<GridDataType>> pMapper,
-              const cosmology::CosmologicalParameters<T> &cosmology) {
+              const cosmology::CosmologicalParameters<T> &cosmology,
+              const tools::FileWriterOptions &writerOptions = tools::FileWriterOptions()) {
 
-      TipsyOutput<GridDataType> output(boxLength, generators, pMapper, cosmology);
+      TipsyOutput<GridDataType> output(boxLength, generators, pMapper, cosmology, writerOptions);
       output(filename);
     }
 
@@ -78,6 +78,21 @@ void setup_parser(tools::ClassDispatch<ICType, void> &dispatch) {
   dispatch.add_class_route("gadget_flagged_particle_type", &ICType::setFlaggedGadgetParticleType);
   dispatch.add_class_route("gadget_num_files", &ICType::setGadgetNumFiles);
 
+  // HDF5 (gadgethdf and swift) options
+  dispatch.add_class_route("hdf5_chunk_size", &ICType::setHDF5ChunkSize);
+  dispatch.add_class_route("hdf5_chunk_cache", &ICType::setHDF5ChunkCache);
+  dispatch.add_class_route("hdf5_shuffle", &ICType::setHDF5Shuffle);
+
+  // Output back-end for gadget, tipsy and grafic
+  dispatch.add_class_route("output_backend", &ICType::setOutputBackend);
+  dispatch.add_class_route("output_buffer_size", &ICType::setOutputBufferSize);
+  dispatch.add_class_route("output_num_buffers", &ICType::setOutputNumBuffers);
+  dispatch.add_class_route("output_direct_io", &ICType::setOutputDirectIO);
+
+  // Threads for Fourier transforms
+  dispatch.add_class_route("fftw_threads", &ICType::setFFTWThreads);
+  dispatch.add_class_route("calibrate_fftw_threads", &ICType::calibrateFFTWThreads);
+
   // Define input files
   dispatch.add_class_route("mapper_relative_to", &ICType::setInputMapper);
   dispatch.add_class_route("camb", &ICType::setCambDat);
@@ -152,6 +167,7 @@ void setup_parser(tools::ClassDispatch<ICType, void> &dispatch) {
   dispatch.add_class_route("dump_tipsy", static_cast<void (ICType::*)(std::string)>(&ICType::saveTipsyArray));
   dispatch.add_class_route("dump_tipsy_field", static_cast<void (ICType::*)(std::string, size_t)>(&ICType::saveTipsyArray));
   dispatch.add_class_route("dump_mask", &ICType::dumpMask);
+  dispatch.add_class_route("dump_single_precision", &ICType::setDumpSinglePrecision);
 
   // Load existing random field instead of generating
   dispatch.add_class_route("import_level", static_cast<void (ICType::*)(size_t, std::string)>(&ICType::importLevel));
@@ -0,0 +1,87 @@
+#ifndef IC_BRICKS_HPP
+#define IC_BRICKS_HPP
+
+#include <algorithm>
+#include <cstddef>
+
+namespace fields {
+
+  /*! \brief Brick-tiled ordering of the cells of a cubic grid.
+
+      The grid is divided into cubic bricks of brickSize cells on a side. Bricks are stored one after another in the
+      same order as cells on a grid of bricks, and cells within a brick in the same order as cells on a grid. A 4x4x4
+      interpolation stencil then touches at most eight bricks, each of which is a contiguous block of memory, rather
+      than sixteen rows spread over four planes of the grid.
+
+      Only grids whose size is a multiple of brickSize can be tiled (see canTile), so that the tiled data occupies
+      exactly as much storage as the row-major data.
+  */
+  class BrickLayout {
+  public:
+    static constexpr int log2BrickSize = 3;
+    static constexpr int brickSize = 1 << log2BrickSize; //!< Number of cells along each side of a brick
+    static constexpr size_t brickVolume = size_t(1) << (3 * log2BrickSize); //!< Number of cells in a brick
+
+  protected:
+    size_t size; //!< Number of cells on a side of the grid
+    size_t bricksPerSide; //!< Number of bricks on a side of the grid
+
+  public:
+    //! Returns true if a grid with the given number of cells on a side can be tiled with bricks
+    static bool canTile(size_t size) {
+      return size > 0 && size % brickSize == 0;
+    }
+
+    explicit BrickLayout(size_t size) : size(size), bricksPerSide(size / brickSize) {}
+
+    //! Returns the position in brick-tiled storage of the cell at coordinate (x, y, z), which must lie within the grid
+    size_t getIndex(int x, int y, int z) const {
+      constexpr int mask = brickSize - 1;
+      size_t brick = (size_t(x >> log2BrickSize) * bricksPerSide + size_t(y >> log2BrickSize)) * bricksPerSide
+                     + size_t(z >> log2BrickSize);
+      return (brick << (3 * log2BrickSize)) | (size_t(x & mask) << (2 * log2BrickSize))
+             | (size_t(y & mask) << log2BrickSize) | size_t(z & mask);
+    }
+
+    /*! \brief Copies row-major data into brick-tiled storage
+
+        \param rows - input data, with the row of cells along z at (x, y) starting at (x * size + y) * rowStride
+        \param rowStride - separation between rows; size for plain data, or larger for rows padded for FFTW
+        \param bricks - output storage for size^3 cells; must not overlap rows
+    */
+    template<typename DataType>
+    void copyToBricks(const DataType *rows, size_t rowStride, DataType *bricks) const {
+      const size_t nRows = size * size;
+#pragma omp parallel for schedule(static)
+      for (size_t row = 0; row < nRows; ++row) {
+        const DataType *rowData = rows + row * rowStride;
+        int x = int(row / size), y = int(row % size);
+        for (int z = 0; z < int(size); z += brickSize)
+          std::copy(rowData + z, rowData + z + brickSize, bricks + getIndex(x, y, z));
+      }
+    }
+
+    /*! \brief Copies brick-tiled storage back into row-major data
+
+        \param bricks - input storage for size^3 cells
+        \param rows - output data, with rows arranged as for copyToBricks; must not overlap bricks
+        \param rowStride - separation between rows
+    */
+    template<typename DataType>
+    void copyFromBricks(const DataType *bricks, DataType *rows, size_t rowStride) const {
+      const size_t nRows = size * size;
+#pragma omp parallel for schedule(static)
+      for (size_t row = 0; row < nRows; ++row) {
+        DataType *rowData = rows + row * rowStride;
+        int x = int(row / size), y = int(row % size);
+        for (int z = 0; z < int(size); z += brickSize) {
+          const DataType *brickRow = bricks + getIndex(x, y, z);
+          std::copy(brickRow, brickRow + brickSize, rowData + z);
+        }
+      }
+    }
+  };
+
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include "../grid/virtualgrid.hpp"
 #include "field.hpp"
 #include "../multilevelgrid/multilevelgrid.hpp"
+#include <array>
+#include <stdexcept>
 #include <string>
 
 namespace fields {
@@ -27,6 +29,15 @@ namespace fields {
     //!\brief Returns true if index i corresponds to a point in the field.
     virtual bool contains(size_t i) const = 0;
 
+    /*! \brief Evaluates the field at the n consecutive linear indices starting at firstCell, writing into out.
+     *
+     * The default implementation calls operator[] for each cell; evaluators that can do better override it.
+     */
+    virtual void evaluateRange(size_t firstCell, size_t n, DataType *out) const {
+      for (size_t k = 0; k < n; ++k)
+        out[k] = (*this)[firstCell + k];
+    }
+
     //! \brief Adds this field to the destination field.
     virtual void addTo(Field <DataType, CoordinateType> &destination) const {
 
@@ -72,7 +83,7 @@ namespace fields {
 
     //! \brief Direct evaluation of the field at a point where its value is stored.
     DataType operator[](size_t i) const override {
-      return (*field)[i];
+      return (*field)[field->getStorageIndex(i)];
     }
 
     //! \brief Evaluate the field at a given point using interpolation
@@ -84,6 +95,17 @@ namespace fields {
     bool contains(size_t i) const override {
       return i < field->getGrid().size3;
     }
+
+    //! \brief Copies the stored values for a range of cells
+    void evaluateRange(size_t firstCell, size_t n, DataType *out) const override {
+      const auto &data = field->getDataVector();
+      if (field->isBricked()) {
+        for (size_t k = 0; k < n; ++k)
+          out[k] = data[field->getStorageIndex(firstCell + k)];
+      } else {
+        std::copy(data.begin() + firstCell, data.begin() + firstCell + n, out);
+      }
+    }
   };
 
 
@@ -100,18 +122,19 @@ namespace fields {
     using MyGridType = const grids::SuperSampleGrid<CoordinateType>;
     const std::shared_ptr<const grids::Grid<CoordinateType>> grid;
     const std::shared_ptr<const EvaluatorBase<DataType, CoordinateType>> underlying;
+    const grids::GridGeometry<CoordinateType> geometry;
 
   public:
     SuperSampleEvaluator(const grids::VirtualGrid<CoordinateType> &grid,
                          std::shared_ptr<const EvaluatorBase<DataType, CoordinateType>> underlying) :
       grid(std::dynamic_pointer_cast<MyGridType>(grid.shared_from_this())),
-      underlying(underlying) {
+      underlying(underlying), geometry(grid.getGeometry()) {
 
     }
 
     //! \brief Interpolates to get the field at the centre of specified virtual cell.
     DataType operator[](size_t i) const override {
-      auto centroid = grid->getCentroidFromIndex(i);
+      auto centroid = geometry.getCentroidFromIndex(i);
       return (*underlying)(centroid);
     }
 
@@ -161,6 +184,29 @@ namespace fields {
       return grid->containsCell(i);
     }
 
+    /*! \brief Evaluate a range of cells one row at a time.
+     *
+     * Each row of the section maps onto a consecutive run of cells in the underlying grid unless it wraps around
+     * the box, so most rows can be handed on to the underlying evaluator as a single range.
+     */
+    void evaluateRange(size_t firstCell, size_t n, DataType *out) const override {
+      size_t rowLength = grid->size;
+      size_t k = 0;
+      while (k < n) {
+        size_t cell = firstCell + k;
+        size_t nThisRow = std::min(n - k, rowLength - cell % rowLength);
+        size_t underlyingStart = grid->mapIndexToUnderlying(cell);
+        size_t underlyingEnd = grid->mapIndexToUnderlying(cell + nThisRow - 1);
+        if (underlyingEnd == underlyingStart + nThisRow - 1) {
+          underlying->evaluateRange(underlyingStart, nThisRow, out + k);
+        } else {
+          for (size_t j = 0; j < nThisRow; ++j)
+            out[k + j] = (*underlying)[grid->mapIndexToUnderlying(cell + j)];
+        }
+        k += nThisRow;
+      }
+    }
+
   };
 
   /*!   \class SubSampleEvaluator
@@ -256,6 +302,128 @@ namespace fields {
   };
 
 
+  /*!   \class FlattenedEvaluator
+        \brief Evaluator for a tower of virtual grids that has been flattened into a single map (see grids::FlattenedGrid).
+
+        Each cell is mapped straight onto the target grid, without passing through the intermediate grids. The
+        underlying evaluator is for the target grid if there is no resampling, or otherwise for the source grid of the
+        resampling stage.
+  */
+  template<typename DataType, typename CoordinateType = tools::datatypes::strip_complex<DataType>>
+  class FlattenedEvaluator : public EvaluatorBase<DataType, CoordinateType> {
+
+  protected:
+    const std::shared_ptr<const grids::Grid<CoordinateType>> grid; //!< Top of the tower, keeping all of it alive
+    const grids::FlattenedGrid<CoordinateType> flat;
+    const std::shared_ptr<const EvaluatorBase<DataType, CoordinateType>> underlying;
+    const grids::GridGeometry<CoordinateType> flatGeometry; //!< Layout of cells on the flattened grid
+    const grids::GridGeometry<CoordinateType> targetGeometry; //!< Layout of cells on the target grid
+
+    //! Number of cells fetched at once along a row of the source grid when sub-sampling
+    static constexpr size_t subcellBatchSize = 32;
+
+    //! Averages over the cells of the source grid making up a target cell, in the same order as SubSampleGrid::forEachSubcell
+    DataType averageSubcells(const Coordinate<int> &targetCoord) const {
+      const Coordinate<int> lower = targetCoord * flat.factor;
+      Coordinate<int> upper = lower + flat.factor;
+      if (upper.x > flat.sourceLimit) upper.x = flat.sourceLimit;
+      if (upper.y > flat.sourceLimit) upper.y = flat.sourceLimit;
+      if (upper.z > flat.sourceLimit) upper.z = flat.sourceLimit;
+
+      std::array<DataType, subcellBatchSize> values;
+      DataType returnVal(0);
+      int localFactor3 = 0;
+
+      for (int xi = lower.x; xi < upper.x; ++xi) {
+        for (int yi = lower.y; yi < upper.y; ++yi) {
+          size_t rowStart = (size_t(xi) * flat.sourceSize + size_t(yi)) * flat.sourceSize;
+          for (int zi = lower.z; zi < upper.z; zi += int(subcellBatchSize)) {
+            size_t nThisBatch = std::min(subcellBatchSize, size_t(upper.z - zi));
+            underlying->evaluateRange(rowStart + size_t(zi), nThisBatch, values.data());
+            for (size_t k = 0; k < nThisBatch; ++k)
+              returnVal += values[k];
+            localFactor3 += int(nThisBatch);
+          }
+        }
+      }
+
+      assert(localFactor3 != 0);
+      return returnVal / CoordinateType(localFactor3);
+    }
+
+    //! Evaluates the field at the given cell of the target grid
+    DataType evaluateTargetCell(const Coordinate<int> &targetCoord) const {
+      switch (flat.resampling) {
+        case grids::Resampling::superSample:
+          return (*underlying)(targetGeometry.getCentroidFromCoordinate(targetCoord));
+        case grids::Resampling::subSample:
+          return averageSubcells(targetCoord);
+        default:
+          return (*underlying)[targetGeometry.getIndexFromCoordinateNoWrap(targetCoord)];
+      }
+    }
+
+    //! Returns true if n cells starting from coord along a row all lie within the clips, and map onto consecutive cells
+    bool isRunContiguous(const Coordinate<int> &coord, size_t n) const {
+      const int last = int(n) - 1;
+      for (const auto &clip : flat.clips) {
+        auto clipped = flat.wrap(coord + clip.offset);
+        if (clipped.x >= clip.limit || clipped.y >= clip.limit || clipped.z + last >= clip.limit)
+          return false;
+      }
+      auto targetCoord = flat.getTargetCoordinate(coord);
+      return size_t(targetCoord.z + last) < flat.targetSize;
+    }
+
+  public:
+    FlattenedEvaluator(const grids::Grid<CoordinateType> &grid, const grids::FlattenedGrid<CoordinateType> &flat,
+                       std::shared_ptr<const EvaluatorBase<DataType, CoordinateType>> underlying) :
+      grid(grid.shared_from_this()), flat(flat), underlying(underlying),
+      flatGeometry(grid.getGeometry()), targetGeometry(flat.target->getGeometry()) {
+
+    }
+
+    //! Maps the cell onto the target grid and evaluates there
+    DataType operator[](size_t i) const override {
+      auto coord = flatGeometry.getCoordinateFromIndex(i);
+      if (!flat.isMapped(coord))
+        throw std::out_of_range("Out of range in FlattenedEvaluator");
+      return evaluateTargetCell(flat.getTargetCoordinate(coord));
+    }
+
+    //! \brief Evaluate the field at a given point using interpolation
+    DataType operator()(const Coordinate<CoordinateType> &at) const override {
+      return (*underlying)(at);
+    }
+
+    bool contains(size_t i) const override {
+      return i < flatGeometry.size3 && flat.containsCoordinate(flatGeometry.getCoordinateFromIndex(i));
+    }
+
+    /*! \brief Evaluate a range of cells one row at a time.
+     *
+     * Without resampling, rows that do not wrap or leave a clipped section map onto consecutive cells of the target
+     * grid and are handed on to the underlying evaluator as a single range.
+     */
+    void evaluateRange(size_t firstCell, size_t n, DataType *out) const override {
+      size_t k = 0;
+      while (k < n) {
+        size_t cell = firstCell + k;
+        auto coord = flatGeometry.getCoordinateFromIndex(cell);
+        size_t nThisRow = std::min(n - k, flat.size - size_t(coord.z));
+        if (flat.resampling == grids::Resampling::none && isRunContiguous(coord, nThisRow)) {
+          underlying->evaluateRange(targetGeometry.getIndexFromCoordinateNoWrap(flat.getTargetCoordinate(coord)),
+                                    nThisRow, out + k);
+        } else {
+          for (size_t j = 0; j < nThisRow; ++j)
+            out[k + j] = (*this)[cell + j];
+        }
+        k += nThisRow;
+      }
+    }
+  };
+
+
   //! \brief Return an object suitable for evaluating the specified field at coordinates on the specified grid
   template<typename DataType, typename CoordinateType>
   std::shared_ptr<EvaluatorBase<DataType, CoordinateType>> makeEvaluator(const Field <DataType, CoordinateType> &field,
@@ -288,6 +456,9 @@ namespace fields {
     // provided.) Otherwise, we create the appropriate adaptor evaluator and recurse
     // to find its underlying evaluators. Eventually this always bottoms out at a 
     // direct evaluator.
+    //
+    // Most towers of virtual grids can be flattened into a single map onto the grid storing the field, with at most
+    // one resampling stage; those are evaluated in one step, and only the rest go through the adaptors.
 
     auto &runtimeType = typeid(grid);
 
@@ -295,6 +466,19 @@ namespace fields {
       // Simplest case: the field is actually stored directly on this grid.
       return std::make_shared<DirectEvaluator<DataType, CoordinateType>>(field.getFieldForGrid(grid));
     } else {
+      grids::FlattenedGrid<CoordinateType> flat;
+      if (grid.flatten(flat)) {
+        if (flat.resampling == grids::Resampling::none) {
+          auto targetEvaluator = makeEvaluator(field, *flat.target);
+          if (flat.isIdentity())
+            return targetEvaluator;
+          return std::make_shared<FlattenedEvaluator<DataType, CoordinateType>>(grid, flat, targetEvaluator);
+        } else {
+          auto sourceEvaluator = makeEvaluator(field, *flat.source);
+          return std::make_shared<FlattenedEvaluator<DataType, CoordinateType>>(grid, flat, sourceEvaluator);
+        }
+      }
+
       // Special case: ResolutionMatchingGrid points to TWO underlying grids
       if (runtimeType == typeid(grids::ResolutionMatchingGrid<CoordinateType>)) {
         const grids::ResolutionMatchingGrid<CoordinateType> &rmGrid =
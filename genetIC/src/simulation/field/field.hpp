@@ -1,14 +1,18 @@
 #ifndef IC_FIELD_HPP
 #define IC_FIELD_HPP
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <cassert>
 #include <src/simulation/filters/filter.hpp>
+#include "src/simulation/filters/tabulated.hpp"
 #include <src/tools/numerics/fourier.hpp>
 #include <execinfo.h>
 #include "src/io/numpy.hpp"
 #include "src/simulation/grid/grid.hpp"
+#include "src/simulation/field/bricks.hpp"
 #include "src/tools/numerics/tricubic.hpp"
 #include "src/tools/lru_cache.hpp"
 
@@ -114,8 +118,9 @@ namespace fields {
   std::shared_ptr<EvaluatorBase<DataType, CoordinateType>> makeEvaluator(const MultiLevelField<DataType> &field,
                                                                          const grids::Grid<CoordinateType> &grid);
 
-  size_t peakMemUsage = 0;
-  size_t currentMemUsage = 0;
+  // Fields are allocated and freed by concurrent tasks (see tools::forEachTaskConcurrently), so the usage is atomic
+  std::atomic<size_t> peakMemUsage(0);
+  std::atomic<size_t> currentMemUsage(0);
 
   std::string formatBytes(size_t bytes) {
     std::string suffixes[] = {"B", "KB", "MB", "GB", "TB"};
@@ -127,6 +132,19 @@ namespace fields {
     return std::to_string(bytes) + suffixes[suffix];
   }
 
+  //! Bytes of field data shared by copies of fields, and how many of those were later copied (see Field::getDataVector)
+  std::atomic<size_t> copyOnWriteSharedBytes(0), copyOnWriteCopiedBytes(0);
+
+  //! Reports how much copying of field data was avoided by sharing it between copies of fields
+  void reportCopyOnWriteSavings() {
+    size_t shared = copyOnWriteSharedBytes, copied = copyOnWriteCopiedBytes;
+    if (shared > 0)
+      logging::entry() << "Copy-on-write avoided copying " << formatBytes(shared > copied ? shared - copied : 0)
+                       << " of field data" << std::endl;
+  }
+
+  std::atomic<bool> stopMemUsageReporter(false); //!< Tells the reporter to finish, once the memory usage reaches zero
+
   void memUsagePeriodicReportInThread() {
     // Check memory usage every 0.1 second. If zero, report the peak memory usage and return.
     // If non-zero, report the current memory usage but only if that has changed since the
@@ -137,8 +155,9 @@ namespace fields {
 
     while(true) {
       std::this_thread::sleep_for(std::chrono::milliseconds(100));
-      if(currentMemUsage==0) {
+      if(stopMemUsageReporter) {
         logging::entry() << "Peak memory usage: " << formatBytes(peakMemUsage) << std::endl;
+        reportCopyOnWriteSavings();
         return;
       }
 
@@ -155,23 +174,29 @@ namespace fields {
   }
 
   static std::thread reporter;
+  std::mutex reporterMutex; //!< Guards starting and stopping the reporter
 
   void addMemUsage(size_t bytes) {
-    currentMemUsage += bytes;
-    if(currentMemUsage > peakMemUsage) {
-      peakMemUsage = currentMemUsage;
-    }
+    size_t current = (currentMemUsage += bytes);
+    size_t peak = peakMemUsage;
+    while(current > peak && !peakMemUsage.compare_exchange_weak(peak, current));
 
     // now launch the periodic reporter
+    std::lock_guard<std::mutex> lock(reporterMutex);
     if(!reporter.joinable()) {
       reporter = std::thread(memUsagePeriodicReportInThread);
     }
   }
 
   void removeMemUsage(size_t bytes) {
-    currentMemUsage -= bytes;
-    if(currentMemUsage == 0 && reporter.joinable()) {
-      reporter.join();
+    if((currentMemUsage -= bytes) == 0) {
+      std::lock_guard<std::mutex> lock(reporterMutex);
+      // another task may have allocated in the meantime, in which case the reporter carries on
+      if(currentMemUsage == 0 && reporter.joinable()) {
+        stopMemUsageReporter = true;
+        reporter.join();
+        stopMemUsageReporter = false;
+      }
     }
 
   }
@@ -195,44 +220,109 @@ namespace fields {
   protected:
     const TPtrGrid pGrid; //!< Pointer to the grid on which the field is defined.
     std::shared_ptr<FourierManager> fourierManager; //!< Class to handle Fourier transforms of this field.
-    TData data; //!< Vector which stores the underlying data associated to the field
+    /*! \brief The data associated to the field, which may be shared with copies of it
+
+        Copying a field shares this buffer, and the first modification of either field then gives it a copy of its
+        own (see getDataVector). That first modification may happen inside a parallel loop, so pData is only read or
+        replaced within the fieldCopyOnWrite critical section once the field has been constructed. Everything else
+        reaches the data through pCurrentData and pWritableData.
+    */
+    std::shared_ptr<TData> pData;
+    std::atomic<TData *> pCurrentData; //!< Always the buffer held by pData
+    mutable std::atomic<TData *> pWritableData; //!< The buffer if held by this field alone, otherwise nullptr
     bool fourier; //!< If true, then the field is regarded as being in Fourier space. Switched by Fourier transforms.
+    bool bricked; //!< If true, real-space data is held in brick-tiled order (see toBricked) rather than by linear index.
+
+    //! Takes ownership of the given data, accounting for its memory until it is freed
+    static std::shared_ptr<TData> makeSharedData(TData &&dataVector) {
+      size_t bytes = dataVector.size() * sizeof(DataType);
+      if (bytes > 0)
+        addMemUsage(bytes);
+      return std::shared_ptr<TData>(new TData(std::move(dataVector)), [bytes](TData *pFreed) {
+        if (bytes > 0)
+          removeMemUsage(bytes);
+        delete pFreed;
+      });
+    }
+
+    //! Gives this field its own copy of the data if it is shared with any other field, returning the data
+    TData *makeDataWritable() {
+      TData *pWritable;
+#pragma omp critical(fieldCopyOnWrite)
+      {
+        pWritable = pWritableData.load(std::memory_order_relaxed);
+        if (pWritable == nullptr) {
+          if (pData.use_count() > 1) {
+            // The buffer being replaced stays alive (and unchanged) in the other fields, so any thread still reading
+            // it through pCurrentData sees the same values
+            pData = makeSharedData(TData(*pData));
+            copyOnWriteCopiedBytes += pData->size() * sizeof(DataType);
+          }
+          pWritable = pData.get();
+          pCurrentData.store(pWritable, std::memory_order_release);
+          pWritableData.store(pWritable, std::memory_order_release);
+        }
+      }
+      return pWritable;
+    }
 
   public:
     //! Move constructor
-    Field(Field<DataType, CoordinateType> &&move) : pGrid(move.pGrid),
-                                                    fourier(move.fourier) {
+    Field(Field<DataType, CoordinateType> &&move) : pGrid(move.pGrid), pData(std::move(move.pData)),
+                                                    pCurrentData(move.pCurrentData.load()),
+                                                    pWritableData(move.pWritableData.load()),
+                                                    fourier(move.fourier), bricked(move.bricked) {
       fourierManager = std::make_shared<FourierManager>(*this);
-      std::swap(data, move.data);
-      assert(data.size() == this->fourierManager->getRequiredDataSize());
+      move.pData = makeSharedData(TData());
+      move.pCurrentData = move.pData.get();
+      move.pWritableData = move.pData.get();
+      assert(pCurrentData.load()->size() == this->fourierManager->getRequiredDataSize());
     }
 
     //! Move operator
     auto & operator=(Field<DataType, CoordinateType> &&move) {
       assert(move.pGrid == pGrid);
-      std::swap(data, move.data);
-      assert(data.size() == this->fourierManager->getRequiredDataSize());
+      std::swap(pData, move.pData);
+      TData *pCurrent = pCurrentData.load(), *pWritable = pWritableData.load();
+      pCurrentData = move.pCurrentData.load();
+      pWritableData = move.pWritableData.load();
+      move.pCurrentData = pCurrent;
+      move.pWritableData = pWritable;
+      assert(pCurrentData.load()->size() == this->fourierManager->getRequiredDataSize());
       fourier = move.fourier;
+      bricked = move.bricked;
       return *this;
     }
 
-    //! Copy constructor
+    /*! \brief Copy constructor
+
+        The copy shares its data with the original until either of them is modified (see getDataVector). The
+        original is marked as shared, which is why pWritableData is mutable.
+    */
     Field(const Field<DataType, CoordinateType> &copy)
       : std::enable_shared_from_this<Field<DataType, CoordinateType>>(),
-        pGrid(copy.pGrid), data(copy.data),
-        fourier(copy.fourier) {
+        pGrid(copy.pGrid), pWritableData(nullptr),
+        fourier(copy.fourier), bricked(copy.bricked) {
+#pragma omp critical(fieldCopyOnWrite)
+      {
+        pData = copy.pData;
+        copy.pWritableData = nullptr;
+      }
+      pCurrentData = pData.get();
       fourierManager = std::make_shared<FourierManager>(*this);
-      assert(data.size() == fourierManager->getRequiredDataSize());
-      addMemUsage(data.size() * sizeof(DataType));
+      copyOnWriteSharedBytes += pData->size() * sizeof(DataType);
+      assert(pData->size() == fourierManager->getRequiredDataSize());
     }
 
     //! Construct a field on the specified grid by moving the given data
     Field(TGrid &grid, TData &&dataVector, bool fourier = true) : pGrid(grid.shared_from_this()),
-                                                                  data(std::move(dataVector)), fourier(fourier) {
+                                                                  pData(makeSharedData(std::move(dataVector))),
+                                                                  pCurrentData(pData.get()),
+                                                                  pWritableData(pData.get()), fourier(fourier),
+                                                                  bricked(false) {
 
       fourierManager = std::make_shared<FourierManager>(*this);
-      assert(data.size() == fourierManager->getRequiredDataSize());
-      addMemUsage(data.size() * sizeof(DataType));
+      assert(pData->size() == fourierManager->getRequiredDataSize());
 
     }
 
@@ -240,24 +330,26 @@ namespace fields {
 
     //! Construct a field on the specified grid by copying the given data
     Field(TGrid &grid, const TData &dataVector, bool fourier = true) : pGrid(grid.shared_from_this()),
-                                                                       data(dataVector), fourier(fourier) {
+                                                                       pData(makeSharedData(TData(dataVector))),
+                                                                       pCurrentData(pData.get()),
+                                                                       pWritableData(pData.get()), fourier(fourier),
+                                                                       bricked(false) {
 
       fourierManager = std::make_shared<FourierManager>(*this);
-      assert(data.size() == fourierManager->getRequiredDataSize());
-      addMemUsage(data.size() * sizeof(DataType));
+      assert(pData->size() == fourierManager->getRequiredDataSize());
 
     }
 
     //! Construct a zero-filled field on the specified grid
     Field(TGrid &grid, bool fourier = true) : pGrid(grid.shared_from_this()),
                                               fourierManager(std::make_shared<FourierManager>(*this)),
-                                              data(fourierManager->getRequiredDataSize(), 0),
-                                              fourier(fourier) {
-      addMemUsage(data.size() * sizeof(DataType));
+                                              pData(makeSharedData(TData(fourierManager->getRequiredDataSize(), 0))),
+                                              pCurrentData(pData.get()),
+                                              pWritableData(pData.get()),
+                                              fourier(fourier), bricked(false) {
     }
 
     virtual ~Field() {
-      removeMemUsage(data.size() * sizeof(DataType));
     }
 
   public:
@@ -267,14 +359,24 @@ namespace fields {
       return const_cast<TGrid &>(*pGrid);
     }
 
-    //! Returns a reference to the data vector that stores the field
+    /*! \brief Returns a reference to the data vector that stores the field, for modification
+
+        Copies of a field share its data until one of them is modified, at which point that one is given its own
+        copy. This happens here, so a reference obtained before the field was copied must not be used to modify it
+        afterwards, and code that only reads the data should go through a const reference to the field (or
+        std::as_const) so as not to copy it needlessly. Each call costs an atomic load, so loops over the data should
+        call this once rather than using operator[] for every element.
+    */
     TData &getDataVector() {
-      return data;
+      TData *pWritable = pWritableData.load(std::memory_order_acquire);
+      if (pWritable == nullptr)
+        pWritable = makeDataWritable();
+      return *pWritable;
     }
 
     //! Returns a constant reference to the data vector that stores the field.
     const TData &getDataVector() const {
-      return data;
+      return *pCurrentData.load(std::memory_order_acquire);
     }
 
     //! Returns a reference to the data vector storing the field.
@@ -298,7 +400,7 @@ namespace fields {
       y_p_0 = (int) floor(((location.y - offsetLower.y) / pGrid->cellSize));
       z_p_0 = (int) floor(((location.z - offsetLower.z) / pGrid->cellSize));
 
-      return (*this)[pGrid->getIndexFromCoordinate(Coordinate<int>(x_p_0, y_p_0, z_p_0))];
+      return (*this)[getStorageIndex(pGrid->getIndexFromCoordinate(Coordinate<int>(x_p_0, y_p_0, z_p_0)))];
     }
 
     //! Multiply the field in-place by the provided field
@@ -311,6 +413,7 @@ namespace fields {
       // To be on the safe side, we check that their grid have the same size.
       assert(other.getGrid().size3 == this->pGrid->size3);
       size_t N = this->pGrid->size3;
+      auto &data = getDataVector();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
         data[i]*=other[i];
@@ -320,6 +423,7 @@ namespace fields {
     //! Multiply the field in-place by the provided value
     template<typename OtherDataType>
     void operator*=(OtherDataType value) {
+      auto &data = getDataVector();
       size_t N = data.size();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
@@ -329,6 +433,7 @@ namespace fields {
 
     //! Add the provided field to this one in-place
     void operator+=(const Field<DataType, CoordinateType> & other) {
+      auto &data = getDataVector();
       size_t N = data.size();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
@@ -338,6 +443,7 @@ namespace fields {
 
     //! Subtract the provided field from this one in-place
     void operator-=(const Field<DataType, CoordinateType> & other) {
+      auto &data = getDataVector();
       size_t N = data.size();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
@@ -354,6 +460,7 @@ namespace fields {
     //! Add a multiple of the provided field to this one in-place
     void addScaled(const Field<DataType, CoordinateType> & other,
                    tools::datatypes::strip_complex<DataType> scale) {
+      auto &data = getDataVector();
       size_t N = data.size();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
@@ -367,6 +474,7 @@ namespace fields {
       assert(!isFourier());
 
       tools::datatypes::strip_complex<DataType> v=0;
+      const auto &data = getDataVector();
       size_t N = data.size();
 
 #pragma omp parallel for reduction(+:v)
@@ -383,10 +491,11 @@ namespace fields {
 
     Field<DataType, CoordinateType> operator-() const {
       auto ret(*this);
-      size_t N = data.size();
+      auto &retData = ret.getDataVector();
+      size_t N = retData.size();
 #pragma omp parallel for
       for(size_t i=0; i<N; i++) {
-        ret[i]=-ret[i];
+        retData[i]=-retData[i];
       }
       return ret;
     }
@@ -461,9 +570,24 @@ namespace fields {
       getWrappedCoords(index_y, y_p_0);
       getWrappedCoords(index_z, z_p_0);
 
-      size_t key_cell_index = pGrid->getIndexFromCoordinate({index_x[0], index_y[0], index_z[0]});
-
       auto & data = this->getDataVector();
+
+      if (bricked) {
+        // Brick-tiled storage has nothing beyond the last cell, so coordinates must be wrapped fully onto the grid
+        BrickLayout bricks(gridSize);
+        for (int i = 0; i < 4; ++i) {
+          if (index_x[i] >= int(gridSize)) index_x[i] -= gridSize;
+          if (index_y[i] >= int(gridSize)) index_y[i] -= gridSize;
+          if (index_z[i] >= int(gridSize)) index_z[i] -= gridSize;
+        }
+        for (int i = 0; i < 4; ++i)
+          for (int j = 0; j < 4; ++j)
+            for (int k = 0; k < 4; ++k)
+              data[bricks.getIndex(index_x[i], index_y[j], index_z[k])] += value * valsForInterpolation[i][j][k];
+        return;
+      }
+
+      size_t key_cell_index = pGrid->getIndexFromCoordinate({index_x[0], index_y[0], index_z[0]});
       for(int i=0; i<4; ++i) {
         for(int j=0; j<4; ++j) {
           for(int k=0; k<4; ++k) {
@@ -562,15 +686,16 @@ namespace fields {
       assert(y_p_0 < size_i && y_p_0 >= 0 && y_p_1 < size_i && y_p_1 >= 0);
       assert(z_p_0 < size_i && z_p_0 >= 0 && z_p_1 < size_i && z_p_1 >= 0);
 
+      const auto &data = getDataVector();
 
-      return xw0 * yw0 * zw1 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_0, y_p_0, z_p_1)] +
-             xw1 * yw0 * zw1 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_1, y_p_0, z_p_1)] +
-             xw0 * yw1 * zw1 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_0, y_p_1, z_p_1)] +
-             xw1 * yw1 * zw1 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_1, y_p_1, z_p_1)] +
-             xw0 * yw0 * zw0 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_0, y_p_0, z_p_0)] +
-             xw1 * yw0 * zw0 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_1, y_p_0, z_p_0)] +
-             xw0 * yw1 * zw0 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_0, y_p_1, z_p_0)] +
-             xw1 * yw1 * zw0 * (*this)[pGrid->getIndexFromCoordinateNoWrap(x_p_1, y_p_1, z_p_0)];
+      return xw0 * yw0 * zw1 * data[getStorageIndex({x_p_0, y_p_0, z_p_1})] +
+             xw1 * yw0 * zw1 * data[getStorageIndex({x_p_1, y_p_0, z_p_1})] +
+             xw0 * yw1 * zw1 * data[getStorageIndex({x_p_0, y_p_1, z_p_1})] +
+             xw1 * yw1 * zw1 * data[getStorageIndex({x_p_1, y_p_1, z_p_1})] +
+             xw0 * yw0 * zw0 * data[getStorageIndex({x_p_0, y_p_0, z_p_0})] +
+             xw1 * yw0 * zw0 * data[getStorageIndex({x_p_1, y_p_0, z_p_0})] +
+             xw0 * yw1 * zw0 * data[getStorageIndex({x_p_0, y_p_1, z_p_0})] +
+             xw1 * yw1 * zw0 * data[getStorageIndex({x_p_1, y_p_1, z_p_0})];
 
 #endif
 
@@ -597,6 +722,7 @@ namespace fields {
 
     numerics::LocalUnitTricubicApproximation<DataType> makeTricubicInterpolator(int x_p_0, int y_p_0, int z_p_0) const {
       assert(!this->isFourier());
+      const auto &data = getDataVector();
       DataType valsForInterpolation[4][4][4];
       for(int i=-1; i<3; ++i) {
         for(int j=-1; j<3; ++j) {
@@ -609,7 +735,7 @@ namespace fields {
               // about using results within a few cells of the boundary are issued to the user elsewhere.
               coord = pGrid->clampCoordinate(coord);
             }
-            valsForInterpolation[i+1][j+1][k+1] = (*this)[pGrid->getIndexFromCoordinateNoWrap(coord)];
+            valsForInterpolation[i+1][j+1][k+1] = data[getStorageIndex(coord)];
           }
         }
       }
@@ -620,12 +746,12 @@ namespace fields {
 
     //! Returns a constant reference to the value of the field at grid index i
     const DataType &operator[](size_t i) const {
-      return data[i];
+      return getDataVector()[i];
     }
 
     //! Returns a reference to the value of the field at grid index i
     DataType &operator[](size_t i) {
-      return data[i];
+      return getDataVector()[i];
     }
 
     /*
@@ -657,20 +783,77 @@ namespace fields {
     */
     void toFourier() {
       if (fourier) return;
+      // Where the Fourier manager supports it, brick-tiled data is copied straight into the padded FFT layout
+      if constexpr (!FourierManager::supportsBrickedLayout)
+        toRowMajor();
       fourierManager->performTransform();
+      bricked = false;
       assert(fourier);
     }
 
     //! \brief Converts the field to real space
     /*!
-        Does nothing if already in real space.
+        Does nothing if already in real space, except to restore the row-major order of brick-tiled data.
     */
     void toReal() {
+      toRowMajor();
       if (!fourier) return;
       fourierManager->performTransform();
       assert(!fourier);
     }
 
+    //! Returns true if the real-space data is held in brick-tiled order (see toBricked)
+    bool isBricked() const {
+      return bricked;
+    }
+
+    /*! \brief Converts the field to real space, holding the data in brick-tiled order (see BrickLayout).
+
+        Stencil operations (interpolation and deinterpolation) are faster in this order. Does nothing if the grid
+        cannot be tiled. While the field is bricked, its data must only be accessed through getStorageIndex (or by
+        operations that treat every element alike); toReal, toRowMajor and toFourier all leave it row-major again.
+        A field in Fourier space is transformed straight into bricks, without an intermediate row-major copy.
+    */
+    void toBricked() {
+      if (bricked || !BrickLayout::canTile(pGrid->size)) return;
+      if (fourier) {
+        if constexpr (FourierManager::supportsBrickedLayout) {
+          fourierManager->performTransform(true);
+          bricked = true;
+          return;
+        } else {
+          toReal();
+        }
+      }
+      auto &data = getDataVector();
+      std::vector<DataType> rowMajor(data.begin(), data.begin() + pGrid->size3);
+      BrickLayout(pGrid->size).copyToBricks(rowMajor.data(), pGrid->size, data.data());
+      bricked = true;
+    }
+
+    //! Restores brick-tiled real-space data (see toBricked) to the usual order by linear index
+    void toRowMajor() {
+      if (!bricked) return;
+      assert(!fourier);
+      auto &data = getDataVector();
+      std::vector<DataType> bricks(data.begin(), data.begin() + pGrid->size3);
+      BrickLayout(pGrid->size).copyFromBricks(bricks.data(), data.data(), pGrid->size);
+      bricked = false;
+    }
+
+    //! Returns the position in the data vector of the real-space value for the cell with linear index i
+    size_t getStorageIndex(size_t i) const {
+      if (!bricked) return i;
+      return getStorageIndex(pGrid->getGeometry().getCoordinateFromIndex(i));
+    }
+
+    //! Returns the position in the data vector of the real-space value for the cell at a coordinate within the grid
+    size_t getStorageIndex(const Coordinate<int> &coord) const {
+      if (bricked)
+        return BrickLayout(pGrid->size).getIndex(coord.x, coord.y, coord.z);
+      return pGrid->getIndexFromCoordinateNoWrap(coord);
+    }
+
     //! Returns the value of the field in Fourier space at the specified Fourier mode
     //! For efficiency, does not check whether the field is actually stored in Fourier space first.
     ComplexType getFourierCoefficient(int kx, int ky, int kz) const {
@@ -679,7 +862,7 @@ namespace fields {
 
     //! Generate a set of three Fourier fields from a function of k and the Fourier space field, supplied as an argument.
     template<typename... Args>
-    auto generateNewFourierFields(Args &&... args) {
+    auto generateNewFourierFields(Args &&... args) const {
       return fourierManager->generateNewFourierFields(args...);
     }
 
@@ -739,6 +922,14 @@ namespace fields {
 
     //! Apply a Fourier space filter that suppresses the field at some k
     void applyFilter(const filters::Filter<CoordinateType> &filter) {
+      if (auto tabulated = dynamic_cast<const filters::TabulatedFilter<CoordinateType> *>(&filter)) {
+        const auto &values = tabulated->getValuesForGrid(pGrid->size, pGrid->getFourierKmin());
+        forEachFourierCellInt([&values](ComplexType current_value, int kx, int ky, int kz) {
+          return current_value * values[kx * kx + ky * ky + kz * kz];
+        });
+        return;
+      }
+
       forEachFourierCell([&filter](ComplexType current_value, CoordinateType kx, CoordinateType ky, CoordinateType kz) {
         CoordinateType k = sqrt(double(kx * kx + ky * ky + kz * kz));
         return current_value * filter(k);
@@ -770,27 +961,29 @@ namespace fields {
         this->toFourier();
       else
         this->toReal();
-      this->data += inWindow->data;
+      this->getDataVector() += inWindow->getDataVector();
 
     }
 
     void setZeroInsideWindow(const Window<CoordinateType> & window) {
       toReal();
+      auto &data = getDataVector();
 
-#pragma omp parallel for default(none) shared(window)
+#pragma omp parallel for default(none) shared(window, data)
       for(size_t i=0; i<this->pGrid->size3; ++i) {
         if(window.contains(this->pGrid->getCentroidFromIndex(i)))
-          (*this)[i]=0;
+          data[i]=0;
       }
     }
 
     void setZeroOutsideWindow(const Window<CoordinateType> & window) {
       toReal();
+      auto &data = getDataVector();
 
-#pragma omp parallel for default(none) shared(window)
+#pragma omp parallel for default(none) shared(window, data)
       for(size_t i=0; i<this->pGrid->size3; ++i) {
         if(!window.contains(this->pGrid->getCentroidFromIndex(i)))
-          (*this)[i]=0;
+          data[i]=0;
       }
     }
 
@@ -825,7 +1018,12 @@ namespace fields {
       // counterintuitively requires a shared_ptr due to innards of addFieldFromDifferentGrid using shared_from_this
 
       temporaryField->applyFilter(filter);
+#ifdef BRICKED_REAL_SPACE
+      // The interpolation stencils gather from the brick-tiled copy, straight out of the inverse transform
+      temporaryField->toBricked();
+#else
       temporaryField->toReal();
+#endif
       this->toReal();
       this->addFieldFromDifferentGrid(*temporaryField);
 
@@ -839,6 +1037,7 @@ namespace fields {
 
       this->matchFourier(*temporaryField); // expect that the temporary field is now stored in Fourier space
 
+      auto & data = getDataVector();
       const auto & temporaryFieldData = temporaryField->getDataVector();
 
 #pragma omp parallel for schedule(static) default(none)  shared(data, temporaryFieldData)
@@ -865,25 +1064,38 @@ namespace fields {
         addFieldFromDifferentGridWithFilter(const_cast<const Field<DataType, CoordinateType> &>(source), filter);
       }
 
-    //! Outputs the field as a numpy array to the specified filename.
-    void dumpGridData(std::string filename) const {
+    //! Outputs the field as a numpy array to the specified filename, optionally reduced to single precision.
+    void dumpGridData(std::string filename, bool singlePrecision = false) const {
       int n = static_cast<int>(getGrid().size);
       const int dim[3] = {n, n, n};
-      io::numpy::SaveArrayAsNumpy(filename, false, 3, dim, data.data());
+      const auto &data = getDataVector();
+      if (singlePrecision)
+        io::numpy::SaveConvertedArrayAsNumpy<typename io::numpy::SinglePrecision<DataType>::type>(
+          filename, false, 3, dim, data.data());
+      else
+        io::numpy::SaveArrayAsNumpy(filename, false, 3, dim, data.data());
     }
 
     //! Loads field data from the specified numpy file, if this is possible.
+    /*!
+     * The file is memory mapped and copied straight into the field's storage, converting the precision if it
+     * differs from DataType.
+     */
     void loadGridData(std::string filename) {
-      int n = static_cast<int>(getGrid().size);
-      int n0, n1, n2;
-      io::numpy::LoadArrayFromNumpy(filename, n0, n1, n2, data);
-      if (n0 != n || n1 != n || n2 != n) {
+      size_t n = getGrid().size;
+      io::numpy::MappedNumpyArray array(filename);
+      const auto &shape = array.getShape();
+      if (shape.size() != 3 || size_t(shape[0]) != n || size_t(shape[1]) != n || size_t(shape[2]) != n) {
         throw std::runtime_error("Incorrect size for imported numpy array");
       }
-      assert(data.size() == getGrid().size3);
+      assert(array.getNumElements() == getGrid().size3);
+      auto &data = getDataVector();
       data.resize(fourierManager->getRequiredDataSize());
+      array.copyTo(data.data());
+      std::fill(data.begin() + getGrid().size3, data.end(), DataType(0));
     }
 
+    //! Returns a copy of the field, sharing its data until either is modified (see getDataVector)
     auto copy() const {
       return std::make_shared<Field<DataType,CoordinateType>>(*this);
     }
@@ -125,15 +125,17 @@ namespace fields {
     //! Converts the fields on each level to real space, if they are not already.
     void toReal() {
       assertContextConsistent();
-      for (size_t i = 0; i < multiLevelContext->getNumLevels(); ++i)
+      multiLevelContext->forEachLevelConcurrently([this](size_t i) {
         getFieldForLevel(i).toReal();
+      });
     }
 
     //! Converts the fields on each level to Fourier space, if they are not already.
     void toFourier() {
       assertContextConsistent();
-      for (size_t i = 0; i < multiLevelContext->getNumLevels(); ++i)
+      multiLevelContext->forEachLevelConcurrently([this](size_t i) {
         getFieldForLevel(i).toFourier();
+      });
     }
 
     //! Returns true if the specified field has the same multi-level context as this one.
@@ -296,11 +298,11 @@ namespace fields {
     //! Applies the specified filters to this field
     void applyFilters(const filters::FilterFamilyBase<T> & filters) {
       assertContextConsistent();
-      for (size_t level = 0; level < getNumLevels(); ++level) {
+      multiLevelContext->forEachLevelConcurrently([this, &filters](size_t level) {
         if (hasFieldForLevel(level)) {
           getFieldForLevel(level).applyFilter(filters.getFilterForLevel(level));
         }
-      }
+      });
     }
 
     /*! \brief Applies the default filters to this field
@@ -340,6 +342,9 @@ namespace fields {
      *
      * Thus, when converting to a covector, a more careful filter-within-window approach is applied based on the
      * analysis given in the notes.
+     *
+     * The filters for each pair of levels are tabulated once and cached by the multi-level context, since the metric
+     * is applied for every chi^2, inner product and modification.
      */
     void applyMetric(bool toCovector = false) {
       auto filters = getFilters();
@@ -354,13 +359,14 @@ namespace fields {
         auto & f = filters.getFilterForLevel(level);
         if(toCovector && level < getNumLevels()-1) {
           auto window = multiLevelContext->getGridForLevel(level+1).getWindow();
-          result->applyFilterInWindow(f, window, true);
-          result->applyFilterInWindow(f, window, false);
+          auto tabulated_f = multiLevelContext->getTabulatedFilter(f);
+          result->applyFilterInWindow(*tabulated_f, window, true);
+          result->applyFilterInWindow(*tabulated_f, window, false);
         } else
-          result->applyFilter(f*f);
+          result->applyFilter(*multiLevelContext->getTabulatedFilter(f*f));
 
         for(size_t source_level=0; source_level < getNumLevels(); ++source_level) {
-          auto & source_field = getFieldForLevel(source_level);
+          const auto & source_field = getFieldForLevel(source_level); // read only, so its data stays shared
           T pixel_volume_ratio = multiLevelContext->getWeightForLevel(level) /
                                  multiLevelContext->getWeightForLevel(source_level);
 
@@ -373,8 +379,9 @@ namespace fields {
             // shows that it has no discernible effect on the measured chi^2 (which is the only place it would enter).
             auto & this_level_filter = filters.getFilterForLevel(level);
             auto & source_level_filter = filters.getFilterForLevel(source_level);
-            result->addFieldFromDifferentGridWithFilter(source_field,
+            auto projection_filter = multiLevelContext->getTabulatedFilter(
               this_level_filter*source_level_filter*sqrt(pixel_volume_ratio));
+            result->addFieldFromDifferentGridWithFilter(source_field, *projection_filter);
           }
         }
         result->toFourier();
@@ -425,9 +432,14 @@ namespace fields {
       }
 
       toFourier();
-      for (size_t i = 0; i < getNumLevels(); ++i) {
-        applyTransferRatioOneLevel(oldSpecies, newSpecies, i);
-      }
+      auto oldCovariances = getCovariances(oldSpecies);
+      auto newCovariances = getCovariances(newSpecies);
+      multiLevelContext->forEachLevelConcurrently([&](size_t i) {
+        if(oldCovariances[i]!=nullptr)
+          getFieldForLevel(i).applyTransferFunction(*oldCovariances[i],-0.5);
+        if(newCovariances[i]!=nullptr)
+          getFieldForLevel(i).applyTransferFunction(*newCovariances[i],0.5);
+      });
 
     }
 
@@ -445,12 +457,18 @@ namespace fields {
     void applyTransfer(particle::species ofSpecies) {
       assertContextConsistent();
       toFourier();
-      for (size_t i = 0; i < multiLevelContext->getNumLevels(); ++i) {
-        auto &grid = multiLevelContext->getGridForLevel(i);
-
-        getFieldForLevel(i).applyTransferFunction(*multiLevelContext->getCovariance(i, ofSpecies), 0.5);
+      auto covariances = getCovariances(ofSpecies);
+      multiLevelContext->forEachLevelConcurrently([&](size_t i) {
+        getFieldForLevel(i).applyTransferFunction(*covariances[i], 0.5);
+      });
+    }
 
-      }
+    //! Returns the covariance for each level, fetched in series because the power spectrum's cache is not thread-safe
+    std::vector<std::shared_ptr<Field<DataType, T>>> getCovariances(particle::species species) const {
+      std::vector<std::shared_ptr<Field<DataType, T>>> covariances;
+      for (size_t i = 0; i < multiLevelContext->getNumLevels(); ++i)
+        covariances.push_back(multiLevelContext->getCovariance(i, species));
+      return covariances;
     }
 
 
@@ -5,6 +5,7 @@
 #include <gsl/gsl_randist.h> //for the gaussian (and other) distributions
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_spline.h>
+#include <memory>
 #include <omp.h>
 
 #include "src/simulation/grid/grid.hpp"
@@ -122,6 +123,18 @@ namespace fields {
     void draw() {
       if (!seeded)
         throw std::runtime_error("The random number generator has not been seeded");
+
+      if (drawInFourierSpace && parallel) {
+        // Each level draws from its own generators (one per k-shell), so the levels can be drawn concurrently
+        logging::entry() << "Drawing random numbers (all levels)" << std::endl;
+        field.getContext().forEachLevelConcurrently([this](size_t i) {
+          auto &fieldOnGrid = field.getFieldForLevel(i);
+          fieldOnGrid.toFourier();
+          drawRandomForSpecifiedGridFourier(fieldOnGrid);
+        });
+        return;
+      }
+
       for (size_t i = 0; i < field.getNumLevels(); ++i) {
         auto &fieldOnGrid = field.getFieldForLevel(i);
         if(i==0)
@@ -208,7 +221,12 @@ namespace fields {
 
       const grids::Grid<FloatType> &g = field.getGrid();
 
-      tools::progress::ProgressBar pb("");
+      // Levels drawn concurrently (see draw) would interleave their progress bars, so only a lone draw shows one
+      std::unique_ptr<tools::progress::ProgressBar> pb;
+#ifdef _OPENMP
+      if (!omp_in_parallel())
+#endif
+        pb = std::make_unique<tools::progress::ProgressBar>("");
 
       FloatType sigma = 1.0 / sqrt(2.0);
 
@@ -230,7 +248,7 @@ namespace fields {
 #ifdef OPENMP
           if (omp_get_thread_num() == 0)
 #endif
-            pb.setProgress(float(ks * ks) * (ks * 8) / g.size3);
+            if (pb) pb->setProgress(float(ks * ks) * (ks * 8) / g.size3);
           for (int k1 = -ks; k1 < ks; k1++) {
             for (int k2 = -ks; k2 < ks; k2++) {
               drawOneFourierMode(field, ks, k1, k2, sigma, localRandomState);
@@ -245,7 +263,7 @@ namespace fields {
       } else {
         // N.B. This is the original way of doing things that does not allow for parallelization
         for (int ks = 0; ks < int(g.size / 2); ks++) {
-          pb.setProgress(float(ks * ks) * (ks * 8) / g.size3);
+          if (pb) pb->setProgress(float(ks * ks) * (ks * 8) / g.size3);
           for (int k1 = -ks; k1 < ks; k1++) {
             for (int k2 = -ks; k2 < ks; k2++) {
               drawOneFourierMode(field, ks, k1, k2, sigma, randomState);
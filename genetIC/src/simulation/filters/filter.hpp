@@ -2,6 +2,7 @@
 #define IC_FILTER_HPP
 
 #include <stdexcept>
+#include <typeinfo>
 /*!
     \namespace filters
     \brief Define the filters used to separate low and high k modes in the box
@@ -67,6 +68,16 @@ namespace filters {
       return ProductFilter<T>(*this, ValueAsFilter<T>(value));
     }
 
+    /*! \brief Returns true if other is known to have exactly the same response as this filter at every k
+
+        Used to share tabulations of filters (see MultiLevelGridBase::getTabulatedFilter). Each subclass compares its
+        own type and parameters; a subclass that does not override this is never considered equivalent to anything,
+        not even itself, and so is never shared.
+    */
+    virtual bool isEquivalentTo(const Filter<T> &other) const {
+      return typeid(*this) == typeid(Filter<T>) && typeid(other) == typeid(Filter<T>);
+    }
+
     //! Output debug information (debug use only)
     virtual void debugInfo(std::ostream &s) const {
       s << "Filter";
@@ -94,6 +105,11 @@ namespace filters {
       return std::make_shared<NullFilter<T>>();
     }
 
+    //! All null filters are equivalent
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      return typeid(other) == typeid(*this);
+    }
+
     //! Output debug information to the specified stream.
     virtual void debugInfo(std::ostream &s) const override {
       s << "NullFilter";
@@ -121,6 +137,11 @@ namespace filters {
       return std::make_shared<ValueAsFilter<T>>(value);
     }
 
+    //! Equivalent to another filter returning the same value
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      return typeid(other) == typeid(*this) && static_cast<const ValueAsFilter<T> &>(other).value == value;
+    }
+
     //! Output debug information to the specified stream.
     virtual void debugInfo(std::ostream &s) const override {
       s << value;
@@ -156,6 +177,14 @@ namespace filters {
       return std::make_shared<DivisionFilter<T>>(*pFirst, *pSecond);
     }
 
+    //! Equivalent to another filter of the same type whose two filters are equivalent to these, in the same order
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      if (typeid(other) != typeid(*this))
+        return false;
+      const auto &otherDivision = static_cast<const DivisionFilter<T> &>(other);
+      return pFirst->isEquivalentTo(*otherDivision.pFirst) && pSecond->isEquivalentTo(*otherDivision.pSecond);
+    }
+
     virtual void debugInfo(std::ostream &s) const override {
       s << (*pFirst) << "/" << (*pSecond);
     }
@@ -227,6 +256,14 @@ namespace filters {
       return std::make_shared<LowPassFermiFilter<T>>(*this);
     }
 
+    //! Equivalent to another Fermi filter with the same cutoff and temperature
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      if (typeid(other) != typeid(*this))
+        return false;
+      const auto &otherFermi = static_cast<const LowPassFermiFilter<T> &>(other);
+      return otherFermi.kcut == kcut && otherFermi.temperature == temperature;
+    }
+
     //! Fermi dirac distribution as the filter's temperature and cutoff in k-space
     T operator()(T k) const override {
       return 1. / (1. + exp((k - kcut) / temperature));
@@ -268,6 +305,12 @@ namespace filters {
       return std::make_shared<ComplementaryCovarianceFilterAdaptor<UnderlyingType>>(*this);
     }
 
+    //! Equivalent to another such adaptor of an equivalent filter
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      return typeid(other) == typeid(*this) &&
+             pUnderlying->isEquivalentTo(*static_cast<const ComplementaryCovarianceFilterAdaptor &>(other).pUnderlying);
+    }
+
     //! Debug information (only used for debugging purposes)
     virtual void debugInfo(std::ostream &s) const override {
       s << "ComplementaryCovarianceFilterAdaptor(" << (*pUnderlying) << ")";
@@ -310,6 +353,12 @@ namespace filters {
       return std::make_shared<ComplementaryFilterAdaptor<UnderlyingType>>(*this);
     }
 
+    //! Equivalent to another such adaptor of an equivalent filter
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      return typeid(other) == typeid(*this) &&
+             pUnderlying->isEquivalentTo(*static_cast<const ComplementaryFilterAdaptor &>(other).pUnderlying);
+    }
+
     //! Debug information (only used for debugging purposes)
     virtual void debugInfo(std::ostream &s) const override {
       s << "ComplementaryFilterAdaptor(" << (*pUnderlying) << ")";
@@ -0,0 +1,80 @@
+#ifndef IC_TABULATED_HPP
+#define IC_TABULATED_HPP
+
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "src/simulation/filters/filter.hpp"
+
+namespace filters {
+
+  /*! \class TabulatedFilter
+      \brief Wraps a filter, tabulating its values at each |k|^2 that occurs on the grids it is applied to
+
+      Evaluating a composite filter involves a chain of virtual calls and transcendental functions for every Fourier
+      cell. On a grid with n cells a side, the integer wavenumbers only give rise to 3(n/2)^2+1 distinct values of
+      |k|^2, so Field::applyFilter looks these up instead when handed a TabulatedFilter. The tables are built on
+      first use for each grid size and kept for the lifetime of the filter (see MultiLevelGridBase::getTabulatedFilter).
+  */
+  template<typename T>
+  class TabulatedFilter : public Filter<T> {
+  protected:
+    std::shared_ptr<Filter<T>> pUnderlying; //!< The filter being tabulated
+    mutable std::map<std::pair<size_t, T>, std::vector<T>> tables; //!< Tables keyed by grid size and fundamental wavenumber
+    mutable std::mutex tablesMutex; //!< Guards construction of new tables
+
+  public:
+    //! Constructs a tabulated version of the specified filter
+    explicit TabulatedFilter(const Filter<T> &underlying) : pUnderlying(underlying.clone()) {}
+
+    //! Returns the filter being tabulated
+    const Filter<T> &getUnderlying() const {
+      return *pUnderlying;
+    }
+
+    //! Returns the underlying filter at the specified k
+    T operator()(T k) const override {
+      return (*pUnderlying)(k);
+    }
+
+    /*! \brief Returns the filter values for a grid, indexed by kx^2 + ky^2 + kz^2 in integer wavenumbers
+        \param size - number of cells on a side of the grid
+        \param kMin - fundamental wavenumber of the grid
+    */
+    const std::vector<T> &getValuesForGrid(size_t size, T kMin) const {
+      std::lock_guard<std::mutex> lock(tablesMutex);
+      auto &values = tables[std::make_pair(size, kMin)];
+      if (values.empty()) {
+        size_t kNyquist = size / 2;
+        values.resize(3 * kNyquist * kNyquist + 1);
+#pragma omp parallel for schedule(static)
+        for (size_t k2 = 0; k2 < values.size(); ++k2) {
+          values[k2] = (*pUnderlying)(kMin * std::sqrt(T(k2)));
+        }
+      }
+      return values;
+    }
+
+    //! Returns a copy of the filter (sharing no tables with this one)
+    std::shared_ptr<Filter<T>> clone() const override {
+      return std::make_shared<TabulatedFilter<T>>(*pUnderlying);
+    }
+
+    //! Equivalent to another tabulation of an equivalent filter
+    bool isEquivalentTo(const Filter<T> &other) const override {
+      return typeid(other) == typeid(*this) &&
+             pUnderlying->isEquivalentTo(static_cast<const TabulatedFilter<T> &>(other).getUnderlying());
+    }
+
+    //! Output debug information to the specified stream.
+    void debugInfo(std::ostream &s) const override {
+      s << "TabulatedFilter(" << (*pUnderlying) << ")";
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef IC_DILATION_HPP
+#define IC_DILATION_HPP
+
+#include <omp.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <vector>
+
+namespace grids {
+
+  /*! \brief Dilates a line of occupancy flags, so that each cell is set if any cell within radius of it was set
+
+      \param line - the input flags
+      \param radius - number of cells by which to grow each set cell in each direction
+      \param periodic - if true, the line wraps around; otherwise cells beyond its ends count as unset
+      \param result - on exit, the dilated flags (must not alias line)
+      \param counts - scratch space for the running count of set cells
+  */
+  inline void dilateLine(const std::vector<char> &line, size_t radius, bool periodic,
+                         std::vector<char> &result, std::vector<size_t> &counts) {
+    const long n = static_cast<long>(line.size());
+    result.resize(line.size());
+
+    if (periodic && 2 * radius + 1 >= line.size()) {
+      bool anySet = std::any_of(line.begin(), line.end(), [](char f) { return f != 0; });
+      std::fill(result.begin(), result.end(), char(anySet));
+      return;
+    }
+
+    // Without wrapping, a radius larger than the line is equivalent to one of the same length
+    const long r = static_cast<long>(std::min(radius, line.size()));
+
+    // counts[j] is the number of set cells at positions [-r, j - r) along the line, with positions outside the
+    // line either wrapped or treated as unset
+    counts.resize(n + 2 * r + 1);
+    counts[0] = 0;
+    for (long j = 0; j < n + 2 * r; ++j) {
+      long c = j - r;
+      bool isSet;
+      if (c >= 0 && c < n)
+        isSet = line[c] != 0;
+      else if (periodic)
+        isSet = line[c < 0 ? c + n : c - n] != 0;
+      else
+        isSet = false;
+      counts[j + 1] = counts[j] + isSet;
+    }
+
+    for (long i = 0; i < n; ++i)
+      result[i] = char(counts[i + 2 * r + 1] > counts[i]);
+  }
+
+  /*! \brief Dilates a cuboid occupancy mask by radius cells along each axis, i.e. by a cube of side 2*radius+1
+
+      \param mask - flags for each cell of a box with the given shape, ordered by linear index (x*ny+y)*nz+z
+      \param shape - number of cells along the x, y and z axes of the box
+      \param radius - number of cells by which to grow the flagged region in each direction
+      \param periodic - for each axis, true if the box wraps around along it; otherwise the region is clipped at
+                        the faces of the box
+
+      The dilation is separable, so it is applied as one pass along each axis in turn. Each pass processes the
+      lines along its axis in parallel, in place; lines with nothing flagged are left untouched.
+  */
+  inline void dilateMask(std::vector<char> &mask, const std::array<size_t, 3> &shape, size_t radius,
+                         const std::array<bool, 3> &periodic) {
+    if (radius == 0 || mask.empty())
+      return;
+
+    const size_t strides[3] = {shape[1] * shape[2], shape[2], 1};
+
+    for (int axis = 2; axis >= 0; --axis) {
+      const size_t length = shape[axis];
+      const size_t stride = strides[axis];
+      const size_t nLines = mask.size() / length;
+
+#pragma omp parallel
+      {
+        std::vector<char> line(length), result(length);
+        std::vector<size_t> counts;
+
+#pragma omp for schedule(static)
+        for (size_t lineIndex = 0; lineIndex < nLines; ++lineIndex) {
+          // Linear index of the first cell of the line; lines are numbered in order of the other two coordinates
+          size_t start = (lineIndex / stride) * stride * length + lineIndex % stride;
+
+          bool anySet = false;
+          for (size_t i = 0; i < length; ++i) {
+            line[i] = mask[start + i * stride];
+            anySet |= line[i] != 0;
+          }
+          if (!anySet)
+            continue;
+
+          dilateLine(line, radius, periodic[axis], result, counts);
+          for (size_t i = 0; i < length; ++i)
+            mask[start + i * stride] = result[i];
+        }
+      }
+    }
+  }
+
+}
+
+#endif
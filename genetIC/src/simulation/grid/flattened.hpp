@@ -0,0 +1,115 @@
+#ifndef IC_FLATTENED_HPP
+#define IC_FLATTENED_HPP
+
+#include <climits>
+#include <cstddef>
+#include <vector>
+#include "src/simulation/coordinate.hpp"
+
+namespace grids {
+
+  template<typename T>
+  class Grid;
+
+  //! The resampling applied at the bottom of a flattened tower of grids (see FlattenedGrid)
+  enum class Resampling {
+    none, //!< values are stored directly on the target grid
+    superSample, //!< values are interpolated from the coarser source grid at the centre of each target cell
+    subSample //!< values are averaged over the cells of the finer source grid that make up each target cell
+  };
+
+  /*! \brief A tower of virtual grids reduced to a single affine map onto one target grid, plus at most one resampling stage.
+
+      The cell at coordinate c on the flattened grid corresponds to the cell at coordinate wrap(c + offset) on the
+      target grid. Each clip describes a section of a grid that the cell had to lie within on the way down the tower:
+      cells for which wrap(c + clip.offset) lies outside [0, clip.limit) along any axis are not part of the flattened
+      grid. Cells on the target grid are also only present if their coordinates are below targetLimit.
+
+      If the resampling is none, the target is a grid on which a field is stored. Otherwise the target is a
+      SuperSampleGrid or SubSampleGrid, and values on it come from the source grid, which is factor times coarser or
+      finer respectively. For sub-sampling, the cells of the source grid exist below sourceLimit along each axis.
+  */
+  template<typename T>
+  struct FlattenedGrid {
+    //! A section of grid (in coordinates relative to the flattened grid) that a cell must lie within
+    struct Clip {
+      Coordinate<int> offset; //!< Added to the coordinate on the flattened grid before wrapping
+      int limit; //!< Wrapped coordinates must be below this along each axis
+    };
+
+    size_t size = 0; //!< Number of cells on a side of the flattened grid
+    const Grid<T> *target = nullptr; //!< Grid onto which cells are mapped
+    size_t targetSize = 0; //!< Number of cells on a side of the target grid
+    int targetLimit = INT_MAX; //!< Cells on the target grid exist below this coordinate along each axis
+    Coordinate<int> offset; //!< Added to the coordinate on the flattened grid to give the coordinate on the target
+    int period = 0; //!< Number of cells across the periodic domain, at the resolution of the target
+    std::vector<Clip> clips; //!< Sections that cells must lie within
+
+    Resampling resampling = Resampling::none; //!< Resampling between the target and source grids
+    const Grid<T> *source = nullptr; //!< Grid from which values are resampled (if resampling is not none)
+    int factor = 1; //!< Ratio between the resolutions of the target and source grids
+    size_t sourceSize = 0; //!< Number of cells on a side of the source grid
+    int sourceLimit = 0; //!< For sub-sampling, cells of the source grid exist below this coordinate along each axis
+
+    //! Wraps a single coordinate into [0, period), assuming it lies within one period of that range
+    int wrap(int x) const {
+      if (x >= period) x -= period;
+      if (x < 0) x += period;
+      return x;
+    }
+
+    //! Wraps a coordinate into [0, period) along each axis
+    Coordinate<int> wrap(const Coordinate<int> &coord) const {
+      return Coordinate<int>(wrap(coord.x), wrap(coord.y), wrap(coord.z));
+    }
+
+    //! Returns the coordinate on the flattened grid of the cell with linear index i
+    Coordinate<int> getCoordinateFromIndex(size_t i) const {
+      size_t x = i / (size * size);
+      i -= x * size * size;
+      size_t y = i / size;
+      size_t z = i - y * size;
+      return Coordinate<int>(int(x), int(y), int(z));
+    }
+
+    //! Returns true if the cell with the given coordinate on the flattened grid lies within all the clips
+    bool isMapped(const Coordinate<int> &coord) const {
+      for (const auto &clip : clips) {
+        auto clipped = wrap(coord + clip.offset);
+        if (clipped.x >= clip.limit || clipped.y >= clip.limit || clipped.z >= clip.limit)
+          return false;
+      }
+      return true;
+    }
+
+    //! Returns the coordinate on the target grid of the cell with the given coordinate on the flattened grid
+    Coordinate<int> getTargetCoordinate(const Coordinate<int> &coord) const {
+      return wrap(coord + offset);
+    }
+
+    //! Returns true if the cell with linear index i exists on the flattened grid
+    bool contains(size_t i) const {
+      if (i >= size * size * size)
+        return false;
+      return containsCoordinate(getCoordinateFromIndex(i));
+    }
+
+    //! Returns true if the cell with the given coordinate (which must lie within [0, size)) exists on the flattened grid
+    bool containsCoordinate(const Coordinate<int> &coord) const {
+      if (!isMapped(coord))
+        return false;
+      if (targetLimit == INT_MAX)
+        return true;
+      auto targetCoord = getTargetCoordinate(coord);
+      return targetCoord.x < targetLimit && targetCoord.y < targetLimit && targetCoord.z < targetLimit;
+    }
+
+    //! Returns true if cells map one-to-one onto the target grid with the same linear indices
+    bool isIdentity() const {
+      return offset.x == 0 && offset.y == 0 && offset.z == 0 && size == targetSize && clips.empty();
+    }
+  };
+
+}
+
+#endif
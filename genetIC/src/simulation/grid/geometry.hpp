@@ -0,0 +1,130 @@
+#ifndef IC_GEOMETRY_HPP
+#define IC_GEOMETRY_HPP
+
+#include <cstddef>
+#include "src/simulation/coordinate.hpp"
+
+namespace grids {
+
+  /*! \brief Index arithmetic for the cells of a cubic grid, as a small value type with no virtual calls.
+
+      Cells are laid out as in Grid, with linear index (x * size + y) * size + z. Where size is a power of two (the
+      usual case), conversions between indices and coordinates use shifts and masks rather than division. Periodic
+      wrapping is branch-free.
+
+      Hot loops should take a copy of the geometry (see Grid::getGeometry) so that the compiler can inline all the
+      index calculations. Note that the geometry describes the plain layout of cells: virtual grids that remap cell
+      indices (such as CenteredGrid) do not follow it.
+  */
+  template<typename T>
+  class GridGeometry {
+  public:
+    size_t size; //!< Number of cells on a side
+    size_t size2; //!< Number of cells on a face
+    size_t size3; //!< Total number of cells
+    int periodicSize; //!< Number of cells across the periodic domain at this resolution
+    T cellSize; //!< Size of one cell in comoving units
+    Coordinate<T> offsetLower; //!< Position of the lower front left hand corner of the grid
+
+  protected:
+    int log2Size; //!< log2(size) if size is a power of two, otherwise -1
+    size_t mask; //!< size - 1, used for wrapping and extracting coordinates when size is a power of two
+
+  public:
+    /*! \brief Constructs the geometry of a grid
+        \param size - number of cells on a side
+        \param periodicSize - number of cells across the periodic domain at this resolution
+        \param cellSize - size of one cell in comoving units
+        \param offsetLower - position of the lower front left hand corner of the grid
+    */
+    GridGeometry(size_t size, size_t periodicSize, T cellSize, const Coordinate<T> &offsetLower) :
+      size(size), size2(size * size), size3(size * size * size), periodicSize(int(periodicSize)),
+      cellSize(cellSize), offsetLower(offsetLower), log2Size(-1), mask(size - 1) {
+      if (size > 0 && (size & (size - 1)) == 0) {
+        log2Size = 0;
+        while ((size_t(1) << log2Size) < size)
+          ++log2Size;
+      }
+    }
+
+    //! Returns true if the number of cells on a side is a power of two
+    bool isPowerOfTwo() const {
+      return log2Size >= 0;
+    }
+
+    //! Wraps x into [0, n), assuming it lies within one period of that range
+    static int wrap(int x, int n) {
+      x -= n & -int(x >= n);
+      x += n & -int(x < 0);
+      return x;
+    }
+
+    //! Wraps the coordinate into [0, periodicSize) along each axis, assuming it lies within one period of that range
+    Coordinate<int> wrapCoordinate(const Coordinate<int> &coord) const {
+      return Coordinate<int>(wrap(coord.x, periodicSize), wrap(coord.y, periodicSize), wrap(coord.z, periodicSize));
+    }
+
+    //! Wraps the coordinate into [0, size) along each axis, assuming it lies within one grid size of that range
+    Coordinate<int> wrapCoordinateAroundGrid(const Coordinate<int> &coord) const {
+      if (isPowerOfTwo())
+        return Coordinate<int>(int(coord.x & mask), int(coord.y & mask), int(coord.z & mask));
+      const int n = int(size);
+      return Coordinate<int>(wrap(coord.x, n), wrap(coord.y, n), wrap(coord.z, n));
+    }
+
+    //! Converts a coordinate that lies within the grid to a linear index
+    size_t getIndexFromCoordinateNoWrap(int x, int y, int z) const {
+      if (isPowerOfTwo())
+        return (size_t(x) << (2 * log2Size)) | (size_t(y) << log2Size) | size_t(z);
+      return (size_t(x) * size + size_t(y)) * size + size_t(z);
+    }
+
+    //! Converts a coordinate that lies within the grid to a linear index
+    size_t getIndexFromCoordinateNoWrap(const Coordinate<int> &coord) const {
+      return getIndexFromCoordinateNoWrap(coord.x, coord.y, coord.z);
+    }
+
+    //! Converts a coordinate to a linear index, first wrapping it around the periodic domain
+    size_t getIndexFromCoordinate(const Coordinate<int> &coord) const {
+      return getIndexFromCoordinateNoWrap(wrapCoordinate(coord));
+    }
+
+    //! Converts a linear index (which must be below size3) to a coordinate
+    Coordinate<int> getCoordinateFromIndex(size_t id) const {
+      if (isPowerOfTwo())
+        return Coordinate<int>(int(id >> (2 * log2Size)), int((id >> log2Size) & mask), int(id & mask));
+      size_t x = id / size2;
+      id -= x * size2;
+      size_t y = id / size;
+      id -= y * size;
+      return Coordinate<int>(int(x), int(y), int(id));
+    }
+
+    //! Returns the comoving position of the centre of the cell at the given coordinate
+    Coordinate<T> getCentroidFromCoordinate(const Coordinate<int> &coord) const {
+      Coordinate<T> result(coord);
+      result *= cellSize;
+      result += offsetLower;
+      result += cellSize / 2;
+      return result;
+    }
+
+    //! Returns the comoving position of the centre of the cell with the given linear index
+    Coordinate<T> getCentroidFromIndex(size_t id) const {
+      return getCentroidFromCoordinate(getCoordinateFromIndex(id));
+    }
+
+    //! Returns the linear index of the cell displaced from index by step, wrapping around the periodic domain
+    size_t getIndexFromIndexAndStep(size_t index, const Coordinate<int> &step) const {
+      return getIndexFromCoordinate(getCoordinateFromIndex(index) + step);
+    }
+
+    //! Returns the linear index of the cell displaced from index by step, wrapping around the *grid*
+    size_t getIndexFromIndexAndStepWithWrap(size_t index, const Coordinate<int> &step) const {
+      return getIndexFromCoordinateNoWrap(wrapCoordinateAroundGrid(getCoordinateFromIndex(index) + step));
+    }
+  };
+
+}
+
+#endif
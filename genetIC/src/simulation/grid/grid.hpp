@@ -1,6 +1,7 @@
 #ifndef __GRID_HPP
 #define __GRID_HPP
 
+#include <array>
 #include <cassert>
 #include <set>
 #include <type_traits>
@@ -13,6 +14,9 @@
 #include "src/tools/util_functions.hpp"
 #include "src/tools/data_types/complex.hpp"
 #include "src/simulation/window.hpp"
+#include "src/simulation/grid/dilation.hpp"
+#include "src/simulation/grid/flattened.hpp"
+#include "src/simulation/grid/geometry.hpp"
 #include "boost/config.hpp"
 
 using std::complex;
@@ -92,6 +96,11 @@ namespace grids {
     const T cellMassFrac; //!< the fraction of mass of the full simulation in a single cell of this grid
     const T cellSofteningScale; //!< normally 1.0; scales softening relative to dx
 
+  protected:
+    const GridGeometry<T> geometry; //!< Index arithmetic for the plain layout of cells on this grid
+
+  public:
+
     /*! \brief Detailed constructor - supply all properties
 
         \param simsize - size of the simulation in comoving units
@@ -110,7 +119,7 @@ namespace grids {
       size(n), size2(n * n), size3(n * n * n),
       simEquivalentSize((unsigned) tools::getRatioAndAssertInteger(simsize, dx)),
       cellMassFrac(massFrac == 0.0 ? pow(dx / simsize, 3.0) : massFrac),
-      cellSofteningScale(softScale) {
+      cellSofteningScale(softScale), geometry(n, simEquivalentSize, dx, offsetLower) {
       setKmin();
     }
 
@@ -118,7 +127,7 @@ namespace grids {
     explicit Grid(size_t n) : periodicDomainSize(0), thisGridSize(n),
                               cellSize(1.0), offsetLower(0, 0, 0),
                               size(n), size2(n * n), size3(n * n * n), simEquivalentSize(0), cellMassFrac(0.0),
-                              cellSofteningScale(1.0) {
+                              cellSofteningScale(1.0), geometry(n, simEquivalentSize, cellSize, offsetLower) {
       setKmin();
     }
 
@@ -274,29 +283,105 @@ namespace grids {
       tools::sortAndEraseDuplicate(flags);
     }
 
-    /*! \brief For each existing flag, flags the point one step ahead and one step behind.
+    /*! \brief Flags the cells in a list which is already sorted and free of duplicates, taking ownership of it.
 
-     So, if there is initially a flag at position (x0,y0,z0), and we step by (x,y,z), then
-     afterwards the points (x0-x,y0-y,z0-z), (x0,y0,z0), and (x0 + x,y0 + y,z0 + z) will all
-     be flagged. Triples the number of flags, but removes any duplicates.*/
-    virtual void expandFlaggedRegionInDirection(const Coordinate<int> &step) {
-      size_t old_size = flags.size();
-      flags.resize(old_size * 3);
-      for (size_t i = 0; i < old_size; ++i) {
-        size_t original_cell_id = flags[i];
-        flags[i + old_size] = this->getIndexFromIndexAndStep(original_cell_id, step);
-        flags[i + old_size * 2] = this->getIndexFromIndexAndStep(original_cell_id, -step);
-      }
-      tools::sortAndEraseDuplicate(flags);
+        Equivalent to flagCells, except that if nothing is flagged yet the list simply becomes the flags.
+     */
+    virtual void flagSortedCells(std::vector<size_t> &&sortedCells) {
+      if (flags.empty())
+        flags = std::move(sortedCells);
+      else
+        flagCells(sortedCells);
     }
 
-    //! Expands the flagged region by ncells cells in each of the x,y,z directions.
+    /*! \brief Expands the flagged region by ncells cells in each of the x,y,z directions.
+
+     The flags are marked on an occupancy mask covering only the box that the expanded region can reach, i.e. the
+     bounding box of the flagged cells grown by ncells on each side. The mask is dilated along each axis in turn (see
+     dilateMask) and then converted back into a sorted list. A grid covering the whole simulation wraps periodically,
+     so the bounding box may itself wrap, and an axis the expanded region spans completely is dilated periodically;
+     on a zoom grid, the region is clipped at the edges of the grid.*/
     virtual void expandFlaggedRegion(size_t ncells = 1) {
-      for (size_t i = 0; i < ncells; i++) {
-        expandFlaggedRegionInDirection({0, 0, 1});
-        expandFlaggedRegionInDirection({0, 1, 0});
-        expandFlaggedRegionInDirection({1, 0, 0});
+      if (ncells == 0 || flags.empty())
+        return;
+
+      const bool periodic = size == simEquivalentSize;
+      const int gridSize = int(size);
+      const int radius = int(std::min(ncells, size));
+
+      // Inclusive bounds of the flagged cells; on a periodic grid the upper bound may lie beyond the edge of the box
+      Coordinate<int> lowerCell, upperCell;
+      if (periodic) {
+        Window<int> flaggedWindow(gridSize, this->getCoordinateFromIndex(flags[0]));
+        for (auto cell_id : flags)
+          flaggedWindow.expandToInclude(this->getCoordinateFromIndex(cell_id));
+        lowerCell = flaggedWindow.getLowerCornerInclusive();
+        upperCell = lowerCell + flaggedWindow.getSizes() - 1;
+      } else {
+        lowerCell = upperCell = this->getCoordinateFromIndex(flags[0]);
+        for (auto cell_id : flags) {
+          auto coord = this->getCoordinateFromIndex(cell_id);
+          for (int dim = 0; dim < 3; ++dim) {
+            lowerCell[dim] = std::min(lowerCell[dim], coord[dim]);
+            upperCell[dim] = std::max(upperCell[dim], coord[dim]);
+          }
+        }
+      }
+
+      Coordinate<int> origin;
+      std::array<size_t, 3> shape;
+      std::array<bool, 3> wrapAxis;
+      bool boxWraps = false;
+      for (int dim = 0; dim < 3; ++dim) {
+        int lower = lowerCell[dim] - radius;
+        int upper = upperCell[dim] + radius;
+        if (periodic && upper - lower + 1 >= gridSize) {
+          lower = 0;
+          upper = gridSize - 1;
+          wrapAxis[dim] = true;
+        } else {
+          if (!periodic) {
+            lower = std::max(lower, 0);
+            upper = std::min(upper, gridSize - 1);
+          }
+          wrapAxis[dim] = false;
+          boxWraps |= lower < 0 || upper >= gridSize;
+        }
+        origin[dim] = lower;
+        shape[dim] = size_t(upper - lower + 1);
+      }
+
+      auto wrapToGrid = [gridSize](int x) { return ((x % gridSize) + gridSize) % gridSize; };
+
+      std::vector<char> mask(shape[0] * shape[1] * shape[2], 0);
+#pragma omp parallel for
+      for (size_t i = 0; i < flags.size(); ++i) {
+        auto local = this->getCoordinateFromIndex(flags[i]) - origin;
+        for (int dim = 0; dim < 3; ++dim)
+          local[dim] = wrapToGrid(local[dim]);
+        mask[(local.x * shape[1] + local.y) * shape[2] + local.z] = 1;
+      }
+
+      dilateMask(mask, shape, ncells, wrapAxis);
+
+      flags.clear();
+      tools::appendSelectedIndices(mask, 0, flags);
+
+#pragma omp parallel for
+      for (size_t i = 0; i < flags.size(); ++i) {
+        size_t local = flags[i];
+        Coordinate<int> coord(int(local / (shape[1] * shape[2])), int((local / shape[2]) % shape[1]),
+                              int(local % shape[2]));
+        coord += origin;
+        if (boxWraps)
+          for (int dim = 0; dim < 3; ++dim)
+            coord[dim] = wrapToGrid(coord[dim]);
+        flags[i] = this->getIndexFromCoordinateNoWrap(coord);
       }
+
+      // The mask is ordered like the grid unless the box wraps round the edge of the grid
+      if (boxWraps)
+        tools::parallelSort(flags);
     }
 
     //! Removes all cells flags - used as part of clearing.
@@ -346,29 +431,35 @@ namespace grids {
      * problems seemed to be sufficient for practical purposes. (If a grid is not much bigger than 16^3, the
      * parallelisation will be very poor -- but on the other hand, it's such a small grid that performance is
      * unlikely to be an issue.)
+     *
+     * Every cell index is passed to the callback exactly once. The indices follow the plain layout of cells (see
+     * getGeometry), so that the index arithmetic and the callback itself can be inlined.
      */
-    void parallelIterateOverCellsSpatiallyClustered(std::function<void(size_t)> callback, int chunk_size=16) const {
+    template<typename Callback>
+    void parallelIterateOverCellsSpatiallyClustered(const Callback &callback, int chunk_size=16) const {
       // This prevents error when the grid is tiny
       if (chunk_size > int(size))
         chunk_size = size;
       size_t nChunksPerSide = size_t(std::ceil(size/double(chunk_size)));
       size_t nChunks = std::pow(nChunksPerSide,3);
-      Grid<T> gridOfChunks(periodicDomainSize, nChunksPerSide, cellSize*chunk_size);
-
-      // Explicit typing of this lambda seems required to prevent Clang linking error (which only shows up
-      // when used in parallel, as below).
-      std::function<void(const Coordinate<int> &)> adaptedCallback = [callback, this](const Coordinate<int> & coord) {
-        callback(this->getIndexFromCoordinate(coord));
-      };
+      const GridGeometry<T> chunkGeometry(nChunksPerSide, nChunksPerSide, cellSize*chunk_size, offsetLower);
+      const GridGeometry<T> cellGeometry = geometry;
+      const int size_i = int(size);
 
-#pragma omp parallel for schedule(dynamic) default(none) shared(nChunks, gridOfChunks, chunk_size, adaptedCallback)
+#pragma omp parallel for schedule(dynamic) default(none) shared(nChunks, chunkGeometry, cellGeometry, chunk_size, size_i, callback)
       for(size_t chunk=0; chunk<nChunks; chunk++) {
-        auto lci_coordinate = gridOfChunks.getCoordinateFromIndex(chunk) * chunk_size;
+        auto lci_coordinate = chunkGeometry.getCoordinateFromIndex(chunk) * chunk_size;
         auto uce_coordinate = lci_coordinate+chunk_size;
-        if(BOOST_UNLIKELY(uce_coordinate.x>size)) uce_coordinate.x = size;
-        if(BOOST_UNLIKELY(uce_coordinate.y>size)) uce_coordinate.y = size;
-        if(BOOST_UNLIKELY(uce_coordinate.z>size)) uce_coordinate.z = size;
-        iterateOverCube<int>(lci_coordinate, uce_coordinate, adaptedCallback);
+        if(BOOST_UNLIKELY(uce_coordinate.x>size_i)) uce_coordinate.x = size_i;
+        if(BOOST_UNLIKELY(uce_coordinate.y>size_i)) uce_coordinate.y = size_i;
+        if(BOOST_UNLIKELY(uce_coordinate.z>size_i)) uce_coordinate.z = size_i;
+        for (int x = lci_coordinate.x; x < uce_coordinate.x; ++x) {
+          for (int y = lci_coordinate.y; y < uce_coordinate.y; ++y) {
+            size_t index = cellGeometry.getIndexFromCoordinateNoWrap(x, y, lci_coordinate.z);
+            for (int z = lci_coordinate.z; z < uce_coordinate.z; ++z, ++index)
+              callback(index);
+          }
+        }
       }
 
 
@@ -430,8 +521,7 @@ namespace grids {
         targetArray[i] = target->getIndexFromCoordinateNoWrap(coord / factor);
       }
 
-      // this sort seems to be the slowest step. In C++17 we can make it parallel... or is there a
-      // better overall algorithm?
+      // this sort is the slowest step, so it uses the parallel radix sort in tools::sort
       tools::sortAndEraseDuplicate(targetArray);
     }
 
@@ -544,6 +634,39 @@ namespace grids {
       return i < size3;
     }
 
+    /*! \brief Describes evaluation of a field on this grid as a single map onto the grid it is stored on.
+
+        See FlattenedGrid. On a grid that stores its own field, the map is the identity. Returns false if the grid
+        cannot be flattened, in which case evaluation has to go through each layer of the grid in turn.
+    */
+    virtual bool flatten(FlattenedGrid<T> &flat) const {
+      flat = FlattenedGrid<T>();
+      flat.size = size;
+      flat.target = this;
+      flat.targetSize = size;
+      flat.period = int(simEquivalentSize);
+      return true;
+    }
+
+    /*! \brief If the cells present are exactly those whose non-negative coordinates are all below some limit, and the
+        index of each is given directly by its coordinate, sets limit and returns true.
+
+        This allows containsCellWithCoordinate to be expressed as a clip when a section of this grid is flattened.
+    */
+    virtual bool getSimpleCoordinateBox(int &limit) const {
+      limit = int(size);
+      return true;
+    }
+
+    /*! \brief Returns the index arithmetic for the plain layout of cells on this grid, for use in hot loops.
+     *
+     * The geometry is a value type without virtual calls. Virtual grids that remap cell indices (e.g. CenteredGrid)
+     * override the methods below and do not follow it, so only use it where the plain layout is what is wanted.
+     */
+    GridGeometry<T> getGeometry() const {
+      return geometry;
+    }
+
     //! Returns the linear index of the point displaced from index by the co-ordinate vector step, wrapping around the *grid*
     size_t getIndexFromIndexAndStepWithWrap(size_t index, const Coordinate<int> &step) const {
       auto coord = getCoordinateFromIndex(index);
@@ -564,13 +687,7 @@ namespace grids {
      * Note that for efficiency this routine only "corrects" coordinates within one boxsize of the fundamental domain.
      */
     Coordinate<int> wrapCoordinate(Coordinate<int> coord) const {
-      if (coord.x > (signed) simEquivalentSize - 1) coord.x -= simEquivalentSize;
-      if (coord.y > (signed) simEquivalentSize - 1) coord.y -= simEquivalentSize;
-      if (coord.z > (signed) simEquivalentSize - 1) coord.z -= simEquivalentSize;
-      if (coord.x < 0) coord.x += simEquivalentSize;
-      if (coord.y < 0) coord.y += simEquivalentSize;
-      if (coord.z < 0) coord.z += simEquivalentSize;
-      return coord;
+      return geometry.wrapCoordinate(coord);
     }
 
     /*! \brief Wrap the coordinate such that it lies within [0,size) (i.e. within the grid).
@@ -578,13 +695,7 @@ namespace grids {
      * Note that for efficiency this routine only "corrects" coordinates within one gridsize of the fundamental domain.
      */
     Coordinate<int> wrapCoordinateAroundGrid(Coordinate<int> coord) const {
-      if (coord.x > (signed) size - 1) coord.x -= size;
-      if (coord.y > (signed) size - 1) coord.y -= size;
-      if (coord.z > (signed) size - 1) coord.z -= size;
-      if (coord.x < 0) coord.x += size;
-      if (coord.y < 0) coord.y += size;
-      if (coord.z < 0) coord.z += size;
-      return coord;
+      return geometry.wrapCoordinateAroundGrid(coord);
     }
 
 
@@ -608,7 +719,7 @@ namespace grids {
 
     //! Converts positive-integer co-ordinates to linear indices, assuming the co-ordinate lies within the box.
     virtual size_t getIndexFromCoordinateNoWrap(size_t x, size_t y, size_t z) const {
-      size_t index = (x * size + y) * size + z;
+      size_t index = geometry.getIndexFromCoordinateNoWrap(int(x), int(y), int(z));
       assert(this->containsCell(index));
       return index;
     }
@@ -620,7 +731,7 @@ namespace grids {
       if(x<0 || x>=size || y<0 || y>=size || z<0 || z>=size)
           throw std::runtime_error("Grid index out of range in getIndexNoWrap");
 #endif
-      auto index = size_t(x * size + y) * size + z;
+      auto index = geometry.getIndexFromCoordinateNoWrap(x, y, z);
       assert(this->containsCell(index));
       return index;
     }
@@ -632,21 +743,11 @@ namespace grids {
 
     //! Returns cell id in pixel coordinates
     virtual Coordinate<int> getCoordinateFromIndex(size_t id) const {
-      size_t x, y;
-
       if ((unsigned) id >= size3) {
         throw std::runtime_error("Index out of range");
       }
 
-      // The following implementation is a little faster than using the
-      // modulo operator.
-      x = id / size2;
-      id -= x * size2;
-      y = id / size;
-      id -= y * size;
-
-      auto coord = Coordinate<int>(int(x), int(y), int(id));
-      return coord;
+      return geometry.getCoordinateFromIndex(id);
     }
 
     /*! \brief Returns coordinate of centre of cell id, in physical box coordinates
@@ -660,10 +761,7 @@ namespace grids {
 
     //! Returns the comoving position in Mpc/h of the centre of the cell refered to by an integer co-ordinate.
     virtual Coordinate<T> getCentroidFromCoordinate(const Coordinate<int> &coord) const {
-      Coordinate<T> result(coord);
-      result *= cellSize;
-      result += offsetLower;
-      result += cellSize / 2;
+      Coordinate<T> result = geometry.getCentroidFromCoordinate(coord);
       assert(this->containsPoint(result));
       return result;
     }
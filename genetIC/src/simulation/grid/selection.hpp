@@ -0,0 +1,112 @@
+#ifndef IC_SELECTION_HPP
+#define IC_SELECTION_HPP
+
+#include <omp.h>
+#include <cmath>
+#include <typeinfo>
+#include <vector>
+#include "src/simulation/grid/grid.hpp"
+
+namespace grids {
+
+  /*! \brief Finds the cells along one axis of a grid whose centres lie within halfWidth of centre (periodically wrapped)
+
+      The centres are computed in exactly the same way as Grid::getCentroidFromCoordinate, and the offsets as
+      Grid::getWrappedOffset on wrappingGrid, so that the selection agrees bit-for-bit with a scan over every cell.
+      A small tolerance on halfWidth makes sure that rounding cannot exclude a cell that the predicate would accept.
+  */
+  template<typename T>
+  void getCandidatesAlongAxis(const Grid<T> &grid, const Grid<T> &wrappingGrid, T offsetLower, T centre,
+                              T halfWidth, std::vector<size_t> &coordinates, std::vector<T> &offsets) {
+    const T maxOffset = halfWidth * T(1 + 1e-6);
+    for (size_t c = 0; c < grid.size; ++c) {
+      T position = T(int(c)) * grid.cellSize + offsetLower + grid.cellSize / 2;
+      T offset = wrappingGrid.getWrappedOffset(position, centre);
+      if (std::abs(offset) <= maxOffset) {
+        coordinates.push_back(c);
+        offsets.push_back(offset);
+      }
+    }
+  }
+
+  /*! \brief Flags the cells of a grid whose wrapped offsets (dx, dy, dz) from a centre satisfy inclusionFunction
+
+      \param grid - grid on which to flag cells
+      \param wrappingGrid - grid defining the periodic wrapping of offsets (normally the base grid)
+      \param centre - centre of the region
+      \param halfExtent - half the size of a box around the centre outside which inclusionFunction is always false;
+                          may be infinite if no bound is known
+      \param inclusionFunction - callable taking (dx, dy, dz) and returning true for cells to flag
+
+      On an ordinary grid, only the cells inside the (wrapped) bounding box are visited: the candidate coordinates
+      are found separately along each axis, and rows of candidates are then tested in parallel. Virtual grids may
+      place their cells anywhere, so every cell is tested, again in parallel. Either way the flags are passed to the
+      grid as a single sorted list.
+  */
+  template<typename T, typename Predicate>
+  void flagCellsInRegion(Grid<T> &grid, const Grid<T> &wrappingGrid, const Coordinate<T> &centre,
+                         const Coordinate<T> &halfExtent, const Predicate &inclusionFunction) {
+    std::vector<std::vector<size_t>> selectedPerThread;
+
+    if (typeid(grid) == typeid(Grid<T>)) {
+      std::vector<size_t> xs, ys, zs;
+      std::vector<T> dxs, dys, dzs;
+      getCandidatesAlongAxis(grid, wrappingGrid, grid.offsetLower.x, centre.x, halfExtent.x, xs, dxs);
+      getCandidatesAlongAxis(grid, wrappingGrid, grid.offsetLower.y, centre.y, halfExtent.y, ys, dys);
+      getCandidatesAlongAxis(grid, wrappingGrid, grid.offsetLower.z, centre.z, halfExtent.z, zs, dzs);
+      const size_t nRows = xs.size() * ys.size();
+      const auto geometry = grid.getGeometry();
+
+#pragma omp parallel
+      {
+#pragma omp single
+        selectedPerThread.resize(omp_get_num_threads());
+        auto &selected = selectedPerThread[omp_get_thread_num()];
+
+        // a static schedule gives each thread a contiguous block of rows, in thread order, so the concatenated
+        // results are in ascending order
+#pragma omp for schedule(static)
+        for (size_t row = 0; row < nRows; ++row) {
+          size_t ix = row / ys.size();
+          size_t iy = row % ys.size();
+          size_t rowStart = geometry.getIndexFromCoordinateNoWrap(int(xs[ix]), int(ys[iy]), 0);
+          for (size_t iz = 0; iz < zs.size(); ++iz) {
+            if (inclusionFunction(dxs[ix], dys[iy], dzs[iz]))
+              selected.push_back(rowStart + zs[iz]);
+          }
+        }
+      }
+    } else {
+#pragma omp parallel
+      {
+#pragma omp single
+        selectedPerThread.resize(omp_get_num_threads());
+        auto &selected = selectedPerThread[omp_get_thread_num()];
+
+#pragma omp for schedule(static)
+        for (size_t i = 0; i < grid.size3; ++i) {
+          auto centroid = grid.getCentroidFromIndex(i);
+          if (inclusionFunction(wrappingGrid.getWrappedOffset(centroid.x, centre.x),
+                                wrappingGrid.getWrappedOffset(centroid.y, centre.y),
+                                wrappingGrid.getWrappedOffset(centroid.z, centre.z)))
+            selected.push_back(i);
+        }
+      }
+    }
+
+    std::vector<size_t> selected;
+    size_t total = 0;
+    for (const auto &s : selectedPerThread)
+      total += s.size();
+    selected.reserve(total);
+    for (auto &s : selectedPerThread) {
+      selected.insert(selected.end(), s.begin(), s.end());
+      std::vector<size_t>().swap(s);
+    }
+
+    grid.flagSortedCells(std::move(selected));
+  }
+
+}
+
+#endif
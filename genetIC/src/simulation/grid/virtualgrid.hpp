@@ -96,6 +96,11 @@ namespace grids {
       pUnderlying->flagCells(sourceArray);
     }
 
+    //! Flags the specified cells, via flagCells, so that they reach the underlying grid.
+    void flagSortedCells(std::vector<size_t> &&sortedCells) override {
+      this->flagCells(sortedCells);
+    }
+
     virtual //! Unflag all flagged cells in the underlying grid.
     void unflagAllCells() override {
       pUnderlying->unflagAllCells();
@@ -113,6 +118,27 @@ namespace grids {
       return pUnderlying;
     }
 
+    //! A virtual grid can only be flattened if it describes how; see the overrides in derived classes
+    bool flatten(FlattenedGrid<T> &) const override {
+      return false;
+    }
+
+    //! A virtual grid only has a simple coordinate box if it describes it; see the overrides in derived classes
+    bool getSimpleCoordinateBox(int &) const override {
+      return false;
+    }
+
+  protected:
+    //! Flattens a grid on which fields are evaluated exactly as on the underlying grid, cell for cell
+    bool flattenAsUnderlying(FlattenedGrid<T> &flat) const {
+      return this->pUnderlying->flatten(flat) && flat.size == this->size;
+    }
+
+    //! Finds the coordinate box of a grid whose cells have the same coordinates and indices as on the underlying grid
+    bool getSimpleCoordinateBoxAsUnderlying(int &limit) const {
+      return this->pUnderlying->size == this->size && this->pUnderlying->getSimpleCoordinateBox(limit);
+    }
+
 
   };
 
@@ -205,6 +231,28 @@ namespace grids {
       return this->containsCellWithCoordinate(coord);
     }
 
+    //! Flattens onto this grid, with values interpolated from the underlying grid
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      int underlyingLimit;
+      if (!this->pUnderlying->getSimpleCoordinateBox(underlyingLimit))
+        return false;
+      Grid<T>::flatten(flat);
+      flat.targetLimit = underlyingLimit * factor;
+      flat.resampling = Resampling::superSample;
+      flat.source = this->pUnderlying.get();
+      flat.factor = factor;
+      flat.sourceSize = this->pUnderlying->size;
+      flat.sourceLimit = underlyingLimit;
+      return true;
+    }
+
+    bool getSimpleCoordinateBox(int &limit) const override {
+      if (!this->pUnderlying->getSimpleCoordinateBox(limit))
+        return false;
+      limit *= factor;
+      return true;
+    }
+
   };
 
   /*! \brief Virtual grid with two underlying grids - one high resolution, and one low resolution
@@ -479,6 +527,27 @@ namespace grids {
       return containsCellWithCoordinate(coord);
     }
 
+    //! Flattens the underlying grid, then shifts the map by the offset of this section and clips it to the underlying grid
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      int underlyingLimit;
+      if (!this->pUnderlying->getSimpleCoordinateBox(underlyingLimit) || !this->pUnderlying->flatten(flat))
+        return false;
+      if (!flat.clips.empty() || flat.period <= 0 || flat.period != int(this->simEquivalentSize))
+        return false;
+
+      auto wrappedOffset = flat.wrap(cellOffset);
+      flat.size = this->size;
+      flat.offset = flat.wrap(flat.offset + wrappedOffset);
+      flat.clips.push_back({wrappedOffset, underlyingLimit});
+      flat.targetLimit = INT_MAX;
+      return true;
+    }
+
+    //! Cells outside the underlying grid are missing, so the cells present do not form a simple box
+    bool getSimpleCoordinateBox(int &) const override {
+      return false;
+    }
+
 
     //! Outputs debug information
     void debugName(std::ostream &s) const override {
@@ -643,6 +712,28 @@ namespace grids {
       return this->containsCellWithCoordinate(coord);
     }
 
+    //! Flattens onto this grid, with values averaged over the underlying grid as in forEachSubcell
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      int underlyingLimit;
+      if (!this->pUnderlying->getSimpleCoordinateBox(underlyingLimit))
+        return false;
+      Grid<T>::flatten(flat);
+      flat.targetLimit = (underlyingLimit + factor - 1) / factor;
+      flat.resampling = Resampling::subSample;
+      flat.source = this->pUnderlying.get();
+      flat.factor = factor;
+      flat.sourceSize = this->pUnderlying->size;
+      flat.sourceLimit = std::min(underlyingLimit, int(this->pUnderlying->size));
+      return true;
+    }
+
+    bool getSimpleCoordinateBox(int &limit) const override {
+      if (!this->pUnderlying->getSimpleCoordinateBox(limit))
+        return false;
+      limit = (limit + factor - 1) / factor;
+      return true;
+    }
+
 
   };
 
@@ -676,6 +767,16 @@ namespace grids {
     void debugName(std::ostream &s) const override {
       s << "MassScaledGrid";
     }
+
+    //! Only the mass differs from the underlying grid, so fields are evaluated there cell for cell
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      return this->flattenAsUnderlying(flat);
+    }
+
+    //! Cells have the same coordinates and indices as on the underlying grid
+    bool getSimpleCoordinateBox(int &limit) const override {
+      return this->getSimpleCoordinateBoxAsUnderlying(limit);
+    }
   };
 
   //! Wrap a grid such that its center is a given point.
@@ -796,6 +897,17 @@ namespace grids {
     void getFlaggedCells(std::vector<size_t> &targetArray) const override {
       this->pUnderlying->getFlaggedCells(targetArray);
     }
+
+  public:
+    //! Cells are indexed as on the underlying grid rather than by their centred coordinates
+    bool getSimpleCoordinateBox(int &) const override {
+      return false;
+    }
+
+    //! Cells keep their indices on the underlying grid, so fields are evaluated there cell for cell
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      return this->flattenAsUnderlying(flat);
+    }
   };
 
   //! Offsets the corner of a grid in the cordinate of the box
@@ -831,6 +943,16 @@ namespace grids {
     void debugName(std::ostream &s) const override {
       s << "OffsetGrid";
     }
+
+    //! Only the centroids are moved, so fields are evaluated on the underlying grid cell for cell
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      return this->flattenAsUnderlying(flat);
+    }
+
+    //! Cells have the same coordinates and indices as on the underlying grid
+    bool getSimpleCoordinateBox(int &limit) const override {
+      return this->getSimpleCoordinateBoxAsUnderlying(limit);
+    }
   };
 
   //! Wraps any VirtualGrid but allows it to have its own cell flags (independent of the original underlying grid)
@@ -885,6 +1007,16 @@ namespace grids {
     virtual GridPtrType makeSubsampled(size_t ratio) const override {
       return std::make_shared<IndependentFlaggingGrid<T>>(this->pUnderlying->makeSubsampled(ratio));
     }
+
+    //! Only the flags are independent, so fields are evaluated on the underlying grid cell for cell
+    bool flatten(FlattenedGrid<T> &flat) const override {
+      return this->flattenAsUnderlying(flat);
+    }
+
+    //! Cells have the same coordinates and indices as on the underlying grid
+    bool getSimpleCoordinateBox(int &limit) const override {
+      return this->getSimpleCoordinateBoxAsUnderlying(limit);
+    }
   };
 
 
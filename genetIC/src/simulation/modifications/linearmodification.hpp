@@ -220,12 +220,14 @@ namespace modifications {
         // Coeffs for the finite difference.  The signs here so that result is - Nabla Phi
         T a = -w / 12. / grid.cellSize, b = w * 2. / 3. / grid.cellSize;
 
+        const auto geometry = grid.getGeometry();
+
         for (size_t i = 0; i < this->flaggedCellsFinestGrid.size(); i++) {
           size_t index = this->flaggedCellsFinestGrid[i];
-          ind_m1 = grid.getIndexFromIndexAndStep(index, negDirectionVector);
-          ind_p1 = grid.getIndexFromIndexAndStep(index, directionVector);
-          ind_m2 = grid.getIndexFromIndexAndStep(ind_m1, negDirectionVector);
-          ind_p2 = grid.getIndexFromIndexAndStep(ind_p1, directionVector);
+          ind_m1 = geometry.getIndexFromIndexAndStep(index, negDirectionVector);
+          ind_p1 = geometry.getIndexFromIndexAndStep(index, directionVector);
+          ind_m2 = geometry.getIndexFromIndexAndStep(ind_m1, negDirectionVector);
+          ind_p2 = geometry.getIndexFromIndexAndStep(ind_p1, directionVector);
           outputData[ind_m2] += a;
           outputData[ind_m1] += b;
           outputData[ind_p1] -= b;
@@ -342,9 +344,11 @@ namespace modifications {
       fields::Field<DataType, T> outputField = fields::Field<DataType, T>(grid, false);
       std::vector<DataType> &outputData = outputField.getDataVector();
 
+      const auto geometry = grid.getGeometry();
+
       for (size_t i = 0; i < this->flaggedCellsFinestGrid.size(); ++i) {
         size_t index = this->flaggedCellsFinestGrid[i];
-        Coordinate<T> q = grid.getCentroidFromIndex(index);
+        Coordinate<T> q = geometry.getCentroidFromIndex(index);
 
         Coordinate<T> deltaq = grid.getWrappedOffset(qcenter, q);
 
@@ -365,10 +369,10 @@ namespace modifications {
             directionVector[dir] = 1;
             negDirectionVector[dir] = -1;
 
-            ind_m1 = grid.getIndexFromIndexAndStep(index, negDirectionVector);
-            ind_m2 = grid.getIndexFromIndexAndStep(ind_m1, negDirectionVector);
-            ind_p1 = grid.getIndexFromIndexAndStep(index, directionVector);
-            ind_p2 = grid.getIndexFromIndexAndStep(ind_p1, directionVector);
+            ind_m1 = geometry.getIndexFromIndexAndStep(index, negDirectionVector);
+            ind_m2 = geometry.getIndexFromIndexAndStep(ind_m1, negDirectionVector);
+            ind_p1 = geometry.getIndexFromIndexAndStep(index, directionVector);
+            ind_p2 = geometry.getIndexFromIndexAndStep(ind_p1, directionVector);
             outputData[ind_m2] += qCrossCoeff[dir] * a;
             outputData[ind_m1] += qCrossCoeff[dir] * b;
             outputData[ind_p1] -= qCrossCoeff[dir] * b;
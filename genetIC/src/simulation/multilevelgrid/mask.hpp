@@ -12,7 +12,8 @@ namespace multilevelgrid {
 
     //! Constructor from the specified multi-level context.
     explicit AbstractBaseMask(MultiLevelGrid <DataType> *multilevelgrid_) :
-      multilevelgrid(multilevelgrid_), flaggedIdsAtEachLevel(multilevelgrid->getNumLevels()) {}
+      multilevelgrid(multilevelgrid_), flaggedIdsAtEachLevel(multilevelgrid->getNumLevels()),
+      flagBitmapAtEachLevel(multilevelgrid->getNumLevels()) {}
 
     /*! \brief Returns 1 if the specified cell is in the mask, 0 otherwise.
 
@@ -30,6 +31,7 @@ namespace multilevelgrid {
   protected:
     MultiLevelGrid <DataType> *multilevelgrid; //!< Pointer to the multi-level context object.
     std::vector<std::vector<size_t>> flaggedIdsAtEachLevel; //!< Vector whose elements are vectors of the ids flagged at each level of the mask.
+    std::vector<std::vector<char>> flagBitmapAtEachLevel; //!< One entry per cell for each level, non-zero where the cell is flagged.
 
     //! Calculates the flagged cells on all levels.
     virtual void generateFlagsHierarchy() = 0;
@@ -90,29 +92,29 @@ namespace multilevelgrid {
 
 
   protected:
-    //! Information in the input mask needs to be matched to a full Grafic hierarchy, potentially with virtual intermediate levels.
+    /*! \brief Information in the input mask needs to be matched to a full Grafic hierarchy, potentially with virtual intermediate levels.
+
+        Each (sorted) input mask belongs to the first remaining level on which any of its cell ids exists, i.e. the
+        first level with more cells than its smallest id.
+     */
     void identifyLevelsOfInputMask() {
       size_t input_level = 0;
 
       for (size_t level = 0; level < this->multilevelgrid->getNumLevels() - 1; level++) {
-        for (size_t i = 0; i < this->multilevelgrid->getGridForLevel(level).size3; i++) {
-
-          // Terminate calculation if all possible input masks have been found
-          if (input_level >= this->inputzoomParticlesAsMask.size()) {
-            return;
-          }
 
-          // As soon as one cell id matches, we have identified the level, so assign it.
-          if (this->isPartofInputMask(i, input_level)) {
+        // Terminate calculation if all possible input masks have been found
+        if (input_level >= this->inputzoomParticlesAsMask.size()) {
+          return;
+        }
 
-            assert(input_level < this->inputzoomParticlesAsMask.size());
-            assert(int(level)>= this->deepestLevelWithMaskedCells);
+        const auto &inputMask = this->inputzoomParticlesAsMask[input_level];
+        if (!inputMask.empty() && inputMask.front() < this->multilevelgrid->getGridForLevel(level).size3) {
+          assert(int(level) >= this->deepestLevelWithMaskedCells);
 
-            this->flaggedIdsAtEachLevel[level] = this->inputzoomParticlesAsMask[input_level];
-            this->deepestLevelWithMaskedCells = int(level);
-            input_level++;
-            break;
-          }
+          this->flaggedIdsAtEachLevel[level] = inputMask;
+          updateBitmap(level);
+          this->deepestLevelWithMaskedCells = int(level);
+          input_level++;
         }
       }
     }
@@ -134,58 +136,76 @@ namespace multilevelgrid {
       generateHierarchyBelowLevelExclusive(this->deepestLevelWithMaskedCells);
     }
 
-    //! Flags cells for the grafic mask at all levels above (coarser than) the selected deepest level.
+    /*! \brief Flags cells for the grafic mask at all levels above (coarser than) the selected deepest level.
+
+        Flags on levels that have none are projected up from the level below, in parallel, into a bitmap, which is
+        then read off in order to give the sorted list of flags.
+     */
     void generateHierarchyAboveLevelInclusive(int deepestLevel) {
       for (int level = deepestLevel; level >= 0; level--) {
 
         if (this->flaggedIdsAtEachLevel[level].size() == 0) {
           // Generate flags on intermediate levels that will not have some
-          for (size_t i : this->flaggedIdsAtEachLevel[level + 1]) {
-            this->flaggedIdsAtEachLevel[level].push_back(
-              this->multilevelgrid->getIndexOfCellOnOtherLevel(level + 1, level, i));
+          const auto &finerFlags = this->flaggedIdsAtEachLevel[level + 1];
+          auto &bitmap = this->flagBitmapAtEachLevel[level];
+          bitmap.assign(this->multilevelgrid->getGridForLevel(level).size3, 0);
+
+#pragma omp parallel for schedule(static)
+          for (size_t k = 0; k < finerFlags.size(); ++k) {
+            size_t id = this->multilevelgrid->getIndexOfCellOnOtherLevel(level + 1, level, finerFlags[k]);
+            // several fine cells share each coarse cell
+#pragma omp atomic write
+            bitmap[id] = 1;
           }
-          // The above procedure might not be ordered and will create duplicates, get rid of them.
-          sortAndEraseDuplicate(level);
+
+          tools::appendSelectedIndices(bitmap, 0, this->flaggedIdsAtEachLevel[level]);
         }
       }
     }
 
-    //! Flags cells for the grafic mask at all levels below (finer than) the selected level).
+    /*! \brief Flags cells for the grafic mask at all levels below (finer than) the selected level).
+
+        Each cell looks up the cell containing it on the level above in that level's bitmap, in parallel.
+     */
     void generateHierarchyBelowLevelExclusive(size_t coarsestLevel) {
 
       // Do all level between this level and the finest
       for (size_t level = coarsestLevel + 1; level < this->multilevelgrid->getNumLevels() - 1; level++) {
 
-        for (size_t i = 0; i < this->multilevelgrid->getGridForLevel(level).size3; i++) {
+        const auto &bitmapAbove = this->flagBitmapAtEachLevel[level - 1];
+        auto &bitmap = this->flagBitmapAtEachLevel[level];
+        bitmap.resize(this->multilevelgrid->getGridForLevel(level).size3);
+
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < bitmap.size(); i++) {
           size_t aboveindex = this->multilevelgrid->getIndexOfCellOnOtherLevel(level, level - 1, i);
-          if (this->isMasked(aboveindex, level - 1)) {
-            this->flaggedIdsAtEachLevel[level].push_back(i);
-          }
+          bitmap[i] = bitmapAbove[aboveindex];
         }
+
+        tools::appendSelectedIndices(bitmap, 0, this->flaggedIdsAtEachLevel[level]);
       }
     }
 
-    //! Sorts the flags on the specified level and erases any duplicates.
-    void sortAndEraseDuplicate(size_t level) {
-      tools::sortAndEraseDuplicate(this->flaggedIdsAtEachLevel[level]);
+    //! Sets the bitmap of the specified level from its (sorted) list of flags
+    void updateBitmap(size_t level) {
+      const auto &flags = this->flaggedIdsAtEachLevel[level];
+      auto &bitmap = this->flagBitmapAtEachLevel[level];
+      bitmap.assign(this->multilevelgrid->getGridForLevel(level).size3, 0);
+
+#pragma omp parallel for schedule(static)
+      for (size_t k = 0; k < flags.size(); ++k) {
+        // skipping repeated ids means that no two threads write to the same cell
+        if (flags[k] < bitmap.size() && (k == 0 || flags[k] != flags[k - 1]))
+          bitmap[flags[k]] = 1;
+      }
     }
 
     /*! \brief Returns true if the cell at the specified level is flagged for inclusion in the mask
         \param id - cell id to check
         \param level - level the id corresponds to
     */
-    bool isMasked(size_t id, size_t level) {
-      return std::binary_search(this->flaggedIdsAtEachLevel[level].begin(),
-                                this->flaggedIdsAtEachLevel[level].end(), id);
-    }
-
-    /*! \brief Checks whether the cell at the specified level is in the mask
-        \param id - cell id to check
-        \param level - level the id corresponds to
-    */
-    bool isPartofInputMask(size_t id, size_t level) {
-      return std::binary_search(this->inputzoomParticlesAsMask[level].begin(),
-                                this->inputzoomParticlesAsMask[level].end(), id);
+    bool isMasked(size_t id, size_t level) const {
+      return this->flagBitmapAtEachLevel[level][id] != 0;
     }
 
   public:
@@ -205,18 +225,21 @@ namespace multilevelgrid {
 
       // Field with mask information
       for (size_t level = 0; level < this->multilevelgrid->getNumLevels(); ++level) {
-        for (size_t i_z = 0; i_z < this->multilevelgrid->getGridForLevel(level).size; ++i_z) {
-          for (size_t i_y = 0; i_y < this->multilevelgrid->getGridForLevel(level).size; ++i_y) {
-            for (size_t i_x = 0; i_x < this->multilevelgrid->getGridForLevel(level).size; ++i_x) {
+        const auto &grid = this->multilevelgrid->getGridForLevel(level);
+        auto &data = maskfield->getFieldForLevel(level).getDataVector();
+        const size_t size = grid.size;
+
+#pragma omp parallel for schedule(static)
+        for (size_t i_x = 0; i_x < size; ++i_x) {
+          for (size_t i_y = 0; i_y < size; ++i_y) {
+            for (size_t i_z = 0; i_z < size; ++i_z) {
 
               // These two indices can be different if some virtual grid are used in the context, e.g. centered.
               // In all other cases, they will be equal.
-              size_t i = size_t(i_x * this->multilevelgrid->getGridForLevel(level).size + i_y)
-                         * this->multilevelgrid->getGridForLevel(level).size + i_z;
-              size_t virtual_i = this->multilevelgrid->getGridForLevel(level).getIndexFromCoordinateNoWrap(i_x, i_y,
-                                                                                                              i_z);
+              size_t i = size_t(i_x * size + i_y) * size + i_z;
+              size_t virtual_i = grid.getIndexFromCoordinateNoWrap(i_x, i_y, i_z);
 
-              maskfield->getFieldForLevel(level).getDataVector()[i] = isInMask(level, virtual_i);
+              data[i] = isInMask(level, virtual_i);
 
             }
           }
@@ -9,7 +9,9 @@
 #include <memory>
 
 #include "src/simulation/grid/grid.hpp"
+#include "src/simulation/filters/tabulated.hpp"
 #include "src/tools/signaling.hpp"
+#include "src/tools/scheduler.hpp"
 #include "src/simulation/particles/species.hpp"
 
 namespace fields {
@@ -59,6 +61,9 @@ namespace multilevelgrid {
 
     bool levelsAreCombined = false; //!< Set to true after low-frequency information is propagated into high-resolution fields
 
+    //! Filters used to project fields between levels, tabulated once for each distinct filter (see getTabulatedFilter)
+    mutable std::vector<std::shared_ptr<const filters::TabulatedFilter<T>>> tabulatedFilters;
+
   public:
     size_t nTransferFunctions = 1; //!< Keeps track of the number of transfer functions currently being used by the code.
     bool allowStrays = false; //!< If true, return output grids that cover the whole simulation box even in the zoom regions
@@ -147,9 +152,39 @@ namespace multilevelgrid {
       Ntot = 0;
       nLevels = 0;
       levelsAreCombined = false;
+      tabulatedFilters.clear();
       this->changed();
     }
 
+    /*! \brief Returns a tabulated version of the specified filter, shared with all previous requests for the same filter
+
+        Used for the filters that project fields between (and within) levels, so that repeated applications of the
+        metric (e.g. in every chi^2 and modification) only evaluate each filter once per grid. Filters are matched
+        with Filter::isEquivalentTo; one that cannot vouch for its own equivalence gets a fresh tabulation each time.
+    */
+    std::shared_ptr<const filters::TabulatedFilter<T>> getTabulatedFilter(const filters::Filter<T> &filter) const {
+      // compare in the form the tabulation stores, since cloning may simplify the filter (see ProductFilter::clone)
+      auto pFilter = filter.clone();
+      if (!pFilter->isEquivalentTo(*pFilter))
+        return std::make_shared<filters::TabulatedFilter<T>>(*pFilter);
+
+      std::shared_ptr<const filters::TabulatedFilter<T>> result;
+#pragma omp critical(tabulatedFilters)
+      {
+        for (const auto &cached : tabulatedFilters) {
+          if (cached->getUnderlying().isEquivalentTo(*pFilter)) {
+            result = cached;
+            break;
+          }
+        }
+        if (!result) {
+          result = std::make_shared<filters::TabulatedFilter<T>>(*pFilter);
+          tabulatedFilters.push_back(result);
+        }
+      }
+      return result;
+    }
+
 
     //! Returns the total number of cells in the multi-level context
     size_t getNumCells() const {
@@ -265,7 +300,7 @@ namespace multilevelgrid {
 
         for (int level = levelmax - 1; level >= 0; --level) {
 
-          fields::Field<DataType, T> & hires = *fieldsOnLevels[level + 1];
+          const fields::Field<DataType, T> & hires = *fieldsOnLevels[level + 1];
           fields::Field<DataType, T> & lores = *fieldsOnLevels[level];
 
           int pixel_size_ratio = tools::getRatioAndAssertInteger(fieldsOnLevels[level]->getGrid().cellSize,
@@ -286,6 +321,9 @@ namespace multilevelgrid {
           // that threads are always working on regions at least 4 lores cells apart...
           size_t hiresGridSize = hires.getGrid().size;
           size_t hiresParallelisationSeparation = 4 * pixel_size_ratio;
+#ifdef BRICKED_REAL_SPACE
+          lores.toBricked();
+#endif
           for(int xoffset=0; xoffset < hiresParallelisationSeparation; xoffset++) {
 #pragma omp parallel for default(none) shared(hires, lores, pixel_volume_ratio, xoffset, hiresGridSize, hiresParallelisationSeparation)
             for(int x=xoffset; x<hiresGridSize; x+=hiresParallelisationSeparation) {
@@ -299,6 +337,9 @@ namespace multilevelgrid {
               }
             }
           }
+#ifdef BRICKED_REAL_SPACE
+          lores.toRowMajor();
+#endif
 
 
 
@@ -334,6 +375,22 @@ namespace multilevelgrid {
       }
     }
 
+    /*! \brief Applies the specified independent operation to each level, running the levels concurrently
+
+        Threads are shared between levels in proportion to the cost of a Fourier transform on each (see
+        tools::forEachTaskConcurrently). The operation must not touch state shared between levels, such as the
+        covariance cache.
+        \param levelCallback - function taking the index of the level to operate on
+    */
+    void forEachLevelConcurrently(const std::function<void(size_t)> &levelCallback) const {
+      std::vector<double> costs;
+      for (size_t level = 0; level < nLevels; level++) {
+        double nCells = double(pGrids[level]->size3);
+        costs.push_back(nCells * std::log2(nCells + 1));
+      }
+      tools::forEachTaskConcurrently(costs, levelCallback);
+    }
+
 
     void copyContextWithIntermediateResolutionGrids(MultiLevelGrid<DataType> &newStack,
                                                     size_t resolution_step_factor = 2,
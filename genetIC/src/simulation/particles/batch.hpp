@@ -0,0 +1,110 @@
+#ifndef IC_BATCH_HPP
+#define IC_BATCH_HPP
+
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include "src/simulation/coordinate.hpp"
+#include "src/simulation/particles/mapper/mapperiterator.hpp"
+
+namespace particle {
+
+  /*! \class ParticleBatch
+      \brief Structure-of-arrays storage for the properties of a run of consecutive particles from a mapper.
+
+      Output writers fill a batch once for each run of particles and then copy whichever properties they need into
+      their own layout. Each particle is therefore generated (i.e. its offset fields are interpolated) only once,
+      however many separate blocks the output format spreads its properties across.
+  */
+  template<typename T>
+  class ParticleBatch {
+  public:
+    std::vector<Coordinate<T>> pos; //!< Positions, wrapped into the simulation box
+    std::vector<Coordinate<T>> vel; //!< Velocities
+    std::vector<T> mass; //!< Masses
+    std::vector<T> soft; //!< Cell softening scales
+    std::vector<T> smoothing; //!< SPH smoothing scale estimates
+    std::vector<size_t> id; //!< Index of each particle in the mapper that the iterator belongs to
+
+    //! Number of particles evaluated at a time when streaming through a block with iterateInBatches
+    static constexpr size_t defaultSize = 16384;
+
+    //! Returns the number of particles in the batch
+    size_t size() const {
+      return id.size();
+    }
+
+    //! Resizes all the property arrays to hold n particles
+    void resize(size_t n) {
+      pos.resize(n);
+      vel.resize(n);
+      mass.resize(n);
+      soft.resize(n);
+      smoothing.resize(n);
+      id.resize(n);
+    }
+
+    /*! \brief Evaluate n particles into the batch, starting from the given iterator and position in the batch.
+     *
+     * Runs of particles on consecutive cells of the same grid are evaluated together with
+     * ParticleEvaluator::evaluateRange. The iterator is left pointing at the last particle evaluated, following the
+     * convention of MapperIterator::parallelIterateBlocks that an iterator is never stepped beyond its block.
+     */
+    template<typename GridDataType>
+    void fill(mapper::MapperIterator<GridDataType> &iterator, size_t n, size_t offset = 0) {
+      assert(offset + n <= size());
+      size_t end = offset + n;
+      size_t k = offset;
+      while (k < end) {
+        size_t run = iterator.getNumConsecutiveCells(end - k);
+        auto evaluatorAndIndex = iterator.getParticleEvaluatorAndIndex();
+        const auto &evaluator = *evaluatorAndIndex.first;
+
+        evaluator.evaluateRange(evaluatorAndIndex.second, run, &pos[k], &vel[k]);
+
+        T runMass = evaluator.getMass();
+        T runSoft = evaluator.getEps();
+        T runSmoothing = evaluator.getSmoothingScale();
+
+        for (size_t j = 0; j < run; ++j, ++k) {
+          mass[k] = runMass;
+          soft[k] = runSoft;
+          smoothing[k] = runSmoothing;
+          id[k] = iterator.getIndex();
+          if (k + 1 < end) ++iterator;
+        }
+      }
+    }
+
+    //! Evaluate n particles from the iterator into a batch of exactly that size, in parallel. The iterator is advanced past them.
+    template<typename GridDataType>
+    void fillInParallel(mapper::MapperIterator<GridDataType> &begin, size_t n) {
+      resize(n);
+      begin.parallelIterateBlocks([this](size_t blockStart, size_t blockLength,
+                                         mapper::MapperIterator<GridDataType> &localIterator) {
+        fill(localIterator, blockLength, blockStart);
+      }, n);
+    }
+
+    /*! \brief Evaluate n particles from the iterator in successive batches of at most defaultSize particles.
+     *
+     * The callback receives the offset of each batch's first particle relative to the starting iterator, and the
+     * batch itself. As with fill, the iterator is never stepped beyond the last of the n particles.
+     */
+    template<typename GridDataType>
+    static void iterateInBatches(mapper::MapperIterator<GridDataType> &iterator, size_t n,
+                                 const std::function<void(size_t, const ParticleBatch<T> &)> &callback) {
+      ParticleBatch<T> batch;
+      for (size_t batchStart = 0; batchStart < n; batchStart += defaultSize) {
+        size_t batchLength = std::min(defaultSize, n - batchStart);
+        if (batchStart > 0) ++iterator;
+        batch.resize(batchLength);
+        batch.fill(iterator, batchLength);
+        callback(batchStart, batch);
+      }
+    }
+  };
+
+}
+
+#endif
@@ -51,6 +51,26 @@ namespace particle {
       particle.pos = grid.wrapPoint(particle.pos);
       return particle;
     }
+
+    /*! \brief Evaluates the positions (without wrapping) and velocities of n particles on consecutive cells.
+     *
+     * The results are written into separate position and velocity arrays. The default implementation calls
+     * getParticleNoWrap for each cell; derived classes override it to evaluate whole ranges at once.
+     */
+    virtual void evaluateRangeNoWrap(size_t firstCell, size_t n, Coordinate<T> *pos, Coordinate<T> *vel) const {
+      for (size_t k = 0; k < n; ++k) {
+        Particle<T> particle = getParticleNoWrap(firstCell + k);
+        pos[k] = particle.pos;
+        vel[k] = particle.vel;
+      }
+    }
+
+    //! Evaluates the positions and velocities of n particles on consecutive cells, as getParticle would for each
+    void evaluateRange(size_t firstCell, size_t n, Coordinate<T> *pos, Coordinate<T> *vel) const {
+      evaluateRangeNoWrap(firstCell, n, pos, vel);
+      for (size_t k = 0; k < n; ++k)
+        pos[k] = grid.wrapPoint(pos[k]);
+    }
   };
 
 
@@ -37,6 +37,8 @@ namespace particle {
       bool gasFirst; //!< If true, baryons are assigned using the first mapper in the pair, and if false, using the second.
       size_t nFirst; //!< Number of particles in the first mapper.
       size_t nSecond; //!< Number of particles in the second mapper.
+      mutable std::shared_ptr<const ParticleSegmentIndex<T>> pFirstSegmentIndex; //!< First mapper's index from which pSegmentIndex was built
+      mutable std::shared_ptr<const ParticleSegmentIndex<T>> pSecondSegmentIndex; //!< Second mapper's index from which pSegmentIndex was built
 
       MapPtrType getGasMap() const {
         return gasFirst?firstMap:secondMap;
@@ -67,6 +69,24 @@ namespace particle {
           return **(pIterator->subIterators[0]);
       }
 
+      //! The segments of the first mapper, followed by those of the second
+      bool appendSegments(ParticleSegmentIndex<T> &index) const override {
+        auto pFirstIndex = firstMap->getSegmentIndex();
+        auto pSecondIndex = secondMap->getSegmentIndex();
+        if (pFirstIndex == nullptr || pSecondIndex == nullptr)
+          return false;
+        index.appendAll(*pFirstIndex);
+        index.appendAll(*pSecondIndex);
+        pFirstSegmentIndex = pFirstIndex;
+        pSecondSegmentIndex = pSecondIndex;
+        return true;
+      }
+
+      //! The cached index is out of date if either mapper's index has been rebuilt since
+      bool segmentIndexIsCurrent() const override {
+        return firstMap->getSegmentIndex() == pFirstSegmentIndex && secondMap->getSegmentIndex() == pSecondSegmentIndex;
+      }
+
 
     public:
 
@@ -7,6 +7,8 @@
 
 #endif
 
+#include <map>
+#include <limits>
 #include <src/simulation/particles/particle.hpp>
 #include "src/simulation/grid/grid.hpp"
 #include "src/tools/util_functions.hpp"
@@ -76,6 +78,22 @@ namespace particle {
           incrementIterator(pIterator);
       }
 
+      mutable std::shared_ptr<const ParticleSegmentIndex<T>> pSegmentIndex; //!< Flat index of the particles, built on demand by getSegmentIndex
+
+      /*! \brief Append the segments describing this mapper's particles, in order, to the specified index
+          \returns false if the mapper cannot be described by segments (implemented only by derived classes)
+      */
+      virtual bool appendSegments(ParticleSegmentIndex<T> & /*index*/) const {
+        return false;
+      }
+
+      /*! \brief Returns false if the cached segment index is out of date, e.g. because a child mapper has changed
+          since it was built (implemented only by derived classes)
+      */
+      virtual bool segmentIndexIsCurrent() const {
+        return true;
+      }
+
       //! Decrement the specified iterator by the specified number of steps. Only implemented by derived mapper classes.
       virtual void decrementIteratorBy(iterator *, size_t) const {
         throw std::runtime_error("Attempting to reverse in a mapper that does not support random access");
@@ -137,6 +155,22 @@ namespace particle {
       }
 
 
+      /*! \brief Returns a flat index of the particles in this mapper, or nullptr if it cannot be described that way.
+       *
+       * The index is built on first use and then cached, until the mapper or any of its children change. Building
+       * is not thread-safe, so the first call should be made outside any parallel region.
+       */
+      std::shared_ptr<const ParticleSegmentIndex<T>> getSegmentIndex() const {
+        if (pSegmentIndex == nullptr || !segmentIndexIsCurrent()) {
+          auto pNewIndex = std::make_shared<ParticleSegmentIndex<T>>();
+          if (!appendSegments(*pNewIndex))
+            return nullptr;
+          assert(pNewIndex->size() == size());
+          pSegmentIndex = pNewIndex;
+        }
+        return pSegmentIndex;
+      }
+
       //! Returns the total number of particles mapped to be the mapper
       virtual size_t size() const {
         return 0;
@@ -264,11 +298,55 @@ namespace particle {
         const std::function<void(const iterator &)> &callback) const {
         auto begin = beginParticleType(generator, particle_type);
         auto end = endParticleType(generator, particle_type);
+        begin.flatten();
         for (auto i = begin; i != end; ++i) {
           callback(i);
         }
       }
 
+      /*! \brief Count the particles and find their mass range and total mass, without visiting every particle.
+
+          All particles in a segment of the segment index share a grid, and therefore a mass, so the statistics
+          follow from one mass evaluation per segment.
+
+          \param generator - generator used to create particles.
+          \param minMass, maxMass, totalMass, num - set to the statistics of the selected particles.
+          \param particle_type - gadget type of the particles to include, or -1 to include all particles.
+          \returns false if the mapper has no segment index, in which case the outputs are left unchanged.
+      */
+      bool getParticleMassStatistics(
+        const particle::AbstractMultiLevelParticleGenerator<GridDataType> &generator,
+        T &minMass, T &maxMass, T &totalMass, size_t &num, int particle_type = -1) const {
+        auto pIndex = getSegmentIndex();
+        if (pIndex == nullptr)
+          return false;
+
+        std::map<const grids::Grid<T> *, T> massPerGrid;
+
+        minMass = std::numeric_limits<T>::max();
+        maxMass = 0;
+        totalMass = 0;
+        num = 0;
+
+        for (size_t s = 0; s < pIndex->getNumSegments(); ++s) {
+          const auto &seg = pIndex->getSegment(s);
+          if (particle_type >= 0 && seg.gadgetType != static_cast<unsigned int>(particle_type))
+            continue;
+
+          auto massIt = massPerGrid.find(seg.pGrid.get());
+          if (massIt == massPerGrid.end())
+            massIt = massPerGrid.emplace(seg.pGrid.get(),
+                                         generator.makeParticleEvaluatorForGrid(*seg.pGrid)->getMass()).first;
+          T mass = massIt->second;
+
+          if (minMass > mass) minMass = mass;
+          if (maxMass < mass) maxMass = mass;
+          totalMass += mass * seg.numParticles;
+          num += seg.numParticles;
+        }
+        return true;
+      }
+
       /*! \brief Iterate over all particles in order of the gadget particle types.
        *
           This may not be the same as the genetIC mapper order.
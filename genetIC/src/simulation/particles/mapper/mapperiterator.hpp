@@ -4,6 +4,7 @@
 #include <memory>
 #include <typeinfo>
 #include <src/simulation/particles/generator.hpp>
+#include "src/simulation/particles/mapper/segmentindex.hpp"
 
 namespace particle {
   template<typename GridDataType>
@@ -40,6 +41,9 @@ namespace particle {
      iterator is also tied to a specific particle generator, which can be used to quickly
      generate particles by iterating through the structure of grid.
 
+     An iterator can be flattened, after which it ignores the sub-iterators and instead uses the mapper's
+     ParticleSegmentIndex to step and dereference; see flatten().
+
     */
     template<typename GridDataType, typename T=tools::datatypes::strip_complex<GridDataType>>
     class MapperIterator {
@@ -70,6 +74,9 @@ namespace particle {
       const ParticleMapper<GridDataType> *pMapper; //!< Pointer to the particle mapper that uses the iterator
       const AbstractMultiLevelParticleGenerator<GridDataType> &generator; //!< Generator used by the iterator to create particles for a given cell
 
+      std::shared_ptr<const ParticleSegmentIndex<T>> pSegmentIndex; //!< If not null, the iterator is flattened and uses this index in place of the mapper
+      size_t segmentNumber; //!< Segment of pSegmentIndex containing the current particle, if flattened
+
     private:
       mutable ConstGridPtrType pLastGrid; //!< Pointer to the last grid pointed to
       mutable EvaluatorPtrType pLastGridEvaluator; //!< Evaluator for fields on the last grid pointed to. Don't use directly: always call getEvaluatorAndIndex instead.
@@ -81,7 +88,7 @@ namespace particle {
       */
       MapperIterator(const ParticleMapper<GridDataType> *pMapper,
                      const AbstractMultiLevelParticleGenerator<GridDataType> &generator) :
-        i(0), pMapper(pMapper), generator(generator) {}
+        i(0), pMapper(pMapper), generator(generator), segmentNumber(0) {}
 
 
     public:
@@ -91,7 +98,8 @@ namespace particle {
       //! Constructor that copies another iterator
       MapperIterator(const MapperIterator<GridDataType> &source) :
         i(source.i), extraData(source.extraData), pMapper(source.pMapper),
-        generator(source.generator), pLastGrid(nullptr) {
+        generator(source.generator), pSegmentIndex(source.pSegmentIndex), segmentNumber(source.segmentNumber),
+        pLastGrid(nullptr) {
         for (const auto &subIterator: source.subIterators) {
           if (subIterator == nullptr)
             subIterators.push_back(nullptr);
@@ -102,29 +110,63 @@ namespace particle {
 
       //! Increments the iterator by one step
       MapperIterator &operator++() {
-        pMapper->incrementIterator(this);
+        if (pSegmentIndex != nullptr) {
+          ++i;
+          if (segmentNumber < pSegmentIndex->getNumSegments() &&
+              i >= pSegmentIndex->getSegment(segmentNumber).endParticle())
+            ++segmentNumber;
+        } else {
+          pMapper->incrementIterator(this);
+        }
         return (*this);
       }
 
       //! Increments the iterator by the specified number of steps
       MapperIterator operator++(int) {
         MapperIterator R = (*this);
-        pMapper->incrementIterator(this);
+        ++(*this);
         return R;
       }
 
       //! Increments the iterator by the specified number of steps
       MapperIterator &operator+=(size_t m) {
-        pMapper->incrementIteratorBy(this, m);
+        if (pSegmentIndex != nullptr) {
+          i += m;
+          segmentNumber = pSegmentIndex->findSegment(i);
+        } else {
+          pMapper->incrementIteratorBy(this, m);
+        }
         return (*this);
       }
 
       //! Decrements the iterator by the specified number of steps
       MapperIterator &operator-=(size_t m) {
-        pMapper->decrementIteratorBy(this, m);
+        if (pSegmentIndex != nullptr) {
+          i -= m;
+          segmentNumber = pSegmentIndex->findSegment(i);
+        } else {
+          pMapper->decrementIteratorBy(this, m);
+        }
         return (*this);
       }
 
+      /*! \brief Switch to stepping and dereferencing through the mapper's flat segment index.
+       *
+       * Seeking then costs a binary search over the segments rather than a walk through the mapper hierarchy, and
+       * stepping forward no longer needs any virtual calls. If the mapper cannot supply an index, nothing changes.
+       * The first call for a given mapper builds its index, so should be made outside any parallel region.
+       */
+      void flatten() {
+        if (pMapper == nullptr || pSegmentIndex != nullptr)
+          return;
+        pSegmentIndex = pMapper->getSegmentIndex();
+        if (pSegmentIndex == nullptr)
+          return;
+        segmentNumber = pSegmentIndex->findSegment(i);
+        subIterators.clear();
+        extraData.clear();
+      }
+
       difference_type operator-(const MapperIterator &other) const {
         assert(this->pMapper == other.pMapper);
         return difference_type(this->i) - difference_type(other.i);
@@ -132,9 +174,23 @@ namespace particle {
 
       //! Dereferences the iterator at its current position and returns a pointer to the level current pointed at, and the index of the cell pointed to on that level
       DereferenceType operator*() const {
+        if (pSegmentIndex != nullptr) {
+          const auto &segment = pSegmentIndex->getSegment(segmentNumber);
+          return std::make_pair(segment.pGrid, segment.getCellForParticle(i));
+        }
         return pMapper->dereferenceIterator(this);
       }
 
+      /*! \brief Returns how many particles, starting from the current one and up to nMax, lie on consecutive cells of one grid.
+       *
+       * Such a run can be evaluated in one go. Only flattened iterators know about runs; otherwise this returns 1.
+       */
+      size_t getNumConsecutiveCells(size_t nMax) const {
+        if (pSegmentIndex == nullptr || nMax == 0)
+          return std::min(nMax, size_t(1));
+        return pSegmentIndex->getSegment(segmentNumber).getConsecutiveCellRunLength(i, nMax);
+      }
+
       //! Get a grid evaluator and the index in that evaluator corresponding to the current location
       auto getParticleEvaluatorAndIndex() const {
         ConstGridPtrType gp;
@@ -198,10 +254,31 @@ namespace particle {
         return i;
       }
 
-      //! Iterates in parallel, applying the callback function
+      //! Iterates in parallel, applying the callback function to each particle in turn
       size_t parallelIterate(std::function<void(size_t, const MapperIterator &)> callback, size_t nMax) {
+        return parallelIterateBlocks([&callback](size_t blockStart, size_t blockLength, MapperIterator &localIterator) {
+          size_t blockEnd = blockStart + blockLength;
+          for (size_t local_i = blockStart; local_i < blockEnd; ++local_i) {
+            callback(local_i, localIterator);
+            if (local_i + 1 < blockEnd) ++localIterator;
+          }
+        }, nMax);
+      }
+
+      /*! \brief Iterates in parallel, handing each thread one contiguous block of particles
+       *
+       * The callback receives the offset of the first particle in the block (relative to the current position),
+       * the number of particles in the block and an iterator pointing at the first particle. It is responsible for
+       * stepping that iterator through the block with ++, and must not step it past the end of the block.
+       *
+       * Keeping blocks contiguous means neighbouring particles are generated and written by the same thread, and
+       * each thread only needs to seek once.
+       */
+      size_t parallelIterateBlocks(std::function<void(size_t, size_t, MapperIterator &)> callback, size_t nMax) {
         if (pMapper == nullptr) return 0;
 
+        flatten();
+
         size_t n = std::min(pMapper->size() - i, nMax);
         size_t final_i = i + n;
 
@@ -217,23 +294,24 @@ namespace particle {
           int thread_num = 0;
           int num_threads = 1;
 #endif
+          size_t blockStart = (n * thread_num) / num_threads;
+          size_t blockEnd = (n * (thread_num + 1)) / num_threads;
 
-          if (thread_num == 0)
+          // The final block ends closest to final_i, so its thread advances this iterator; the others take copies
+          bool usesThisIterator = (thread_num == num_threads - 1);
+
+          if (usesThisIterator)
             pThreadLocalIterator = this;
           else
             pThreadLocalIterator = new MapperIterator(*this);
 
 #pragma omp barrier
-          if ((unsigned) thread_num < n) {
-            (*pThreadLocalIterator) += thread_num;
-
-            for (size_t local_i = thread_num; local_i < n; local_i += num_threads) {
-              callback(local_i, *pThreadLocalIterator);
-              if (local_i + num_threads < n) (*pThreadLocalIterator) += num_threads;
-            }
+          if (blockEnd > blockStart) {
+            (*pThreadLocalIterator) += blockStart;
+            callback(blockStart, blockEnd - blockStart, *pThreadLocalIterator);
           }
 
-          if (thread_num != 0)
+          if (!usesThisIterator)
             delete pThreadLocalIterator;
 
         }
@@ -279,7 +357,10 @@ namespace particle {
 
       //! Outputs debug information about the iterator to the specified stream
       void debugInfo(std::ostream &s, int n = 0) const {
-        if(pMapper!=nullptr)
+        if (pSegmentIndex != nullptr) {
+          tools::indent(s, n);
+          s << "i=" << i << " in segment " << segmentNumber << " of flattened iterator" << std::endl;
+        } else if(pMapper!=nullptr)
           pMapper->debugInfoForIterator(s, n, this);
       }
 
@@ -52,6 +52,12 @@ namespace particle {
         pIterator->i += increment;
       }
 
+      //! A single segment covers the whole grid
+      bool appendSegments(ParticleSegmentIndex<T> &index) const override {
+        index.appendContiguous(pGrid, 0, pGrid->size3, gadgetParticleType);
+        return true;
+      }
+
     public:
       bool containsGadgetParticleType(unsigned int t) override {
         return (t==gadgetParticleType);
@@ -102,7 +108,7 @@ namespace particle {
       //! Copies the flagged cells to the specified vector
       void getFlaggedParticles(std::vector<size_t> &particleArray) const override {
         pGrid->getFlaggedCells(particleArray);
-        std::sort(particleArray.begin(), particleArray.end());
+        tools::parallelSort(particleArray);
       }
 
       //! Returns the grid associated to this level (only one level, so by definition it is the coarsest)
@@ -122,6 +128,7 @@ namespace particle {
 
       void setGadgetParticleType(unsigned int type) override {
         gadgetParticleType = type;
+        this->pSegmentIndex = nullptr;
       }
 
       unsigned int getGadgetParticleTypeForFinestGrid() override {
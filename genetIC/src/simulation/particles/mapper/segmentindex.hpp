@@ -0,0 +1,198 @@
+#ifndef IC_SEGMENTINDEX_HPP
+#define IC_SEGMENTINDEX_HPP
+
+#include <memory>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "src/simulation/grid/grid.hpp"
+
+namespace particle {
+
+  namespace mapper {
+
+    /*! \struct ParticleSegment
+        \brief A run of consecutive particles in a mapper which all live on the same grid and share a gadget type.
+
+        The cells are either consecutive (starting at firstCell), or listed explicitly in cellList. The list is
+        owned by the mapper that generated the segment.
+    */
+    template<typename T>
+    struct ParticleSegment {
+      size_t firstParticle; //!< Index in the mapper of the first particle in this segment
+      size_t numParticles; //!< Number of particles in this segment
+      std::shared_ptr<const grids::Grid<T>> pGrid; //!< Grid on which the particles are defined
+      size_t firstCell; //!< Cell of the first particle, if cellList is nullptr
+      const size_t *cellList; //!< If not nullptr, the cell for each particle in the segment
+      unsigned int gadgetType; //!< Gadget particle type of all particles in the segment
+
+      //! Returns one past the last particle in the segment
+      size_t endParticle() const {
+        return firstParticle + numParticles;
+      }
+
+      //! Returns the cell on pGrid corresponding to the given particle, which must lie in the segment
+      size_t getCellForParticle(size_t particle) const {
+        size_t offset = particle - firstParticle;
+        return cellList == nullptr ? firstCell + offset : cellList[offset];
+      }
+
+      //! Returns how many particles, starting from the given one and up to nMax, lie on consecutive cells
+      size_t getConsecutiveCellRunLength(size_t particle, size_t nMax) const {
+        size_t maxRun = std::min(nMax, endParticle() - particle);
+        if (cellList == nullptr || maxRun == 0)
+          return maxRun;
+        const size_t *cells = cellList + (particle - firstParticle);
+        size_t run = 1;
+        while (run < maxRun && cells[run] == cells[0] + run)
+          ++run;
+        return run;
+      }
+    };
+
+    /*! \class ParticleSegmentIndex
+        \brief A flat table of particle segments, compiled from a (possibly nested) particle mapper
+
+        Walking a hierarchy of TwoLevelParticleMappers one particle at a time involves many virtual calls and
+        sub-iterator updates. Instead, the hierarchy can be compiled once into a sorted list of segments, each of which
+        maps a range of particle indices to a range (or explicit list) of cells on one grid. Seeking to a particle is
+        then a binary search over the segments, and advancing by one is a simple increment.
+    */
+    template<typename T>
+    class ParticleSegmentIndex {
+    public:
+      using SegmentType = ParticleSegment<T>;
+      using ConstGridPtrType = std::shared_ptr<const grids::Grid<T>>;
+
+    protected:
+      std::vector<SegmentType> segments; //!< Segments, in order of increasing particle index
+      size_t numParticles = 0; //!< Total number of particles covered by the segments
+
+    public:
+
+      //! Append a run of particles pointing to consecutive cells on the given grid
+      void appendContiguous(ConstGridPtrType pGrid, size_t firstCell, size_t n, unsigned int gadgetType) {
+        if (n == 0) return;
+
+        if (!segments.empty()) {
+          SegmentType &last = segments.back();
+          if (last.cellList == nullptr && last.pGrid == pGrid && last.gadgetType == gadgetType &&
+              last.firstCell + last.numParticles == firstCell) {
+            last.numParticles += n;
+            numParticles += n;
+            return;
+          }
+        }
+
+        segments.push_back({numParticles, n, pGrid, firstCell, nullptr, gadgetType});
+        numParticles += n;
+      }
+
+      //! Append a run of particles whose cells on the given grid are listed explicitly
+      void appendList(ConstGridPtrType pGrid, const size_t *cellList, size_t n, unsigned int gadgetType) {
+        if (n == 0) return;
+        segments.push_back({numParticles, n, pGrid, 0, cellList, gadgetType});
+        numParticles += n;
+      }
+
+      //! Append the particles from another index that lie in the range [start, end)
+      void appendRange(const ParticleSegmentIndex<T> &source, size_t start, size_t end) {
+        if (start >= end) return;
+        assert(end <= source.size());
+
+        for (size_t s = source.findSegment(start); s < source.segments.size() && source.segments[s].firstParticle < end;
+             ++s) {
+          const SegmentType &seg = source.segments[s];
+          size_t from = std::max(start, seg.firstParticle);
+          size_t to = std::min(end, seg.endParticle());
+          if (seg.cellList == nullptr)
+            appendContiguous(seg.pGrid, seg.getCellForParticle(from), to - from, seg.gadgetType);
+          else
+            appendList(seg.pGrid, seg.cellList + (from - seg.firstParticle), to - from, seg.gadgetType);
+        }
+      }
+
+      //! Append all the particles from another index
+      void appendAll(const ParticleSegmentIndex<T> &source) {
+        appendRange(source, 0, source.size());
+      }
+
+      //! Returns the total number of particles in the index
+      size_t size() const {
+        return numParticles;
+      }
+
+      //! Returns the number of segments in the index
+      size_t getNumSegments() const {
+        return segments.size();
+      }
+
+      //! Returns the specified segment
+      const SegmentType &getSegment(size_t s) const {
+        return segments[s];
+      }
+
+      //! Returns the number of the segment containing the given particle, or getNumSegments() if beyond the end
+      size_t findSegment(size_t particle) const {
+        if (particle >= numParticles)
+          return segments.size();
+        auto it = std::upper_bound(segments.begin(), segments.end(), particle,
+                                   [](size_t p, const SegmentType &seg) { return p < seg.firstParticle; });
+        assert(it != segments.begin());
+        return (it - segments.begin()) - 1;
+      }
+
+      /*! \brief Appends the indices of all particles whose cells are flagged on their grid.
+       *
+       * The result is in ascending order. Flags are fetched once per distinct grid.
+       */
+      void getFlaggedParticles(std::vector<size_t> &particleArray) const {
+        std::map<const grids::Grid<T> *, std::vector<size_t>> flagsPerGrid;
+
+        for (const auto &seg : segments) {
+          if (flagsPerGrid.count(seg.pGrid.get()) == 0) {
+            auto &flags = flagsPerGrid[seg.pGrid.get()];
+            seg.pGrid->getFlaggedCells(flags);
+            if (!std::is_sorted(flags.begin(), flags.end()))
+              tools::parallelSort(flags);
+          }
+        }
+
+        for (const auto &seg : segments) {
+          const auto &flags = flagsPerGrid[seg.pGrid.get()];
+          if (flags.empty())
+            continue;
+
+          if (seg.cellList == nullptr) {
+            auto begin = std::lower_bound(flags.begin(), flags.end(), seg.firstCell);
+            auto end = std::lower_bound(begin, flags.end(), seg.firstCell + seg.numParticles);
+            for (auto it = begin; it != end; ++it)
+              particleArray.push_back(seg.firstParticle + (*it - seg.firstCell));
+          } else {
+            std::vector<char> isFlagged(seg.numParticles);
+#pragma omp parallel for schedule(static)
+            for (size_t k = 0; k < seg.numParticles; ++k) {
+              isFlagged[k] = std::binary_search(flags.begin(), flags.end(), seg.cellList[k]);
+            }
+            tools::appendSelectedIndices(isFlagged, seg.firstParticle, particleArray);
+          }
+        }
+      }
+
+      //! Outputs a summary of the segments to the specified stream
+      void debugInfo(std::ostream &s) const {
+        for (const auto &seg : segments) {
+          s << "particles " << seg.firstParticle << "-" << seg.endParticle() << " -> ";
+          if (seg.cellList == nullptr)
+            s << "cells " << seg.firstCell << "-" << seg.firstCell + seg.numParticles;
+          else
+            s << "listed cells";
+          s << " of grid " << seg.pGrid << " (gadget type " << seg.gadgetType << ")" << std::endl;
+        }
+      }
+    };
+
+  }
+}
+
+#endif
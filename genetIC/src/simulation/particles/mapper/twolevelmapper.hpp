@@ -50,6 +50,26 @@ namespace particle {
       std::vector<size_t> level1ParticlesToReplace; //!< the particles on the level-1 (finest available) grid, which we wish to replace with their zooms
       std::vector<size_t> level1CellsToReplace; //!< the cells on the level-1 (finest available) grid, which we wish to replace with their zooms
       mutable std::vector<size_t> zoomParticleArrayHiresUnsorted; //< the particles/cells on the level-2 grid that are included
+      mutable std::vector<size_t> zoomCellsSorted; //!< zoomParticleArrayHiresUnsorted in ascending order, built on demand
+      mutable std::vector<size_t> zoomCellsSortIndex; //!< position in zoomParticleArrayHiresUnsorted of each entry of zoomCellsSorted
+      mutable std::shared_ptr<const ParticleSegmentIndex<T>> pLevel1SegmentIndex; //!< Level 1 index from which pSegmentIndex was built
+      mutable std::shared_ptr<const ParticleSegmentIndex<T>> pLevel2SegmentIndex; //!< Level 2 index from which pSegmentIndex was built
+
+      /*! \brief Builds the inverse of zoomParticleArrayHiresUnsorted (level 2 cell to zoom particle) if not already cached.
+       *
+       * The cache is cleared whenever the zoom particle list is recalculated. The check and build happen inside a
+       * critical section, so that concurrent const queries (e.g. from getFlaggedParticles) see a complete index.
+       */
+      void buildZoomInverseIndexIfRequired() const {
+#pragma omp critical(zoomInverseIndex)
+        if (zoomCellsSortIndex.size() != zoomParticleArrayHiresUnsorted.size()) {
+          zoomCellsSortIndex = tools::argsort(zoomParticleArrayHiresUnsorted);
+          zoomCellsSorted.resize(zoomCellsSortIndex.size());
+#pragma omp parallel for schedule(static)
+          for (size_t i = 0; i < zoomCellsSortIndex.size(); ++i)
+            zoomCellsSorted[i] = zoomParticleArrayHiresUnsorted[zoomCellsSortIndex[i]];
+        }
+      }
 
       /*! \brief Write n_hr_per_lr level 2 ids into a vector at the given starting index, corresponding to the level 1 cell id.
          *  \param id - level 1 id
@@ -267,7 +287,7 @@ namespace particle {
 
         auto pLevel1Indept = pLevel1->withIndependentFlags();
 
-        std::sort(this->level1CellsToReplace.begin(), this->level1CellsToReplace.end());
+        tools::parallelSort(this->level1CellsToReplace);
         pLevel1Indept->unflagAllParticles();
         pLevel1Indept->getFinestGrid()->flagCells(this->level1CellsToReplace);
         pLevel1Indept->getFlaggedParticles(level1ParticlesToReplace);
@@ -404,45 +424,35 @@ namespace particle {
         std::vector<size_t> level2particles;
         level2particles.resize(orderedParticleIndices.size() - firstHrParticleInInput);
 
-        // N.B. the following parallelism does not seem to achieve much speed-up.
-        // Is this because it is memory access bound, or some more subtle reason?
+        // The level 2 cell for each particle is gathered from the zoom particle list calculated on construction.
 
 #ifdef OPENMP
 #pragma omp parallel
         {
 #endif
-          std::vector<size_t> hrCellsCache;
           std::vector<size_t> localLrParticles;
-          hrCellsCache.resize(n_hr_per_lr);
           size_t lrParticleLastAccessed = std::numeric_limits<size_t>::max();
 
 #ifdef OPENMP
-#pragma omp for schedule(static, n_hr_per_lr*10)
+#pragma omp for schedule(static)
 #endif
           for (size_t i = firstHrParticleInInput; i < orderedParticleIndices.size(); ++i) {
-            size_t thisParticle = orderedParticleIndices[i];
-            size_t lr_index = (thisParticle - firstHiresParticleInMapper) / n_hr_per_lr;
+            size_t zoomIndex = orderedParticleIndices[i] - firstHiresParticleInMapper;
+            size_t lr_index = zoomIndex / n_hr_per_lr;
 
             if (lr_index >= level1ParticlesToReplace.size())
               throw std::runtime_error("Particle ID out of range");
 
-            // find the low-res particle.
-
+            // record the low-res particle that this particle replaces
             if (lrParticleLastAccessed != level1ParticlesToReplace[lr_index]) {
               lrParticleLastAccessed = level1ParticlesToReplace[lr_index];
               localLrParticles.push_back(lrParticleLastAccessed);
-              // get all the HR particles
-              insertLevel2IdsFromLevel1CellId(level1CellsToReplace[lr_index], hrCellsCache.begin());
             }
 
-            // work out which of these this particle must be and push it onto
-            // the HR list
-            size_t offset = (thisParticle - firstHiresParticleInMapper) % n_hr_per_lr;
-
             // NB here we assume that level 2 is a OneLevelParticleMapper so that the cell ID can be
             // taken also to be a particle ID. This assumption is explicitly tested with an assert
             // in the constructor.
-            level2particles[i - firstHrParticleInInput] = hrCellsCache[offset];
+            level2particles[i - firstHrParticleInInput] = zoomParticleArrayHiresUnsorted[zoomIndex];
 
           }
 
@@ -459,8 +469,8 @@ namespace particle {
 
         // The divided particle lists will now be passed to the underlying particle mappers,
         // which require the input to be sorted
-        std::sort(level1particles.begin(), level1particles.end());
-        std::sort(level2particles.begin(), level2particles.end());
+        tools::parallelSort(level1particles);
+        tools::parallelSort(level2particles);
 
         // We're done with our list so they might as well steal the data.
         pLevel1->flagParticles(std::move(level1particles));
@@ -472,6 +482,14 @@ namespace particle {
       //! Copies the ids of flagged particles into particleArray. Guarantees the result is sorted in ascending order.
       void getFlaggedParticles(std::vector<size_t> &particleArray) const override {
 
+        auto pIndex = this->getSegmentIndex();
+        if (pIndex != nullptr) {
+          pIndex->getFlaggedParticles(particleArray);
+          if (!std::is_sorted(particleArray.begin(), particleArray.end()))
+            tools::parallelSort(particleArray);
+          return;
+        }
+
         // translate level 1 particles - just need to exclude the zoomed particles
         std::vector<size_t> grid1particles;
         pLevel1->getFlaggedParticles(grid1particles);
@@ -491,27 +509,25 @@ namespace particle {
         std::vector<size_t> grid2particles;
         pLevel2->getFlaggedParticles(grid2particles);
 
-        // get the ordering of the level 2 particles
-        std::vector<size_t> sortIndex = tools::argsort(zoomParticleArrayHiresUnsorted);
-
-
-        size_t zoomed_i = 0;
-        size_t len_zoomed = zoomParticleArrayHiresUnsorted.size();
-        for (const size_t &i_hr : grid2particles) {
-          // find the i_hr in the zoomed particle list
-          while (zoomed_i < len_zoomed && zoomParticleArrayHiresUnsorted[sortIndex[zoomed_i]] < i_hr)
-            ++zoomed_i;
-
-          // If the marked particle is not actually in the output list, ignore it.
-          //
-          // Older versions of the code throw an exception instead
-          if (zoomed_i == len_zoomed || zoomParticleArrayHiresUnsorted[sortIndex[zoomed_i]] != i_hr)
-            continue;
-
-          particleArray.push_back(sortIndex[zoomed_i] + firstLevel2Particle);
+        // look up each flagged level 2 cell in the cached inverse index, and mark the zoom particle it belongs to.
+        // If the marked particle is not actually in the output list, ignore it.
+        //
+        // Older versions of the code throw an exception instead
+        buildZoomInverseIndexIfRequired();
+        std::vector<char> zoomParticleFlagged(zoomParticleArrayHiresUnsorted.size(), 0);
+
+#pragma omp parallel for schedule(static)
+        for (size_t i = 0; i < grid2particles.size(); ++i) {
+          auto it = std::lower_bound(zoomCellsSorted.begin(), zoomCellsSorted.end(), grid2particles[i]);
+          if (it != zoomCellsSorted.end() && *it == grid2particles[i])
+            zoomParticleFlagged[zoomCellsSortIndex[it - zoomCellsSorted.begin()]] = 1;
         }
 
-        std::sort(particleArray.begin(), particleArray.end());
+        // the level 1 particles all precede the level 2 particles, so the result is in ascending order
+        // (unless level 1 is skipped, in which case its particles are listed as if it were not)
+        tools::appendSelectedIndices(zoomParticleFlagged, firstLevel2Particle, particleArray);
+        if (skipLevel1)
+          tools::parallelSort(particleArray);
 
       }
 
@@ -864,10 +880,51 @@ namespace particle {
           return **(pIterator->subIterators[0]);
       }
 
+      /*! \brief The level 1 segments with the replaced particles cut out, followed by a single listed segment for level 2
+       *
+       * Level 2 is a OneLevelParticleMapper, so the cells for its segment are just zoomParticleArrayHiresUnsorted.
+       * The level 2 segment points into that array, so the cached index is cleared whenever it is recalculated.
+       */
+      bool appendSegments(ParticleSegmentIndex<T> &index) const override {
+        auto pLevel2Index = pLevel2->getSegmentIndex();
+        if (pLevel2Index == nullptr)
+          return false;
+        assert(pLevel2Index->getNumSegments() == 1 && pLevel2Index->getSegment(0).firstCell == 0);
+        pLevel2SegmentIndex = pLevel2Index;
+
+        if (!skipLevel1) {
+          auto pLevel1Index = pLevel1->getSegmentIndex();
+          if (pLevel1Index == nullptr)
+            return false;
+          pLevel1SegmentIndex = pLevel1Index;
+
+          size_t start = 0;
+          for (size_t replaced : level1ParticlesToReplace) {
+            index.appendRange(*pLevel1Index, start, replaced);
+            start = replaced + 1;
+          }
+          index.appendRange(*pLevel1Index, start, pLevel1Index->size());
+        }
+
+        const auto &level2Segment = pLevel2Index->getSegment(0);
+        index.appendList(level2Segment.pGrid, zoomParticleArrayHiresUnsorted.data(),
+                         zoomParticleArrayHiresUnsorted.size(), level2Segment.gadgetType);
+        return true;
+      }
+
+      //! The cached index is out of date if either level's index has been rebuilt since
+      bool segmentIndexIsCurrent() const override {
+        return pLevel2->getSegmentIndex() == pLevel2SegmentIndex &&
+               (skipLevel1 || pLevel1->getSegmentIndex() == pLevel1SegmentIndex);
+      }
+
 
       //! Creates a list of zoom particles from the list of level 1 particles that need to be replaced
       void calculateHiresParticleList() const {
         zoomParticleArrayHiresUnsorted.resize(level1ParticlesToReplace.size() * n_hr_per_lr);
+        zoomCellsSorted.clear();
+        zoomCellsSortIndex.clear();
+        this->pSegmentIndex = nullptr;
 
         bool failed = false;
 
@@ -887,7 +944,7 @@ namespace particle {
 
         if (!pLevel2->supportsReverseIterator()) {
           // underlying map can't cope with particles being out of order - sort them
-          std::sort(zoomParticleArrayHiresUnsorted.begin(), zoomParticleArrayHiresUnsorted.end());
+          tools::parallelSort(zoomParticleArrayHiresUnsorted);
         }
 
       }
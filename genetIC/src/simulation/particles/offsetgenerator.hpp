@@ -40,6 +40,15 @@ namespace particle {
       return output;
     }
 
+    void evaluateRangeNoWrap(size_t firstCell, size_t n, Coordinate<GridDataType> *pos,
+                             Coordinate<GridDataType> *vel) const override {
+      underlying->evaluateRangeNoWrap(firstCell, n, pos, vel);
+      for (size_t k = 0; k < n; ++k) {
+        vel[k] += velOffset;
+        pos[k] += posOffset;
+      }
+    }
+
     Particle <GridDataType> getParticleNoOffset(size_t id) const override {
       auto output = underlying->getParticleNoOffset(id);
       output.vel += velOffset;
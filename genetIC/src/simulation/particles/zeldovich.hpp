@@ -6,6 +6,7 @@
 #define IC_ZELDOVICH_HPP
 
 #include <complex>
+#include <array>
 #include <src/io/numpy.hpp>
 #include "src/tools/progress/progress.hpp"
 #include "src/simulation/field/field.hpp"
@@ -108,6 +109,29 @@ namespace particle {
       return particle;
     }
 
+    //! Evaluates a range of particles, fetching each offset component for the whole range at once
+    virtual void evaluateRangeNoWrap(size_t firstCell, size_t n, Coordinate<T> *pos,
+                                     Coordinate<T> *vel) const override {
+      constexpr size_t chunkSize = 256;
+      std::array<GridDataType, chunkSize> offsetX, offsetY, offsetZ;
+
+      for (size_t chunkStart = 0; chunkStart < n; chunkStart += chunkSize) {
+        size_t nThisChunk = std::min(chunkSize, n - chunkStart);
+        pOffsetXEvaluator->evaluateRange(firstCell + chunkStart, nThisChunk, offsetX.data());
+        pOffsetYEvaluator->evaluateRange(firstCell + chunkStart, nThisChunk, offsetY.data());
+        pOffsetZEvaluator->evaluateRange(firstCell + chunkStart, nThisChunk, offsetZ.data());
+
+        for (size_t j = 0; j < nThisChunk; ++j) {
+          Coordinate<T> &thisPos = pos[chunkStart + j];
+          thisPos.x = tools::datatypes::real_part_if_complex(offsetX[j]);
+          thisPos.y = tools::datatypes::real_part_if_complex(offsetY[j]);
+          thisPos.z = tools::datatypes::real_part_if_complex(offsetZ[j]);
+          vel[chunkStart + j] = thisPos * velocityToOffsetRatio;
+          thisPos += onGrid->getCentroidFromIndex(firstCell + chunkStart + j);
+        }
+      }
+    }
+
     //! Gets the mass for a single particle
     virtual T getMass() const override {
       return boxMass * onGrid->cellMassFrac;
@@ -137,7 +161,7 @@ namespace particle {
 
     friend class ZeldovichParticleEvaluator<GridDataType, T>;
 
-    TField &linearOverdensityField; //!< Overdensity field used to generate particles on this grid
+    const TField &linearOverdensityField; //!< Overdensity field used to generate particles on this grid (only read)
     using ParticleGenerator<GridDataType>::grid;
 
 
@@ -215,22 +239,23 @@ namespace particle {
 
         // Create zeldovich offset field
         std::vector<GridDataType> &data = zeldovichOffsetField->getDataVector();
-        auto grid2 = zeldovichOffsetField->getGrid();
+        const auto &grid2 = zeldovichOffsetField->getGrid();
+        const auto geometry = grid2.getGeometry();
 
         // Cannot compute second order finite-difference on a grid smaller than 2
         assert(grid2.size >= 2);
 
         // Iterate over cells and compute finite difference
         grid2.parallelIterateOverCellsSpatiallyClustered(
-           [&data, &grid2, &potential, a, b, &step_left, &step_right](size_t index){
+           [&data, geometry, &potential, a, b, &step_left, &step_right](size_t index){
 
           size_t ind_p1, ind_m1, ind_p2, ind_m2;
 
-          ind_m1 = grid2.getIndexFromIndexAndStepWithWrap(index, step_left);
-          ind_m2 = grid2.getIndexFromIndexAndStepWithWrap(ind_m1, step_left);
+          ind_m1 = geometry.getIndexFromIndexAndStepWithWrap(index, step_left);
+          ind_m2 = geometry.getIndexFromIndexAndStepWithWrap(ind_m1, step_left);
 
-          ind_p1 = grid2.getIndexFromIndexAndStepWithWrap(index, step_right);
-          ind_p2 = grid2.getIndexFromIndexAndStepWithWrap(ind_p1, step_right);
+          ind_p1 = geometry.getIndexFromIndexAndStepWithWrap(index, step_right);
+          ind_p2 = geometry.getIndexFromIndexAndStepWithWrap(ind_p1, step_right);
 
           // 4th order stencil (with periodic boundaries)
           data[index] =
@@ -256,7 +281,7 @@ namespace particle {
 
 
     //! Constructor from a given overdensity field
-    ZeldovichParticleGenerator(TField &linearOverdensityField) :
+    ZeldovichParticleGenerator(const TField &linearOverdensityField) :
       ParticleGenerator<GridDataType>(linearOverdensityField.getGrid()),
       linearOverdensityField(linearOverdensityField) {
       recalculate();
@@ -6,19 +6,74 @@
 #define IC_MEMMAP_HPP
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string>
+#include <memory>
+#include <istream>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <iostream>
+#include "src/tools/writequeue.hpp"
 
 namespace tools {
 
+  //! The ways in which MemMapFileWriter can transfer the bulk of the data to the file
+  enum class WriteBackend {
+    memmap, //!< Regions are memory maps of the file, flushed by the kernel
+    buffered //!< Regions are buffers, written with pwrite by a dedicated I/O thread once released
+  };
+
+  //! Writes the name of a write back-end
+  inline std::ostream &operator<<(std::ostream &outputStream, const WriteBackend &backend) {
+    switch (backend) {
+      case WriteBackend::memmap:
+        outputStream << "memmap";
+        break;
+      case WriteBackend::buffered:
+        outputStream << "buffered";
+        break;
+    }
+    return outputStream;
+  }
+
+  //! Reads a write back-end from its name (memmap or buffered)
+  inline std::istream &operator>>(std::istream &inputStream, WriteBackend &backend) {
+    std::string s;
+    inputStream >> s;
+    if (s == "memmap") {
+      backend = WriteBackend::memmap;
+    } else if (s == "buffered") {
+      backend = WriteBackend::buffered;
+    } else {
+      inputStream.setstate(std::ios::failbit);
+    }
+    return inputStream;
+  }
+
+  /*! \struct FileWriterOptions
+      \brief Settings for MemMapFileWriter.
+
+      With the buffered back-end, output writers fill regions of about bufferSize bytes at a time. Up to
+      numBuffers - 1 such sets of regions may be waiting for the I/O thread while the next is filled, which bounds
+      the memory used.
+  */
+  struct FileWriterOptions {
+    WriteBackend backend = WriteBackend::memmap; //!< How regions are transferred to the file
+    size_t bufferSize = 64 * 1024 * 1024; //!< Buffered back-end: bytes filled at a time by output writers
+    size_t numBuffers = 2; //!< Buffered back-end: number of buffers in use at once, including the one being filled
+    bool directIO = false; //!< Buffered back-end: bypass the page cache with O_DIRECT where alignment allows
+  };
+
   class MemMapFileWriter;
 
   /*! \class MemMapRegion
       \brief Class to interface with a memory block describing some section of data from a potentially large file.
+
+      The block is either a memory map of the file or, for the buffered back-end, a buffer that is handed to the
+      writer's I/O thread when the region is released. Either way its start has the same alignment relative to a page
+      as the data's position in the file.
   */
   template<typename DataType>
   class MemMapRegion {
@@ -26,24 +81,30 @@ namespace tools {
     char *addr_aligned; //!< Address for the start of the current page
     DataType *addr; //!< Address for data to be written to in the memory map
     size_t size_bytes; //!< Size in bytes of the data to be written, plus any data since the start of the current page
+    size_t aligned_offset; //!< Position in the file of the start of the current page
+    std::shared_ptr<AsyncWriteQueue> pWriteQueue; //!< For the buffered back-end, the queue to hand the buffer to
     std::vector<std::function<void()>> onEndCallbacks; //!< A callback for when the
 
     /*! \brief Define a MemMapRegion for a given file descriptor, write location, and number of elements to be written
     \param fd - file descriptor (-1 for errors)
     \param file_offset - current write location in the file
     \param n_elements - number of elements of type DataType to be written
+    \param setFileSize - if true, the file is truncated to end with this region; otherwise it must already be large enough
     */
-    MemMapRegion(int fd, size_t file_offset, size_t n_elements) {
+    MemMapRegion(int fd, size_t file_offset, size_t n_elements, bool setFileSize = true) {
       size_bytes = n_elements*sizeof(DataType);
 
-      ::ftruncate(fd, file_offset+size_bytes);
-      ::lseek(fd, file_offset+size_bytes, SEEK_SET);
+      if (setFileSize) {
+        ::ftruncate(fd, file_offset + size_bytes);
+        ::lseek(fd, file_offset + size_bytes, SEEK_SET);
+      }
 
       size_t npage_offset = file_offset/::getpagesize(); // Number of full pages written at the current write position
       size_t aligned_offset = npage_offset*::getpagesize(); // Beginning of page that the current write position is on
       size_t byte_page_offset = file_offset-aligned_offset; // Distance from the beginning of the current page
 
       size_bytes+=byte_page_offset;
+      this->aligned_offset = aligned_offset;
 
       addr_aligned = static_cast<char*>(::mmap(nullptr, size_bytes, PROT_WRITE,
           MAP_SHARED, fd, aligned_offset));
@@ -55,17 +116,38 @@ namespace tools {
 
     }
 
+    /*! \brief Define a buffered region, which is written by the given queue when released
+    \param pQueue - queue that will write the buffer
+    \param file_offset - write location in the file
+    \param n_elements - number of elements of type DataType to be written
+    */
+    MemMapRegion(std::shared_ptr<AsyncWriteQueue> pQueue, size_t file_offset, size_t n_elements) :
+        pWriteQueue(std::move(pQueue)) {
+      size_t page = AsyncWriteQueue::getPageSize();
+      aligned_offset = (file_offset / page) * page;
+      size_t byte_page_offset = file_offset - aligned_offset;
+      size_bytes = n_elements * sizeof(DataType) + byte_page_offset;
+
+      addr_aligned = AsyncWriteQueue::allocateBuffer(size_bytes);
+      addr = reinterpret_cast<DataType*>(&addr_aligned[byte_page_offset]);
+    }
+
     friend class MemMapFileWriter;
 
   public:
      //! Destructor - exit with an error if we detect something has gone wrong deleting the memory map
     ~MemMapRegion() {
       if (addr_aligned != nullptr) {
-        msync(addr_aligned, size_bytes, MS_ASYNC);
-        if(munmap(addr_aligned, size_bytes)!=0) {
-          // This probably indicates something has gone catastrophically wrong...
-          logging::entry(logging::level::warning) << "ERROR: Failed to delete the mem-map (reason: " << ::strerror(errno) << ")" << std::endl;
-          exit(1);
+        if (pWriteQueue != nullptr) {
+          // the queue now owns the buffer; the padding before the data is not part of this region
+          pWriteQueue->submit(addr_aligned, aligned_offset, reinterpret_cast<char*>(addr) - addr_aligned, size_bytes);
+        } else {
+          msync(addr_aligned, size_bytes, MS_ASYNC);
+          if(munmap(addr_aligned, size_bytes)!=0) {
+            // This probably indicates something has gone catastrophically wrong...
+            logging::entry(logging::level::warning) << "ERROR: Failed to delete the mem-map (reason: " << ::strerror(errno) << ")" << std::endl;
+            exit(1);
+          }
         }
         for(auto f: onEndCallbacks) {
            f();
@@ -96,6 +178,8 @@ namespace tools {
       this->addr = move.addr;
       this->addr_aligned = move.addr_aligned;
       this->size_bytes = move.size_bytes;
+      this->aligned_offset = move.aligned_offset;
+      this->pWriteQueue = std::move(move.pWriteQueue);
       this->onEndCallbacks = std::move(move.onEndCallbacks);
       move.addr = nullptr;
       move.addr_aligned = nullptr;
@@ -111,12 +195,46 @@ namespace tools {
    It operates on a mixed model where you can sequentially write individual bits of data to the file (using the
    write method), but also get a pointer to the mem-map when convenient (using the getMemMap method).
 
+   With the buffered back-end (see FileWriterOptions), the regions returned are buffers rather than memory maps, and
+   are written by a dedicated I/O thread when released. Callers should then keep the regions small, so that the
+   computation of the next region overlaps with the writing of the last.
 
   */
   class MemMapFileWriter {
   protected:
     int fd; //!< File descriptor (ie, state of the file opened). Defaults to -1 (indicating error)
+    int directFd = -1; //!< File descriptor opened with O_DIRECT, if in use by the buffered back-end
     size_t offset; //!< Current write location in the file.
+    FileWriterOptions options; //!< Choice of back-end and its settings
+    std::shared_ptr<AsyncWriteQueue> pWriteQueue; //!< Queue writing the regions, if using the buffered back-end
+
+    //! Create a region of n_elements at the given file offset, using the selected back-end
+    template<typename DataType>
+    MemMapRegion<DataType> makeRegion(size_t file_offset, size_t n_elements, bool setFileSize) {
+      if (pWriteQueue != nullptr)
+        return MemMapRegion<DataType>(pWriteQueue, file_offset, n_elements);
+      else
+        return MemMapRegion<DataType>(fd, file_offset, n_elements, setFileSize);
+    }
+
+    //! Write everything that has been queued, stop the I/O thread (if any) and close the file
+    void close() {
+      if (pWriteQueue != nullptr) {
+        try {
+          pWriteQueue->waitUntilEmpty();
+        } catch (std::runtime_error &e) {
+          logging::entry(logging::level::warning) << "ERROR: " << e.what() << std::endl;
+          exit(1);
+        }
+        pWriteQueue.reset();
+      }
+      if (directFd != -1)
+        ::close(directFd);
+      if (fd != -1)
+        ::close(fd);
+      directFd = -1;
+      fd = -1;
+    }
 
   public:
     //! Default constructor
@@ -135,32 +253,59 @@ namespace tools {
     //! Move semantics: copies the state into this writer, and disables the original writer
     MemMapFileWriter & operator=(MemMapFileWriter &&move) {
       fd = move.fd;
+      directFd = move.directFd;
       offset = move.offset;
+      options = move.options;
+      pWriteQueue = std::move(move.pWriteQueue);
       move.fd = -1;
+      move.directFd = -1;
       return (*this);
     }
 
-    //! Construct a MemMapFileWriter for a file with given name
-    MemMapFileWriter(std::string filename)  {
+    /*! \brief Construct a MemMapFileWriter for a file with given name
+        \param filename - name of the file, which is created or truncated
+        \param options - back-end to use for regions of the file, and its settings
+    */
+    MemMapFileWriter(std::string filename, const FileWriterOptions &options = FileWriterOptions()) :
+        options(options) {
       // Open file in read/write mode, creating it if it doesn't already exist
       fd = ::open(filename.c_str(), O_RDWR | O_CREAT, (mode_t)0666);
       if(fd==-1)
         throw std::runtime_error("Failed to open file (reason: "+std::string(::strerror(errno))+")");
       ::ftruncate(fd, 0);
       offset = 0;
+
+      if (options.backend == WriteBackend::buffered) {
+#ifdef O_DIRECT
+        if (options.directIO) {
+          directFd = ::open(filename.c_str(), O_WRONLY | O_DIRECT);
+          if (directFd == -1)
+            logging::entry(logging::level::warning) << "Direct I/O is not available for " << filename
+                                                   << "; writing through the page cache" << std::endl;
+        }
+#endif
+        size_t numQueued = std::max(options.numBuffers, size_t(2)) - 1;
+        pWriteQueue = std::make_shared<AsyncWriteQueue>(fd, directFd, numQueued * options.bufferSize);
+      }
     }
 
-    //! Destructor. Closes the file (if open)
+    //! Destructor. Writes anything still queued and closes the file (if open)
     ~MemMapFileWriter() {
+      close();
+    }
 
-      if(fd!=-1)
-        close(fd);
+    //! Returns the back-end settings this writer was created with
+    const FileWriterOptions &getOptions() const {
+      return options;
     }
 
     //! Write a single item to the file at the current write location
     template<typename DataType>
     void write(const DataType & data) {
-      ::write(fd, &data, sizeof(data));
+      if (pWriteQueue != nullptr)
+        ::pwrite(fd, &data, sizeof(data), offset); // regions are written out of order, so don't rely on the position
+      else
+        ::write(fd, &data, sizeof(data));
       offset+=sizeof(data);
     }
 
@@ -176,7 +321,7 @@ namespace tools {
     //! Get a memory-mapped view of the file at the current write location, with the intention of writing n_elements
     template<typename DataType>
     auto getMemMap(size_t n_elements) {
-      auto region = MemMapRegion<DataType>(fd,offset,n_elements);
+      auto region = makeRegion<DataType>(offset, n_elements, true);
       offset+=n_elements*sizeof(DataType);
       region.onFinish([this]() {
         // leave file position as though we just finished writing this in a "normal" way
@@ -192,16 +337,7 @@ namespace tools {
     //! Get a memory-mapped view of the file for writing, and surround it with Fortran-style size blocks
     template<typename DataType>
     auto getMemMapFortran(size_t n_elements) {
-      size_t fieldSize = n_elements*sizeof(DataType);
-      int fortranFieldSize;
-
-      if(fieldSize>std::numeric_limits<int>::max()) {
-        fortranFieldSize = std::numeric_limits<int>::max(); // unclear what else to do
-        logging::entry(logging::warning) << "One of the output Fortran fields is too large for the file format." << std::endl;
-        logging::entry(logging::warning) << "Writing will proceed, but the resulting file may appear corrupt" << std::endl;
-        logging::entry(logging::warning) << "Try using gadget_num_files <n> to split your output into multiple files or try using a larger number of files <n>." << std::endl;
-      } else
-        fortranFieldSize = int(fieldSize);
+      int fortranFieldSize = getFortranFieldSize(n_elements*sizeof(DataType));
 
       write(fortranFieldSize);
       auto region = getMemMap<DataType>(n_elements);
@@ -212,6 +348,92 @@ namespace tools {
       return region;
     }
 
+    /*! \brief Get a memory-mapped view surrounded by Fortran-style size blocks, which can stay open while more is written
+     *
+     * Unlike getMemMapFortran, the closing size block is written straight away. Further blocks can therefore be
+     * appended to the file, and filled at the same time, before this region is released.
+     */
+    template<typename DataType>
+    auto getMemMapFortranLeavingOpen(size_t n_elements) {
+      int fortranFieldSize = getFortranFieldSize(n_elements*sizeof(DataType));
+
+      write(fortranFieldSize);
+      auto region = makeRegion<DataType>(offset, n_elements, true);
+      offset+=n_elements*sizeof(DataType);
+      write(fortranFieldSize);
+
+      return region;
+    }
+
+    /*! \brief Get a single view of n_records consecutive Fortran records of n_elements each
+     *
+     * The size blocks between the records are filled in. Record r starts at element r * getFortranRecordStride
+     * of the returned region, so that many records can be filled at once while creating only one map.
+     */
+    template<typename DataType>
+    auto getMemMapFortranRecords(size_t n_elements, size_t n_records) {
+      static_assert((2 * sizeof(int)) % sizeof(DataType) == 0,
+                    "Fortran size blocks must be a whole number of elements");
+      assert(n_records > 0);
+      int fortranFieldSize = getFortranFieldSize(n_elements*sizeof(DataType));
+      size_t stride = getFortranRecordStride<DataType>(n_elements);
+      size_t n_total = n_records * stride - (stride - n_elements);
+
+      write(fortranFieldSize);
+      auto region = makeRegion<DataType>(offset, n_total, true);
+      for (size_t r = 1; r < n_records; ++r) {
+        int markers[2] = {fortranFieldSize, fortranFieldSize};
+        ::memcpy(&region[r * stride - (stride - n_elements)], markers, sizeof(markers));
+      }
+      offset += n_total*sizeof(DataType);
+      write(fortranFieldSize);
+
+      return region;
+    }
+
+    //! Returns the distance, in elements, between the starts of consecutive records from getMemMapFortranRecords
+    template<typename DataType>
+    static size_t getFortranRecordStride(size_t n_elements) {
+      return n_elements + (2 * sizeof(int)) / sizeof(DataType);
+    }
+
+    /*! \brief Write the Fortran-style size blocks for n_elements, and return the file offset of the space between them
+     *
+     * The space can then be filled piece by piece with getMemMapAt, which keeps the memory in use small.
+     */
+    template<typename DataType>
+    size_t reserveFortran(size_t n_elements) {
+      int fortranFieldSize = getFortranFieldSize(n_elements*sizeof(DataType));
+
+      write(fortranFieldSize);
+      size_t start = offset;
+      offset += n_elements*sizeof(DataType);
+      if (pWriteQueue == nullptr)
+        ::lseek(fd, offset, SEEK_SET);
+      write(fortranFieldSize);
+
+      return start;
+    }
+
+    //! Get a region for n_elements at the given file offset, within space already reserved, without moving the write location
+    template<typename DataType>
+    auto getMemMapAt(size_t file_offset, size_t n_elements) {
+      assert(file_offset + n_elements*sizeof(DataType) <= offset);
+      return makeRegion<DataType>(file_offset, n_elements, false);
+    }
+
+  protected:
+    //! Returns the size marker to be written around a Fortran block of the given number of bytes
+    static int getFortranFieldSize(size_t fieldSize) {
+      if(fieldSize>std::numeric_limits<int>::max()) {
+        logging::entry(logging::warning) << "One of the output Fortran fields is too large for the file format." << std::endl;
+        logging::entry(logging::warning) << "Writing will proceed, but the resulting file may appear corrupt" << std::endl;
+        logging::entry(logging::warning) << "Try using gadget_num_files <n> to split your output into multiple files or try using a larger number of files <n>." << std::endl;
+        return std::numeric_limits<int>::max(); // unclear what else to do
+      }
+      return int(fieldSize);
+    }
+
   };
 }
 
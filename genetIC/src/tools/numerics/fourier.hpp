@@ -15,13 +15,25 @@
 
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
 
 #include "src/simulation/coordinate.hpp"
 #include "src/tools/data_types/complex.hpp"
 #include "src/tools/numerics/vectormath.hpp"
 #include "src/simulation/grid/grid.hpp"
 #include "src/simulation/field/field.hpp"
+#include "src/simulation/field/bricks.hpp"
 
 namespace tools {
   namespace numerics {
@@ -31,6 +43,7 @@ namespace tools {
     namespace fourier {
 
       bool fftwThreadsInitialised = false;
+      int maxFFTWThreads = 1; //!< Largest number of threads that any one transform may use (set by initialise)
 
       //! Initialises the FFTW threads if they haven't already been initialised
       void initialise() {
@@ -46,6 +59,7 @@ namespace tools {
           throw std::runtime_error("Cannot initialize FFTW threads");
 #ifndef _OPENMP
         fftw_plan_with_nthreads(FFTW_THREADS);
+        maxFFTWThreads = FFTW_THREADS;
   logging::entry() << "Note: " << FFTW_THREADS << " FFTW Threads were initialised" << std::endl;
 #else
         int numThreads = omp_get_max_threads();
@@ -59,6 +73,7 @@ namespace tools {
 #endif
 #endif
         fftw_plan_with_nthreads(numThreads);
+        maxFFTWThreads = numThreads;
         if(emitThreadLimitMessage) {
           logging::entry() << std::endl;
           logging::entry()  << "Limiting number of FFTW Threads to " << numThreads << ", because FFTW on Mac OS seems to become slow beyond this point."
@@ -80,6 +95,192 @@ namespace tools {
         fftwThreadsInitialised = true;
       }
 
+      /*! \brief Sets the number of threads used by plans created from now on
+
+          The FFTW planner is not thread-safe, so this and all plan creation and destruction must take place within
+          the fftwPlanner critical section.
+      */
+      void setFFTWThreadsForNewPlans(int nThreads) {
+#if defined(FFTW_THREADS) && !defined(USE_CUFFT)
+        fftw_plan_with_nthreads(nThreads);
+#endif
+      }
+
+      /*! \class FFTWThreadTable
+          \brief Chooses the number of threads for each transform according to the size of its grid.
+
+          Transforms of small grids do not scale to many threads, and can run slower with all of them than with a few.
+          The best number of threads for each grid size can be measured by calibrate, which times a forward and
+          reverse transform with 1, 2, 4, ... threads. The measurements are cached in a file so that later runs on the
+          same machine can reuse them. Sizes that have not been measured use all the available threads, unless a fixed
+          number of threads has been requested.
+      */
+      class FFTWThreadTable {
+      protected:
+        std::map<size_t, int> threadsForSize; //!< Best number of threads for grids of each size (cells on a side)
+        int fixedThreads = 0; //!< If non-zero, the number of threads used for every transform
+
+        //! Name of the precision of transforms on FloatType, as recorded in the calibration cache
+        template<typename FloatType>
+        static std::string getPrecisionName() {
+          return std::is_same<FloatType, float>::value ? "float" : "double";
+        }
+
+        //! Returns the fastest time for a forward and reverse transform, in FloatType precision, of a grid of the given size and thread count
+        template<typename FloatType>
+        static double timeTransform(size_t size, int nThreads) {
+          int res = static_cast<int>(size);
+          std::vector<FloatType> data(2 * size * size * (size / 2 + 1));
+          for (size_t i = 0; i < data.size(); ++i)
+            data[i] = FloatType(std::sin(double(i)));
+
+          // only one of each pair of plans will be used, according to the precision
+          fftw_plan forward = nullptr, reverse = nullptr;
+          fftwf_plan forwardFloat = nullptr, reverseFloat = nullptr;
+#pragma omp critical(fftwPlanner)
+          {
+            setFFTWThreadsForNewPlans(nThreads);
+            if constexpr (std::is_same<FloatType, float>::value) {
+              forwardFloat = fftwf_plan_dft_r2c_3d(res, res, res, data.data(),
+                                                   reinterpret_cast<fftwf_complex *>(data.data()), FFTW_ESTIMATE);
+              reverseFloat = fftwf_plan_dft_c2r_3d(res, res, res, reinterpret_cast<fftwf_complex *>(data.data()),
+                                                   data.data(), FFTW_ESTIMATE);
+            } else {
+              forward = fftw_plan_dft_r2c_3d(res, res, res, data.data(),
+                                             reinterpret_cast<fftw_complex *>(data.data()), FFTW_ESTIMATE);
+              reverse = fftw_plan_dft_c2r_3d(res, res, res, reinterpret_cast<fftw_complex *>(data.data()),
+                                             data.data(), FFTW_ESTIMATE);
+            }
+          }
+
+          double best = std::numeric_limits<double>::max();
+          for (int repeat = 0; repeat < 3; ++repeat) {
+            auto start = std::chrono::steady_clock::now();
+            if (forward != nullptr) {
+              fftw_execute(forward);
+              fftw_execute(reverse);
+            } else {
+              fftwf_execute(forwardFloat);
+              fftwf_execute(reverseFloat);
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+          }
+
+#pragma omp critical(fftwPlanner)
+          {
+            if (forward != nullptr) {
+              fftw_destroy_plan(forward);
+              fftw_destroy_plan(reverse);
+            } else {
+              fftwf_destroy_plan(forwardFloat);
+              fftwf_destroy_plan(reverseFloat);
+            }
+          }
+          return best;
+        }
+
+      public:
+        //! Grids larger than this are not calibrated, since their transforms scale well and timing them is costly
+        static constexpr size_t largestCalibratedSize = 256;
+
+        //! Uses the specified number of threads for every transform, or restores the table if nThreads is zero
+        void setFixedThreads(int nThreads) {
+          if (nThreads < 0)
+            throw std::runtime_error("The number of FFTW threads cannot be negative");
+          fixedThreads = nThreads;
+        }
+
+        //! Returns the number of threads to use for a transform of a grid of the given size
+        int getThreads(size_t size, int available) const {
+          if (fixedThreads > 0)
+            return std::min(fixedThreads, available);
+          auto entry = threadsForSize.find(size);
+          if (entry == threadsForSize.end())
+            return available;
+          return std::min(entry->second, available);
+        }
+
+        /*! \brief Fills in the table for the given grid sizes, reusing measurements cached in the specified file
+
+            Transforms are timed in FloatType precision, as used by the fields. Measurements are only reused if they
+            were made in the same precision with the same maximum number of threads. Any new measurements are added
+            to the file; lines in any other format are ignored.
+            \param sizes - numbers of cells on a side of the grids to be transformed
+            \param maxThreads - the largest number of threads to try
+            \param cacheFilename - file in which measurements are cached
+        */
+        template<typename FloatType>
+        void calibrate(const std::vector<size_t> &sizes, int maxThreads, const std::string &cacheFilename) {
+          using CacheKey = std::tuple<size_t, int, std::string>;
+          std::map<CacheKey, int> cache;
+          std::ifstream cacheIn(cacheFilename);
+          std::string line;
+          while (std::getline(cacheIn, line)) {
+            std::istringstream fields(line);
+            size_t cachedSize;
+            int cachedMaxThreads, cachedThreads;
+            std::string cachedPrecision;
+            if (fields >> cachedSize >> cachedMaxThreads >> cachedPrecision >> cachedThreads)
+              cache[CacheKey(cachedSize, cachedMaxThreads, cachedPrecision)] = cachedThreads;
+          }
+          cacheIn.close();
+
+          const std::string precision = getPrecisionName<FloatType>();
+          bool cacheChanged = false;
+          for (size_t size : sizes) {
+            if (size > largestCalibratedSize)
+              continue;
+
+            CacheKey key(size, maxThreads, precision);
+            if (cache.count(key) == 0) {
+              // Prefer fewer threads unless more are clearly faster, leaving threads free for concurrent work
+              int bestThreads = 1;
+              double bestTime = timeTransform<FloatType>(size, 1);
+              for (int nThreads = 2; nThreads < 2 * maxThreads; nThreads *= 2) {
+                nThreads = std::min(nThreads, maxThreads);
+                double time = timeTransform<FloatType>(size, nThreads);
+                if (time < 0.95 * bestTime) {
+                  bestTime = time;
+                  bestThreads = nThreads;
+                }
+              }
+              cache[key] = bestThreads;
+              cacheChanged = true;
+            }
+
+            threadsForSize[size] = cache[key];
+            logging::entry() << "FFTW transforms of " << size << "^3 grids will use " << threadsForSize[size]
+                             << " threads" << std::endl;
+          }
+
+          if (cacheChanged) {
+            std::ofstream cacheOut(cacheFilename);
+            if (!cacheOut)
+              throw std::runtime_error("Unable to write FFTW thread calibration to " + cacheFilename);
+            for (const auto &entry : cache)
+              cacheOut << std::get<0>(entry.first) << " " << std::get<1>(entry.first) << " "
+                       << std::get<2>(entry.first) << " " << entry.second << std::endl;
+          }
+        }
+      };
+
+      FFTWThreadTable fftwThreadTable; //!< Chooses the number of threads for each transform
+
+      /*! \brief Returns the number of threads with which a transform of a grid of the given size, planned now, should run
+
+          This is looked up in fftwThreadTable, limited by the threads available. Within tools::forEachTaskConcurrently,
+          the threads available are the share given to the current task.
+      */
+      int getFFTWThreadsForNewPlan(size_t size) {
+#ifdef _OPENMP
+        int available = std::min(omp_get_max_threads(), maxFFTWThreads);
+#else
+        int available = maxFFTWThreads;
+#endif
+        return fftwThreadTable.getThreads(size, available);
+      }
+
       /*! \class FieldFourierManagerBase
           \brief Class that handles all operations to do with Fourier transforms used by the code.
       */
@@ -106,6 +307,11 @@ namespace tools {
             nyquistIfEvenElseZero = 0;
         }
 
+        //! Returns the field for reading only, so that data it shares with copies of itself is not copied
+        const fields::Field<DataType, CoordinateType> &getFieldForReading() const {
+          return field;
+        }
+
         //! Applies the callback function iteratively over a Fourier space field, summing up the result of the function over all cells
         ComplexType
         iterateFourierCellsWithAccumulation(const std::function<ComplexType(int, int, int)> &callback) const {
@@ -164,6 +370,9 @@ namespace tools {
 
       public:
 
+        //! True if performTransform can read and write brick-tiled real-space data directly (see Field::toBricked)
+        static constexpr bool supportsBrickedLayout = false;
+
         //! Destructor
         virtual ~FieldFourierManagerBase() {
 
@@ -295,6 +504,8 @@ namespace tools {
         fftw_plan reversePlan; //!< Method used for going from Fourier space to real space, if T is double
         fftwf_plan forwardPlanFloat; //!< Method used for going from real space to Fourier space, if T is float
         fftwf_plan reversePlanFloat; //!< Method used for going from Fourier space to real space, if T is float
+        int planThreads; //!< Number of threads with which the existing plans run
+        const void *planData; //!< Address of the field data for which the existing plans were made
 
         //! Re-organises the wave-numbers to lie in the positive quadrant, and returns to a linear index (and whether we conjugated the field)
         auto getRealCoeffLocationAndConjugation(int kx, int ky, int kz) const {
@@ -313,7 +524,7 @@ namespace tools {
           }
           size_t logical_index = kz + compressed_size * ky + compressed_size * size_t(size * kx);
           size_t index_re = 2 * logical_index;
-          assert(index_re + 1 < this->field.getDataVector().size());
+          assert(index_re + 1 < this->getFieldForReading().getDataVector().size());
 
           return std::make_tuple(conjugate, index_re);
         }
@@ -332,6 +543,7 @@ namespace tools {
 
 
           bool unused;
+          auto &data = this->field.getDataVector();
 
 #pragma omp parallel for
           for (int kx = 0; kx < size / 2 + 1; ++kx) {
@@ -343,15 +555,15 @@ namespace tools {
             for (int ky = size / 2; ky > -size / 2; --ky) {
               std::tie(unused, loc_source) = getRealCoeffLocationAndConjugation(kx, ky, 0);
               std::tie(unused, loc_dest) = getRealCoeffLocationAndConjugation(-kx, -ky, 0);
-              this->field[loc_dest] = this->field[loc_source];
-              this->field[loc_dest + 1] = -this->field[loc_source + 1];
+              data[loc_dest] = data[loc_source];
+              data[loc_dest + 1] = -data[loc_source + 1];
 
               // on an odd-sized grid, the following is a null op. On an even sized-grid, it sorts out the kz
               // nyquist mode.
               std::tie(unused, loc_source) = getRealCoeffLocationAndConjugation(kx, ky, this->nyquistIfEvenElseZero);
               std::tie(unused, loc_dest) = getRealCoeffLocationAndConjugation(-kx, -ky, this->nyquistIfEvenElseZero);
-              this->field[loc_dest] = this->field[loc_source];
-              this->field[loc_dest + 1] = -this->field[loc_source + 1];
+              data[loc_dest] = data[loc_source];
+              data[loc_dest + 1] = -data[loc_source + 1];
             }
           }
         }
@@ -385,6 +597,20 @@ namespace tools {
 
         }
 
+        //! As padForFFTWRealTransform, but starting from real-space data in brick-tiled order
+        void padFromBricksForFFTWRealTransform() {
+          auto &data = this->field.getDataVector();
+          std::vector<T> bricks(data.begin(), data.begin() + this->grid.size3);
+          fields::BrickLayout(this->grid.size).copyFromBricks(bricks.data(), data.data(), 2 * compressed_size);
+        }
+
+        //! As unpadAfterFFTWRealTransform, but leaving the real-space data in brick-tiled order
+        void unpadToBricksAfterFFTWRealTransform() {
+          auto &data = this->field.getDataVector();
+          std::vector<T> rows(data.begin(), data.begin() + getRequiredDataSize());
+          fields::BrickLayout(this->grid.size).copyToBricks(rows.data(), 2 * compressed_size, data.data());
+        }
+
         //! Reverse transformation of padForFFTWRealTransform
         void unpadAfterFFTWRealTransform() {
 
@@ -405,6 +631,8 @@ namespace tools {
         }
 
       public:
+        static constexpr bool supportsBrickedLayout = true;
+
         //! Constructor from a real field
         FieldFourierManager(fields::Field<T, T> &field) : FieldFourierManagerBase<T, T>(field) {
           size = static_cast<int>(this->grid.size);
@@ -413,26 +641,13 @@ namespace tools {
           reversePlan = nullptr;
           forwardPlanFloat = nullptr;
           reversePlanFloat = nullptr;
+          planThreads = 0;
+          planData = nullptr;
         }
 
         //! Destructor
         virtual ~FieldFourierManager() {
-          if (forwardPlan != nullptr) {
-            fftw_destroy_plan(forwardPlan);
-            forwardPlan = nullptr;
-          }
-          if (reversePlan != nullptr) {
-            fftw_destroy_plan(reversePlan);
-            reversePlan = nullptr;
-          }
-          if (forwardPlanFloat != nullptr) {
-            fftwf_destroy_plan(forwardPlanFloat);
-            forwardPlanFloat = nullptr;
-          }
-          if (reversePlanFloat != nullptr) {
-            fftwf_destroy_plan(reversePlanFloat);
-            reversePlanFloat = nullptr;
-          }
+          destroyPlans();
         }
 
         //! Sets the specified Fourier coefficient to val (accounting for mirrored Fourier modes as real field)
@@ -447,8 +662,9 @@ namespace tools {
 
           if (conj) imag = -imag;
 
-          this->field[index_re] = re;
-          this->field[index_re + 1] = imag;
+          auto &data = this->field.getDataVector();
+          data[index_re] = re;
+          data[index_re + 1] = imag;
 
         }
 
@@ -459,8 +675,9 @@ namespace tools {
 
           std::tie(conj, index_re) = getRealCoeffLocationAndConjugation(kx, ky, kz);
 
-          T re = this->field[index_re];
-          T im = this->field[index_re + 1];
+          const auto &data = this->getFieldForReading().getDataVector();
+          T re = data[index_re];
+          T im = data[index_re + 1];
           if (conj)
             im = -im;
           return std::complex<T>(re, im);
@@ -475,8 +692,13 @@ namespace tools {
             this->field.getGrid().size / 2 + 1);
         }
 
-        //! Performs the Fourier transform, interfacing with FFTW
-        void performTransform() {
+        /*! \brief Performs the Fourier transform, interfacing with FFTW
+
+            Real-space data in brick-tiled order (see Field::toBricked) is transformed directly. If toBricks is true,
+            a transform to real space leaves the data in brick-tiled order; the caller is responsible for marking the
+            field as bricked.
+        */
+        void performTransform(bool toBricks = false) {
           auto &fieldData = this->field.getDataVector();
 
           initialise();
@@ -492,7 +714,10 @@ namespace tools {
           std::tie(plan, planFloat) = getFFTWPlan(transformToFourier);
 
           if(transformToFourier) {
-            padForFFTWRealTransform();
+            if (this->field.isBricked())
+              padFromBricksForFFTWRealTransform();
+            else
+              padForFFTWRealTransform();
           } else {
             ensureFourierModesAreMirrored();
           }
@@ -506,7 +731,10 @@ namespace tools {
 
 
           if (!transformToFourier) {
-            unpadAfterFFTWRealTransform();
+            if (toBricks)
+              unpadToBricksAfterFFTWRealTransform();
+            else
+              unpadAfterFFTWRealTransform();
           }
 
           using tools::numerics::operator/=;
@@ -518,11 +746,59 @@ namespace tools {
         }
 
       private:
+        //! Destroys any existing plans
+        void destroyPlans() {
+#pragma omp critical(fftwPlanner)
+          {
+            if (forwardPlan != nullptr) {
+              fftw_destroy_plan(forwardPlan);
+              forwardPlan = nullptr;
+            }
+            if (reversePlan != nullptr) {
+              fftw_destroy_plan(reversePlan);
+              reversePlan = nullptr;
+            }
+            if (forwardPlanFloat != nullptr) {
+              fftwf_destroy_plan(forwardPlanFloat);
+              forwardPlanFloat = nullptr;
+            }
+            if (reversePlanFloat != nullptr) {
+              fftwf_destroy_plan(reversePlanFloat);
+              reversePlanFloat = nullptr;
+            }
+          }
+        }
+
+        /*! \brief Returns the plan for the transform in the specified direction
+
+            The plans are remade if the number of threads has changed, or if the field's data has moved (for example
+            because it was shared with a copy of the field until now; see Field::getDataVector).
+        */
         auto getFFTWPlan(bool transformToFourier) {
+          int threads = getFFTWThreadsForNewPlan(this->field.getGrid().size);
+          const void *data = this->field.getDataVector().data();
+          if (threads != planThreads || data != planData) {
+            destroyPlans();
+            planThreads = threads;
+            planData = data;
+          }
+#pragma omp critical(fftwPlanner)
+          {
+            setFFTWThreadsForNewPlans(threads);
+            makeFFTWPlan(transformToFourier);
+          }
+
+          // one, but only one, of these will be nullptr
+          if (transformToFourier)
+            return std::make_pair(forwardPlan, forwardPlanFloat);
+          else
+            return std::make_pair(reversePlan, reversePlanFloat);
+        }
+
+        //! Creates the plan for the transform in the specified direction, if it does not already exist
+        void makeFFTWPlan(bool transformToFourier) {
           auto &fieldData = this->field.getDataVector();
           int res = static_cast<int>(this->field.getGrid().size);
-          fftw_plan plan(nullptr);
-          fftwf_plan planFloat(nullptr);
 
           if (transformToFourier) {
             if (forwardPlan == nullptr && forwardPlanFloat == nullptr) {
@@ -536,11 +812,6 @@ namespace tools {
                                                          FFTW_ESTIMATE);
               }
             }
-
-            // one, but only one, of these will be nullptr
-            plan = forwardPlan;
-            planFloat = forwardPlanFloat;
-
           } else {
             if(reversePlan == nullptr && reversePlanFloat == nullptr) {
               if(std::is_same<T,double>::value) {
@@ -555,11 +826,7 @@ namespace tools {
                                                          FFTW_ESTIMATE);
               }
             }
-            // one, but only one, of these will be nullptr
-            plan = reversePlan;
-            planFloat = reversePlanFloat;
           }
-          return std::make_pair(plan, planFloat);
         }
 
 
@@ -587,7 +854,7 @@ namespace tools {
 
         //! Returns the specified Fourier coefficient
         std::complex<T> getFourierCoefficient(int kx, int ky, int kz) const {
-          return this->field[this->grid.getIndexFromCoordinate(Coordinate<int>(kx, ky, kz))];
+          return this->getFieldForReading()[this->grid.getIndexFromCoordinate(Coordinate<int>(kx, ky, kz))];
         }
 
         //! Returns space required to store Fourier information (always the size of the full grid for Fourier transforms of complex fields)
@@ -606,21 +873,20 @@ namespace tools {
 
           int res = static_cast<int>(this->field.getGrid().size);
           double norm = pow(static_cast<double>(res), 1.5);
+          int threads = getFFTWThreadsForNewPlan(this->field.getGrid().size);
 
-          if (!this->field.isFourier())
-            plan = fftw_plan_dft_3d(res, res, res,
-                                    reinterpret_cast<fftw_complex *>(&fieldData[0]),
-                                    reinterpret_cast<fftw_complex *>(&fieldData[0]),
-                                    FFTW_FORWARD, FFTW_ESTIMATE);
-
-          else
+#pragma omp critical(fftwPlanner)
+          {
+            setFFTWThreadsForNewPlans(threads);
             plan = fftw_plan_dft_3d(res, res, res,
                                     reinterpret_cast<fftw_complex *>(&fieldData[0]),
                                     reinterpret_cast<fftw_complex *>(&fieldData[0]),
-                                    FFTW_BACKWARD, FFTW_ESTIMATE);
-
+                                    this->field.isFourier() ? FFTW_BACKWARD : FFTW_FORWARD, FFTW_ESTIMATE);
+          }
 
           fftw_execute(plan);
+
+#pragma omp critical(fftwPlanner)
           fftw_destroy_plan(plan);
 
           using tools::numerics::operator/=;
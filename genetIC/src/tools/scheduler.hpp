@@ -0,0 +1,106 @@
+#ifndef IC_SCHEDULER_HPP
+#define IC_SCHEDULER_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+#include <numeric>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace tools {
+
+  /*! \brief Divides a number of threads between tasks in proportion to their costs, giving each task at least one
+      \param costs - relative cost of each task
+      \param nThreads - number of threads available, which must be at least the number of tasks
+  */
+  std::vector<int> shareThreadsByCost(const std::vector<double> &costs, int nThreads) {
+    const size_t nTasks = costs.size();
+    std::vector<int> threads(nTasks, 1);
+    double totalCost = std::accumulate(costs.begin(), costs.end(), 0.0);
+    int spare = nThreads - int(nTasks);
+    if (spare <= 0 || totalCost <= 0)
+      return threads;
+
+    // Hand out the spare threads by their whole-number share, then by the largest remainders
+    std::vector<double> remainders(nTasks);
+    int allocated = 0;
+    for (size_t i = 0; i < nTasks; ++i) {
+      double share = spare * costs[i] / totalCost;
+      int whole = int(std::floor(share));
+      threads[i] += whole;
+      allocated += whole;
+      remainders[i] = share - whole;
+    }
+
+    std::vector<size_t> order(nTasks);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&remainders](size_t a, size_t b) { return remainders[a] > remainders[b]; });
+    for (size_t i = 0; allocated < spare; ++i, ++allocated)
+      threads[order[i % nTasks]] += 1;
+
+    return threads;
+  }
+
+  /*! \brief Runs callback(i) for each independent task i, concurrently where possible
+
+      The OpenMP threads are shared between the tasks in proportion to their cost, and each task sees its share as
+      the number of threads available to its own parallel regions (and so to any Fourier transforms it plans; see
+      fourier::getFFTWThreadsForNewPlan). This allows small tasks, which do not scale to many threads, to run alongside
+      large ones rather than one after another.
+
+      The tasks run in series, each with all the threads, if there are fewer threads than tasks or if called from
+      within a parallel region. Any exception thrown by a task is rethrown once all the tasks have finished.
+
+      \param costs - relative cost of each task
+      \param callback - function taking the index of the task to run
+  */
+  template<typename Callback>
+  void forEachTaskConcurrently(const std::vector<double> &costs, const Callback &callback) {
+    const size_t nTasks = costs.size();
+
+#ifdef _OPENMP
+    int nThreads = omp_get_max_threads();
+    if (nTasks > 1 && size_t(nThreads) >= nTasks && !omp_in_parallel()) {
+      std::vector<int> threads = shareThreadsByCost(costs, nThreads);
+
+      // Start the most expensive tasks first, in case fewer threads are available than requested
+      std::vector<size_t> order(nTasks);
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+      std::exception_ptr exception;
+      int previousMaxActiveLevels = omp_get_max_active_levels();
+      omp_set_max_active_levels(std::max(previousMaxActiveLevels, 2));
+
+#pragma omp parallel for schedule(dynamic, 1) num_threads(int(nTasks))
+      for (size_t i = 0; i < nTasks; ++i) {
+        size_t task = order[i];
+        omp_set_num_threads(threads[task]);
+        try {
+          callback(task);
+        } catch (...) {
+#pragma omp critical(forEachTaskConcurrentlyException)
+          if (!exception)
+            exception = std::current_exception();
+        }
+      }
+
+      omp_set_max_active_levels(previousMaxActiveLevels);
+      if (exception)
+        std::rethrow_exception(exception);
+      return;
+    }
+#endif
+
+    for (size_t task = 0; task < nTasks; ++task)
+      callback(task);
+  }
+
+}
+
+#endif
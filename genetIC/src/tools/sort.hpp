@@ -0,0 +1,258 @@
+#ifndef IC_SORT_HPP
+#define IC_SORT_HPP
+
+#include <omp.h>
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+namespace tools {
+
+  /*! \namespace tools::sort
+      \brief Parallel sorting of the index arrays (flagged cells, particle IDs) used throughout the code.
+
+      The arrays are unsigned integers bounded by the size of a grid, so they are sorted with a least significant
+      digit radix sort. Only as many digits as are needed for the largest key are processed. Each pass builds
+      per-thread histograms of its digit over a static block of the input, then scatters each block to its place in
+      the output. Small arrays go to std::sort, where the overhead of threading would dominate.
+  */
+  namespace sort {
+
+    //! Bits of the key processed by each radix pass
+    constexpr unsigned int radixBits = 11;
+
+    //! Number of buckets in each radix pass
+    constexpr size_t radixBuckets = size_t(1) << radixBits;
+
+    //! Arrays shorter than this are sorted with std::sort
+    constexpr size_t radixThreshold = 1 << 16;
+
+    //! Returns the largest value in the array, or zero if it is empty
+    template<typename T>
+    T parallelMax(const std::vector<T> &keys) {
+      T maxKey = 0;
+#pragma omp parallel for reduction(max:maxKey)
+      for (size_t i = 0; i < keys.size(); ++i)
+        maxKey = std::max(maxKey, keys[i]);
+      return maxKey;
+    }
+
+    //! Number of radix passes needed to sort keys no larger than maxKey
+    template<typename T>
+    unsigned int numPasses(T maxKey) {
+      unsigned int passes = 0;
+      while (maxKey > 0) {
+        maxKey = T(maxKey >> radixBits);
+        ++passes;
+      }
+      return passes;
+    }
+
+    /*! \brief Stable radix sort of keys, carrying values along with them when Value is not void.
+
+        \param keys - keys to sort; replaced by the sorted keys
+        \param values - values to permute in the same way as the keys (ignored if the pointer is null)
+        \param maxKey - upper bound on the keys, which sets the number of passes
+    */
+    template<typename T, typename Value>
+    void radixSort(std::vector<T> &keys, std::vector<Value> *values, T maxKey) {
+      static_assert(std::is_integral<T>::value && std::is_unsigned<T>::value,
+                    "Radix sort is only implemented for unsigned integer keys");
+      const size_t n = keys.size();
+      const unsigned int passes = numPasses(maxKey);
+      if (passes == 0)
+        return;
+
+      std::vector<T> keysScratch(n);
+      std::vector<Value> valuesScratch(values == nullptr ? 0 : n);
+      std::vector<size_t> histograms;
+
+#pragma omp parallel
+      {
+        const size_t nThreads = static_cast<size_t>(omp_get_num_threads());
+        const size_t thread = static_cast<size_t>(omp_get_thread_num());
+        const size_t blockStart = n * thread / nThreads;
+        const size_t blockEnd = n * (thread + 1) / nThreads;
+
+#pragma omp single
+        histograms.resize(radixBuckets * nThreads);
+
+        for (unsigned int pass = 0; pass < passes; ++pass) {
+          const unsigned int shift = pass * radixBits;
+          const std::vector<T> &sourceKeys = (pass % 2 == 0) ? keys : keysScratch;
+          std::vector<T> &targetKeys = (pass % 2 == 0) ? keysScratch : keys;
+
+          size_t *histogram = histograms.data() + thread * radixBuckets;
+          std::fill(histogram, histogram + radixBuckets, 0);
+          for (size_t i = blockStart; i < blockEnd; ++i)
+            ++histogram[(sourceKeys[i] >> shift) & (radixBuckets - 1)];
+
+#pragma omp barrier
+#pragma omp single
+          {
+            // Convert counts to output offsets, ordered by bucket and then by thread to keep the sort stable
+            size_t offset = 0;
+            for (size_t bucket = 0; bucket < radixBuckets; ++bucket) {
+              for (size_t t = 0; t < nThreads; ++t) {
+                size_t count = histograms[t * radixBuckets + bucket];
+                histograms[t * radixBuckets + bucket] = offset;
+                offset += count;
+              }
+            }
+          }
+
+          if (values == nullptr) {
+            for (size_t i = blockStart; i < blockEnd; ++i)
+              targetKeys[histogram[(sourceKeys[i] >> shift) & (radixBuckets - 1)]++] = sourceKeys[i];
+          } else {
+            const std::vector<Value> &sourceValues = (pass % 2 == 0) ? *values : valuesScratch;
+            std::vector<Value> &targetValues = (pass % 2 == 0) ? valuesScratch : *values;
+            for (size_t i = blockStart; i < blockEnd; ++i) {
+              size_t destination = histogram[(sourceKeys[i] >> shift) & (radixBuckets - 1)]++;
+              targetKeys[destination] = sourceKeys[i];
+              targetValues[destination] = sourceValues[i];
+            }
+          }
+#pragma omp barrier
+        }
+      }
+
+      if (passes % 2 == 1) {
+        keys.swap(keysScratch);
+        if (values != nullptr)
+          values->swap(valuesScratch);
+      }
+    }
+
+    /*! \brief Removes adjacent duplicates from a sorted array, in parallel.
+
+        Each thread counts the first-of-a-run entries in its block; the counts give each block's place in the
+        compacted output.
+    */
+    template<typename T>
+    void parallelUniqueSorted(std::vector<T> &keys) {
+      const size_t n = keys.size();
+      if (n < radixThreshold) {
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        return;
+      }
+
+      std::vector<T> output;
+      std::vector<size_t> blockOffsets;
+
+#pragma omp parallel
+      {
+        const size_t nThreads = static_cast<size_t>(omp_get_num_threads());
+        const size_t thread = static_cast<size_t>(omp_get_thread_num());
+        const size_t blockStart = n * thread / nThreads;
+        const size_t blockEnd = n * (thread + 1) / nThreads;
+
+#pragma omp single
+        blockOffsets.resize(nThreads + 1, 0);
+
+        size_t count = 0;
+        for (size_t i = blockStart; i < blockEnd; ++i)
+          if (i == 0 || keys[i] != keys[i - 1]) ++count;
+        blockOffsets[thread + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+        {
+          for (size_t t = 0; t < nThreads; ++t)
+            blockOffsets[t + 1] += blockOffsets[t];
+          output.resize(blockOffsets[nThreads]);
+        }
+
+        size_t destination = blockOffsets[thread];
+        for (size_t i = blockStart; i < blockEnd; ++i)
+          if (i == 0 || keys[i] != keys[i - 1]) output[destination++] = keys[i];
+      }
+
+      keys.swap(output);
+    }
+
+  }
+
+  /*! \brief Appends offset + k to output for every k at which mask[k] is non-zero, in ascending order.
+
+      Each thread counts the selected entries in a static block, and the counts give each block's place in the output.
+  */
+  template<typename MaskType>
+  void appendSelectedIndices(const std::vector<MaskType> &mask, size_t offset, std::vector<size_t> &output) {
+    const size_t n = mask.size();
+    const size_t initialSize = output.size();
+    std::vector<size_t> blockOffsets;
+
+#pragma omp parallel
+    {
+      const size_t nThreads = static_cast<size_t>(omp_get_num_threads());
+      const size_t thread = static_cast<size_t>(omp_get_thread_num());
+      const size_t blockStart = n * thread / nThreads;
+      const size_t blockEnd = n * (thread + 1) / nThreads;
+
+#pragma omp single
+      blockOffsets.resize(nThreads + 1, 0);
+
+      size_t count = 0;
+      for (size_t k = blockStart; k < blockEnd; ++k)
+        if (mask[k]) ++count;
+      blockOffsets[thread + 1] = count;
+
+#pragma omp barrier
+#pragma omp single
+      {
+        blockOffsets[0] = initialSize;
+        for (size_t t = 0; t < nThreads; ++t)
+          blockOffsets[t + 1] += blockOffsets[t];
+        output.resize(blockOffsets[nThreads]);
+      }
+
+      size_t destination = blockOffsets[thread];
+      for (size_t k = blockStart; k < blockEnd; ++k)
+        if (mask[k]) output[destination++] = offset + k;
+    }
+  }
+
+  //! Sorts an array of unsigned integers (e.g. cell or particle IDs) in ascending order, in parallel
+  template<typename T>
+  void parallelSort(std::vector<T> &keys) {
+    if (keys.size() < sort::radixThreshold) {
+      std::sort(keys.begin(), keys.end());
+      return;
+    }
+    sort::radixSort<T, T>(keys, nullptr, sort::parallelMax(keys));
+  }
+
+  /*! \brief Returns the indices that would sort the given unsigned integer array, computed in parallel.
+
+      Equal keys keep their original order.
+  */
+  template<typename T>
+  std::vector<size_t> parallelArgsort(const std::vector<T> &keys) {
+    std::vector<size_t> indices(keys.size());
+#pragma omp parallel for
+    for (size_t i = 0; i < indices.size(); ++i)
+      indices[i] = i;
+
+    if (keys.size() < sort::radixThreshold) {
+      std::stable_sort(indices.begin(), indices.end(),
+                       [&keys](size_t i1, size_t i2) { return keys[i1] < keys[i2]; });
+      return indices;
+    }
+
+    std::vector<T> sortedKeys(keys);
+    sort::radixSort(sortedKeys, &indices, sort::parallelMax(keys));
+    return indices;
+  }
+
+  //! Sorts an array of unsigned integers and removes duplicated entries, in parallel
+  template<typename T>
+  void parallelSortAndEraseDuplicate(std::vector<T> &keys) {
+    parallelSort(keys);
+    sort::parallelUniqueSorted(keys);
+  }
+
+}
+
+#endif
@@ -4,6 +4,8 @@
 #include <vector>
 #include <cmath>
 #include <stdexcept>
+#include <type_traits>
+#include "src/tools/sort.hpp"
 /*!
     \namespace tools
     \brief Defines useful functions and tools used throughout the code
@@ -11,8 +13,11 @@
  */
 namespace tools {
   //! Argsort function from http://stackoverflow.com/questions/1577475/c-sorting-and-keeping-track-of-indexes
+  //! Unsigned integer arrays (e.g. particle IDs) are sorted in parallel by parallelArgsort instead.
   template<typename T>
   std::vector<size_t> argsort(const std::vector<T> &v) {
+    if constexpr (std::is_integral<T>::value && std::is_unsigned<T>::value)
+      return parallelArgsort(v);
 
     // initialize original index locations
     std::vector<size_t> idx(v.size());
@@ -94,8 +99,12 @@ namespace tools {
   //! Sorts a vector and removes any duplicated entries (used for sorting lists of flagged cells)
   template<typename T>
   void sortAndEraseDuplicate( std::vector<T> & vector){
-    std::sort(vector.begin(), vector.end());
-    vector.erase(std::unique(vector.begin(), vector.end()), vector.end());
+    if constexpr (std::is_integral<T>::value && std::is_unsigned<T>::value) {
+      parallelSortAndEraseDuplicate(vector);
+    } else {
+      std::sort(vector.begin(), vector.end());
+      vector.erase(std::unique(vector.begin(), vector.end()), vector.end());
+    }
   }
 
 
@@ -0,0 +1,184 @@
+//
+// A queue of buffers to be written to a file from a dedicated I/O thread
+//
+
+#ifndef IC_WRITEQUEUE_HPP
+#define IC_WRITEQUEUE_HPP
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+#include <cstdlib>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace tools {
+
+  /*! \class AsyncWriteQueue
+      \brief Writes buffers to a file from a dedicated I/O thread, so that output can overlap with computation.
+
+      Buffers are handed over with submit, which only blocks if more than maxQueuedBytes are already waiting to be
+      written; the queue then owns the buffer, which must have been obtained from allocateBuffer.
+
+      Each buffer starts at a page-aligned position in the file. If a second file descriptor opened with O_DIRECT
+      is supplied, the whole pages in each buffer are written through it, bypassing the page cache, while any partial
+      pages at either end go through the ordinary descriptor.
+  */
+  class AsyncWriteQueue {
+  protected:
+    //! A buffer waiting to be written
+    struct Job {
+      char *buffer; //!< Start of the buffer, corresponding to position fileOffset in the file
+      size_t fileOffset; //!< Page-aligned position in the file of the start of the buffer
+      size_t begin; //!< First byte of the buffer to write
+      size_t end; //!< One past the last byte of the buffer to write
+    };
+
+    int fd; //!< Ordinary file descriptor
+    int directFd; //!< File descriptor opened with O_DIRECT, or -1 if not in use
+    size_t maxQueuedBytes; //!< Number of bytes that may be waiting before submit blocks
+    size_t queuedBytes = 0; //!< Number of bytes currently waiting or being written
+    std::deque<Job> jobs; //!< Buffers waiting or being written; the front one is in progress
+    bool finishing = false; //!< Set when the I/O thread should exit once the queue is empty
+    std::string error; //!< Description of the first failed write, if any
+
+    std::mutex mutex; //!< Protects all the above
+    std::condition_variable jobsChanged; //!< Signalled whenever a job is added or completed
+    std::thread thread; //!< The I/O thread
+
+    //! Write n bytes from the buffer at the given position in the file, returning a description of any failure
+    static std::string writeFully(int toFd, const char *buffer, size_t n, size_t fileOffset) {
+      while (n > 0) {
+        ssize_t written = ::pwrite(toFd, buffer, n, fileOffset);
+        if (written < 0) {
+          if (errno == EINTR) continue;
+          return "Failed to write output (reason: " + std::string(::strerror(errno)) + ")";
+        }
+        buffer += written;
+        fileOffset += written;
+        n -= written;
+      }
+      return "";
+    }
+
+    //! Write one job, returning a description of any failure
+    std::string writeJob(const Job &job) {
+      size_t page = getPageSize();
+      size_t directBegin = ((job.begin + page - 1) / page) * page;
+      size_t directEnd = (job.end / page) * page;
+
+      if (directFd == -1 || directBegin >= directEnd)
+        return writeFully(fd, job.buffer + job.begin, job.end - job.begin, job.fileOffset + job.begin);
+
+      std::string result = writeFully(fd, job.buffer + job.begin, directBegin - job.begin,
+                                      job.fileOffset + job.begin);
+      if (result.empty()) {
+        result = writeFully(directFd, job.buffer + directBegin, directEnd - directBegin,
+                            job.fileOffset + directBegin);
+        if (!result.empty()) {
+          // Not all filesystems support O_DIRECT; fall back to the page cache for the rest of the output
+          directFd = -1;
+          result = writeFully(fd, job.buffer + directBegin, directEnd - directBegin, job.fileOffset + directBegin);
+        }
+      }
+      if (result.empty())
+        result = writeFully(fd, job.buffer + directEnd, job.end - directEnd, job.fileOffset + directEnd);
+      return result;
+    }
+
+    //! Main loop of the I/O thread
+    void run() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        jobsChanged.wait(lock, [this]() { return !jobs.empty() || finishing; });
+        if (jobs.empty())
+          return;
+
+        Job job = jobs.front();
+        lock.unlock();
+        std::string jobError = writeJob(job);
+        std::free(job.buffer);
+        lock.lock();
+
+        jobs.pop_front();
+        queuedBytes -= job.end - job.begin;
+        if (error.empty())
+          error = jobError;
+        jobsChanged.notify_all();
+      }
+    }
+
+  public:
+    /*! \brief Start the I/O thread for the given file
+        \param fd - file descriptor to write through
+        \param directFd - file descriptor for the same file opened with O_DIRECT, or -1
+        \param maxQueuedBytes - number of bytes that may be waiting to be written before submit blocks
+    */
+    AsyncWriteQueue(int fd, int directFd, size_t maxQueuedBytes) :
+      fd(fd), directFd(directFd), maxQueuedBytes(maxQueuedBytes) {
+      thread = std::thread([this]() { this->run(); });
+    }
+
+    //! Write everything that is still queued, then stop the I/O thread
+    ~AsyncWriteQueue() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        finishing = true;
+      }
+      jobsChanged.notify_all();
+      thread.join();
+    }
+
+    AsyncWriteQueue(const AsyncWriteQueue &) = delete;
+
+    AsyncWriteQueue &operator=(const AsyncWriteQueue &) = delete;
+
+    //! Returns the alignment used for buffers and O_DIRECT writes
+    static size_t getPageSize() {
+      return static_cast<size_t>(::getpagesize());
+    }
+
+    /*! \brief Allocate a page-aligned buffer of at least the given size, suitable for passing to submit
+     *
+     * The buffer is zeroed, so that anything the caller leaves unset reads back as it would from a freshly extended
+     * file, matching the memory-mapped back-end.
+     */
+    static char *allocateBuffer(size_t size) {
+      size_t page = getPageSize();
+      size_t alignedSize = std::max(page, ((size + page - 1) / page) * page);
+      char *buffer = static_cast<char *>(std::aligned_alloc(page, alignedSize));
+      if (buffer == nullptr)
+        throw std::runtime_error("Failed to allocate an output buffer");
+      ::memset(buffer, 0, alignedSize);
+      return buffer;
+    }
+
+    /*! \brief Queue bytes [begin, end) of a buffer to be written at position fileOffset + begin in the file
+        \param buffer - buffer from allocateBuffer; the queue frees it once written
+        \param fileOffset - page-aligned position in the file corresponding to the start of the buffer
+    */
+    void submit(char *buffer, size_t fileOffset, size_t begin, size_t end) {
+      size_t bytes = end - begin;
+      std::unique_lock<std::mutex> lock(mutex);
+      jobsChanged.wait(lock, [&]() { return queuedBytes == 0 || queuedBytes + bytes <= maxQueuedBytes; });
+      jobs.push_back({buffer, fileOffset, begin, end});
+      queuedBytes += bytes;
+      jobsChanged.notify_all();
+    }
+
+    //! Wait until everything submitted so far has been written. Throws if any write failed.
+    void waitUntilEmpty() {
+      std::unique_lock<std::mutex> lock(mutex);
+      jobsChanged.wait(lock, [this]() { return jobs.empty(); });
+      if (!error.empty())
+        throw std::runtime_error(error);
+    }
+  };
+}
+
+#endif //IC_WRITEQUEUE_HPP
@@ -7,6 +7,7 @@ Usage: compare.py path_to_output/
  * compares the particle output (path_to_output/*.gadget or path_to_output/*.tipsy) with path_to_output/reference_output
  * compares the grid output (path_to_output/grid-?.npy) with path_to_output/reference_grid
  * compares the power spectrum output (path_to_output/*.ps) with path_to_output/reference_ps/*.ps
+ * compares any shared memory output (named by path_to_output/*.shm) with the particle output, then removes it
 """
 
 
@@ -21,6 +22,7 @@ import os.path
 import warnings
 import re
 import platform
+import struct
 
 def infer_compare_decimal(sim):
     if sim['vel'].dtype==np.float64:
@@ -166,6 +168,74 @@ def compare_grafic(reference_path, test_path):
         assert (f1['iord']==f2['iord']).all()
         npt.assert_almost_equal(f1['deltab'],f2['deltab'],decimal=infer_compare_decimal(f1))
 
+# Layout of io::shm::ShmHeader (see src/io/shm.hpp): each field with its struct format and array length (or None)
+SHM_MAGIC = 0x734349746e656567
+SHM_VERSION = 1
+SHM_HEADER_LAYOUT = [('magic','Q',None), ('version','I',None), ('floatSize','I',None), ('segmentSize','Q',None),
+                     ('nTotal','Q',None), ('nPartPerType','Q',6), ('massTable','d',6), ('scaleFactor','d',None),
+                     ('boxSize','d',None), ('omega0','d',None), ('omegaLambda','d',None),
+                     ('omegaBaryons','d',None), ('hubbleParam','d',None), ('positionsOffset','Q',None),
+                     ('velocitiesOffset','Q',None), ('idsOffset','Q',None), ('massesOffset','Q',None),
+                     ('complete','I',None), ('reserved','I',None)]
+SHM_HEADER_FIELDS = [(name, count) for name, _, count in SHM_HEADER_LAYOUT]
+SHM_HEADER_FORMAT = '<' + ''.join(('' if count is None else str(count)) + fmt for _, fmt, count in SHM_HEADER_LAYOUT)
+
+def compare_shm(descriptor, particle_filename):
+    """Compare the particles in the shared memory segment named by descriptor with a particle file, then remove it"""
+    from multiprocessing import shared_memory
+
+    with open(descriptor) as f:
+        fields = dict(line.split() for line in f if line.strip())
+
+    # This must match io::shm::ShmHeader, whose size and version are checked below
+    assert int(fields['version'])==SHM_VERSION, "Shared memory layout version %s is not understood"%fields['version']
+    assert int(fields['header_bytes'])==struct.calcsize(SHM_HEADER_FORMAT), \
+        "Shared memory header size does not match the layout version"
+
+    segment = shared_memory.SharedMemory(name=fields['segment'].lstrip('/'))
+    try:
+        values = struct.unpack_from(SHM_HEADER_FORMAT, segment.buf, 0)
+        header = {}
+        for name, count in SHM_HEADER_FIELDS:
+            header[name] = values[0] if count is None else values[:count]
+            values = values[1 if count is None else count:]
+
+        assert header['magic']==SHM_MAGIC, "Shared memory segment is not a genetIC segment"
+        assert header['version']==SHM_VERSION
+        assert header['complete']==1, "Shared memory segment was not completely written"
+        float_size, n_total = header['floatSize'], header['nTotal']
+        n_per_type, mass_table = header['nPartPerType'], header['massTable']
+        pos_offset, vel_offset = header['positionsOffset'], header['velocitiesOffset']
+        id_offset, mass_offset = header['idsOffset'], header['massesOffset']
+
+        float_type = np.float32 if float_size==4 else np.float64
+        def get_array(dtype, count, offset):
+            return np.frombuffer(segment.buf, dtype, count, offset).copy()
+
+        pos = get_array(float_type, 3*n_total, pos_offset).reshape((n_total,3))
+        vel = get_array(float_type, 3*n_total, vel_offset).reshape((n_total,3))
+        ids = get_array(np.uint64, n_total, id_offset)
+        if mass_offset!=0:
+            mass = get_array(float_type, n_total, mass_offset)
+        else:
+            mass = np.repeat(mass_table, n_per_type)
+    finally:
+        segment.close()
+        segment.unlink()
+
+    f = pynbody.load(particle_filename)
+    assert len(f)==n_total
+
+    # pynbody may group the particles differently, so match them up by ID
+    order = np.argsort(ids)
+    f_order = np.argsort(f['iord'])
+    assert (ids[order]==f['iord'][f_order]).all()
+    compare_decimal = infer_compare_decimal(f)
+    npt.assert_almost_equal(pos[order], f['pos'][f_order], decimal=compare_decimal)
+    npt.assert_almost_equal(vel[order], f['vel'][f_order], decimal=compare_decimal)
+    npt.assert_almost_equal(mass[order], f['mass'][f_order], decimal=6)
+    print("Shared memory output matches")
+
 def check_comparison_is_possible(dirname):
     # A valid test must have either a tipsy/gadget output and its reference output or numpy grids and their references.
 
@@ -189,7 +259,8 @@ def check_comparison_is_possible(dirname):
 
     elif len(output_grafic)>0 and len(output_file)==0:
         pass # no specific tests implemented here
-    elif len(output_file)==1 and len(output_grafic)==0:
+    elif len(output_file)==1:
+        # grafic output may also be present if several output formats were requested
         if not os.path.isfile(sys.argv[1]+"/reference_output"):
             raise IOError("A particle output is present but there is no reference_output to test against.")
 
@@ -241,6 +312,11 @@ def default_comparisons():
     if len(output_file)>0 and os.path.exists(sys.argv[1]+"/reference_output"):
         compare(pynbody.load(output_file[0]),pynbody.load(sys.argv[1]+"/reference_output"))
 
+    for descriptor in glob.glob(sys.argv[1]+"/*.shm"):
+        if len(output_file)!=1:
+            raise IOError("Shared memory output can only be tested alongside a single particle output")
+        compare_shm(descriptor, output_file[0])
+
 if __name__=="__main__":
     warnings.simplefilter("ignore")
     if len(sys.argv)==2: